@@ -2,24 +2,57 @@
 
 extern crate alloc;
 
-use alloc::{vec::Vec, rc::Rc};
+use alloc::{boxed::Box, vec::Vec};
 
-use bbq_steno::{memdict::MemDict, dict::{Translator, TypeAction}, Stroke};
-use defmt::info;
+use bbq_steno::{memdict::MemDict, dict::{Dict as StenoDict, DictImpl, Translator, TypeAction}, Stroke};
+use defmt::{info, warn};
 
 use crate::Timable;
 
+/// Address of the main dictionary image.
+const MAIN_DICT: usize = 0x10200000;
+
+/// Address of the user dictionary, a separate image in the last 1MB of the
+/// 16MB flash.  It is built by `dict-convert --user`, and being small, is
+/// quick to program without touching the main image.  Erased flash there just
+/// means there is no user dictionary.
+pub const USER_DICT: usize = 0x10F00000;
+
+/// Slots in the RAM cache of the main dictionary, 16K.
+const CACHE_SLOTS: usize = 1024;
+
 pub struct Dict {
-    // The translation dictionary.
+    // The translation dictionary, with the user dictionary layered ahead of
+    // the main one.
     xlat: Option<Translator>,
 }
 
 impl Dict {
     pub fn new() -> Self {
         let xlat = unsafe {
-            MemDict::from_raw_ptr(0x10200000 as *const u8)
+            MemDict::from_raw_ptr(MAIN_DICT as *const u8)
         };
-        let xlat = xlat.map(|d| Translator::new(Rc::new(d)));
+        let user = unsafe { MemDict::from_raw_ptr(USER_DICT as *const u8) };
+        match &user {
+            Some(user) => info!("User dictionary: {} entries", user.len()),
+            None => info!("No user dictionary"),
+        }
+        // The translator holds onto the dictionaries for the life of the program.
+        let xlat = xlat.map(|d| {
+            if !d.compiled {
+                warn!("Dictionary definitions are not compiled, rebuild it with dict-convert");
+            }
+            if d.longest_key > Translator::HISTORY {
+                warn!("Dictionary has entries of {} strokes, only {} can be translated",
+                      d.longest_key, Translator::HISTORY);
+            }
+            let mut dicts: Vec<StenoDict> = Vec::new();
+            dicts.push(Box::leak(Box::new(d.with_cache(CACHE_SLOTS))));
+            if let Some(user) = user {
+                dicts.push(Box::leak(Box::new(user)));
+            }
+            Translator::with_dicts(&dicts)
+        });
         Dict {
             xlat,
         }
@@ -27,16 +60,22 @@ impl Dict {
 
     pub fn handle_stroke(&mut self, stroke: Stroke, timer: &dyn Timable) -> Vec<TypeAction> {
         let mut result = Vec::new();
+        self.each_action(stroke, timer, |action| result.push(action));
+        result
+    }
+
+    /// Translate a stroke, handing each resulting action to `f`, without
+    /// collecting them.
+    pub fn each_action<F: FnMut(TypeAction)>(&mut self, stroke: Stroke, timer: &dyn Timable, mut f: F) {
         if let Some(xlat) = self.xlat.as_mut() {
             let start = timer.get_ticks();
             xlat.add(stroke);
             let stop = timer.get_ticks();
             while let Some(action) = xlat.next_action() {
-                info!("Key: delete {}, type {} {}us", action.remove, action.text.len(),
+                info!("Key: delete {}, type {} {}us", action.remove, action.len(),
                 stop - start);
-                result.push(action);
+                f(action);
             }
         }
-        result
     }
 }
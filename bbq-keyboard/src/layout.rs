@@ -6,11 +6,14 @@
 
 use crate::log::info;
 
-use crate::{KeyEvent, EventQueue, Event};
+use crate::{KeyBatch, KeyEvent, EventQueue, Event};
+use bbq_steno::Stroke;
 
 use self::qwerty::QwertyManager;
 use self::steno::RawStenoHandler;
 
+pub use self::steno::Held;
+
 mod artsey;
 mod steno;
 mod qwerty;
@@ -85,11 +88,18 @@ impl LayoutManager {
         }
     }
 
-    // For now, just pass everything through.
-    pub fn tick(&mut self, events: &mut dyn EventQueue) {
-        self.raw.tick();
+    /// Tick the layouts.  A held steno stroke is returned, rather than being
+    /// queued, so the caller can make sure that the first send of it isn't
+    /// lost, and so that it goes in order with the other strokes.
+    pub fn tick(&mut self, events: &mut dyn EventQueue) -> Option<Held> {
+        let mode = self.mode.get();
+        let mut held = None;
+        if let LayoutMode::Steno | LayoutMode::StenoRaw = mode {
+            held = self.raw.tick().map(|held| Held { raw: mode == LayoutMode::StenoRaw, ..held });
+        }
         self.artsey.tick(events);
         self.qwerty.tick(events);
+        held
     }
 
     pub fn poll(&mut self) {
@@ -116,6 +126,43 @@ impl LayoutManager {
             }
         }
     }
+
+    /// Handle the key changes from a scan of either side's matrix.  In Steno
+    /// mode, a completed stroke is returned rather than being queued as an
+    /// event, so it can go directly to the translator.  Everything else is the same as
+    /// handling each key with `handle_event`.
+    pub fn handle_batch(&mut self, keys: KeyBatch, events: &mut dyn EventQueue) -> Option<Stroke> {
+        let mut steno = KeyBatch::default();
+        for event in keys.events() {
+            if !self.mode.event(event, events) {
+                continue;
+            }
+            match self.mode.get() {
+                LayoutMode::Steno | LayoutMode::StenoRaw => {
+                    let bit: u64 = 1 << event.key();
+                    if event.is_press() {
+                        steno.pressed |= bit;
+                    } else {
+                        steno.released |= bit;
+                    }
+                }
+                LayoutMode::Artsey => self.artsey.handle_event(event, events),
+                LayoutMode::Qwerty => self.qwerty.handle_event(event, events, false),
+                LayoutMode::NKRO => self.qwerty.handle_event(event, events, true),
+            }
+        }
+
+        if steno.is_empty() {
+            return None;
+        }
+        let stroke = self.raw.handle_batch(steno)?;
+        if self.mode.get() == LayoutMode::Steno {
+            Some(stroke)
+        } else {
+            events.push(Event::RawSteno(stroke));
+            None
+        }
+    }
 }
 
 /// The global keyboard mode.
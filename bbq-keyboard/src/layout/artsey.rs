@@ -56,7 +56,7 @@ pub struct ArtseyManager {
     hold_sent: bool,
 
     // Cached mapping table.
-    mapping: &'static[Entry],
+    mapping: &'static Chords,
 
     // Was the last key seen on the left or right side. The hold maps differ
     // between sides, so we need this to decide which map to use.
@@ -114,23 +114,36 @@ const FIRST_RIGHT_KEY: u8 = 16;
 #[cfg(feature = "proto3")]
 const FIRST_RIGHT_KEY: u8 = 24;
 
-static LEFT_HOLD_KEYS: [HoldEntry; 4] = [
+static LEFT_HOLD_KEYS: Holds = holds(&[
     HoldEntry { code: 0x80, mapping: &LEFT_BRACKET_MAP },
     HoldEntry { code: 0x10, mapping: &NUMBER_MAP },
     HoldEntry { code: 0x08, mapping: &LEFT_PUNCT_MAP },
     HoldEntry { code: 0x01, mapping: &NORMAL },
-];
+]);
 
-static RIGHT_HOLD_KEYS: [HoldEntry; 4] = [
+static RIGHT_HOLD_KEYS: Holds = holds(&[
     HoldEntry { code: 0x80, mapping: &RIGHT_BRACKET_MAP },
     HoldEntry { code: 0x10, mapping: &NUMBER_MAP },
     HoldEntry { code: 0x08, mapping: &RIGHT_PUNCT_MAP },
     HoldEntry { code: 0x01, mapping: &NORMAL },
-];
+]);
 
 struct HoldEntry {
     code: u8,
-    mapping: &'static [Entry],
+    mapping: &'static Chords,
+}
+
+/// The mapping to use for each hold key, indexed by its code.
+type Holds = [Option<&'static Chords>; 256];
+
+const fn holds(entries: &[HoldEntry]) -> Holds {
+    let mut table = [None; 256];
+    let mut i = 0;
+    while i < entries.len() {
+        table[entries[i].code as usize] = Some(entries[i].mapping);
+        i += 1;
+    }
+    table
 }
 
 // Mapping of proto2 keys to artsey bits.  Codes past this will result in zero.
@@ -213,6 +226,7 @@ static KEY_TO_ARTSEY: [u8; 43] = [
     0x08, // 42 - right E
 ];
 
+#[derive(Clone, Copy)]
 enum Value {
     Simple(Keyboard),
     Shifted(Keyboard),
@@ -229,8 +243,28 @@ struct Entry {
     value: Value,
 }
 
+/// A chord map, indexed directly by the code of the chord.  These are built
+/// from the entry lists at compile time, so resolving a chord is a single load.
+type Chords = [Value; 256];
+
+const fn chords(entries: &[Entry]) -> Chords {
+    let mut table = [Value::None; 256];
+    let mut i = 0;
+    while i < entries.len() {
+        let entry = &entries[i];
+        let mut j = 0;
+        while j < i {
+            assert!(entries[j].code != entry.code, "Duplicate chord in artsey map");
+            j += 1;
+        }
+        table[entry.code as usize] = entry.value;
+        i += 1;
+    }
+    table
+}
+
 // Normal Artsey mode map.
-static NORMAL: [Entry; 51] = [
+static NORMAL: Chords = chords(&[
     Entry { code: 0x80, value: Value::Simple(Keyboard::A), },
     Entry { code: 0x40, value: Value::Simple(Keyboard::R), },
     Entry { code: 0x20, value: Value::Simple(Keyboard::T), },
@@ -285,10 +319,10 @@ static NORMAL: [Entry; 51] = [
     Entry { code: 0x32, value: Value::Sticky(Mods::ALT), },
     Entry { code: 0xf8, value: Value::Sticky(Mods::SHIFT), },
     Entry { code: 0xcc, value: Value::Unstick, },
-];
+]);
 
 // The number Artsey mapping.
-static NUMBER_MAP: [Entry; 10] = [
+static NUMBER_MAP: Chords = chords(&[
     Entry { code: 0x80, value: Value::Simple(Keyboard::Keyboard1), },
     Entry { code: 0x40, value: Value::Simple(Keyboard::Keyboard2), },
     Entry { code: 0x20, value: Value::Simple(Keyboard::Keyboard3), },
@@ -299,31 +333,31 @@ static NUMBER_MAP: [Entry; 10] = [
     Entry { code: 0x60, value: Value::Simple(Keyboard::Keyboard8), },
     Entry { code: 0x0c, value: Value::Simple(Keyboard::Keyboard9), },
     Entry { code: 0x06, value: Value::Simple(Keyboard::Keyboard0), },
-];
+]);
 
 // The bracket Artsey mapping, for the right side of the keyboard
-static RIGHT_BRACKET_MAP: [Entry; 6] = [
+static RIGHT_BRACKET_MAP: Chords = chords(&[
     Entry { code: 0x40, value: Value::Shifted(Keyboard::Keyboard9), },
     Entry { code: 0x20, value: Value::Shifted(Keyboard::Keyboard0), },
     Entry { code: 0x10, value: Value::Shifted(Keyboard::LeftBrace), },
     Entry { code: 0x04, value: Value::Simple(Keyboard::LeftBrace), },
     Entry { code: 0x02, value: Value::Simple(Keyboard::RightBrace), },
     Entry { code: 0x01, value: Value::Shifted(Keyboard::RightBrace), },
-];
+]);
 
 // The bracket Artsey mapping, for the left side of the keyboard
 // The standard Artsey swaps the curly braces, even though they are positioned
 // vertically. I have not done this, because this doesn't make sense to me.
-static LEFT_BRACKET_MAP: [Entry; 6] = [
+static LEFT_BRACKET_MAP: Chords = chords(&[
     Entry { code: 0x20, value: Value::Shifted(Keyboard::Keyboard9), },
     Entry { code: 0x40, value: Value::Shifted(Keyboard::Keyboard0), },
     Entry { code: 0x10, value: Value::Shifted(Keyboard::LeftBrace), },
     Entry { code: 0x02, value: Value::Simple(Keyboard::LeftBrace), },
     Entry { code: 0x04, value: Value::Simple(Keyboard::RightBrace), },
     Entry { code: 0x01, value: Value::Shifted(Keyboard::RightBrace), },
-];
+]);
 
-static LEFT_PUNCT_MAP: [Entry; 11] = [
+static LEFT_PUNCT_MAP: Chords = chords(&[
     Entry { code: 0x80, value: Value::Shifted(Keyboard::Keyboard1), },
     Entry { code: 0x40, value: Value::Simple(Keyboard::Backslash), },
     Entry { code: 0x20, value: Value::Simple(Keyboard::Semicolon), },
@@ -337,9 +371,9 @@ static LEFT_PUNCT_MAP: [Entry; 11] = [
     Entry { code: 0x30, value: Value::Shifted(Keyboard::Comma), },
     Entry { code: 0x06, value: Value::Shifted(Keyboard::Semicolon), },
     Entry { code: 0x03, value: Value::Shifted(Keyboard::Keyboard3), },
-];
+]);
 
-static RIGHT_PUNCT_MAP: [Entry; 11] = [
+static RIGHT_PUNCT_MAP: Chords = chords(&[
     Entry { code: 0x80, value: Value::Shifted(Keyboard::Keyboard1), },
     Entry { code: 0x40, value: Value::Simple(Keyboard::Backslash), },
     Entry { code: 0x20, value: Value::Simple(Keyboard::Semicolon), },
@@ -353,11 +387,11 @@ static RIGHT_PUNCT_MAP: [Entry; 11] = [
     Entry { code: 0x30, value: Value::Shifted(Keyboard::Dot), },
     Entry { code: 0x06, value: Value::Shifted(Keyboard::Semicolon), },
     Entry { code: 0x03, value: Value::Shifted(Keyboard::Keyboard3), },
-];
+]);
 
 // Nav is the 8 nav buttons, the 4 one shot modifiers, shift lock, and the one
 // nav toggle key.
-static RIGHT_NAV_MAP: [Entry; 14] = [
+static RIGHT_NAV_MAP: Chords = chords(&[
     Entry { code: 0x80, value: Value::Simple(Keyboard::Home), },
     Entry { code: 0x40, value: Value::Simple(Keyboard::UpArrow), },
     Entry { code: 0x20, value: Value::Simple(Keyboard::End), },
@@ -374,11 +408,11 @@ static RIGHT_NAV_MAP: [Entry; 14] = [
     Entry { code: 0x44, value: Value::Lock(Mods::SHIFT), },
 
     Entry { code: 0x4a, value: Value::Nav, },
-];
+]);
 
 // Nav is the 8 nav buttons, the 4 one shot modifiers, shift lock, and the one
 // nav toggle key.
-static LEFT_NAV_MAP: [Entry; 14] = [
+static LEFT_NAV_MAP: Chords = chords(&[
     Entry { code: 0x80, value: Value::Simple(Keyboard::End), },
     Entry { code: 0x40, value: Value::Simple(Keyboard::UpArrow), },
     Entry { code: 0x20, value: Value::Simple(Keyboard::Home), },
@@ -395,7 +429,7 @@ static LEFT_NAV_MAP: [Entry; 14] = [
     Entry { code: 0x44, value: Value::Lock(Mods::SHIFT), },
 
     Entry { code: 0x4a, value: Value::Nav, },
-];
+]);
 
 impl Default for ArtseyManager {
     fn default() -> Self {
@@ -435,7 +469,7 @@ impl ArtseyManager {
             // special mode, then activate the special mode.
             if self.hold_mode == 0 {
                 let hold = if self.is_right { &RIGHT_HOLD_KEYS } else { &LEFT_HOLD_KEYS };
-                if let Some(HoldEntry { mapping, .. }) = hold.iter().find(|k| k.code == self.seen) {
+                if let Some(mapping) = hold[self.seen as usize] {
                     self.hold_mode = self.seen;
                     self.mapping = mapping;
                     // Pretend this key isn't actually held down.
@@ -455,45 +489,45 @@ impl ArtseyManager {
     fn handle_down(&mut self, events: &mut dyn EventQueue) {
         let base_mods = self.locked | self.oneshot;
 
-        match self.mapping.iter().find(|e| e.code == self.seen) {
-            Some(Entry { value: Value::Simple(k), .. }) => {
+        match self.mapping[self.seen as usize] {
+            Value::Simple(k) => {
                 self.sticky = Mods::empty();
                 self.down = true;
-                events.push(Event::Key(KeyAction::KeyPress(*k, base_mods)));
+                events.push(Event::Key(KeyAction::KeyPress(k, base_mods)));
                 self.oneshot = Mods::empty();
                 self.hold_sent = true;
                 // info!("Simple: {}", *k as u8);
             }
-            Some(Entry { value: Value::Shifted(k), .. }) => {
+            Value::Shifted(k) => {
                 self.sticky = Mods::empty();
                 self.down = true;
-                events.push(Event::Key(KeyAction::KeyPress(*k, base_mods | Mods::SHIFT)));
+                events.push(Event::Key(KeyAction::KeyPress(k, base_mods | Mods::SHIFT)));
                 self.oneshot = Mods::empty();
                 self.hold_sent = true;
                 // info!("Shifted: {}", *k as u8);
             }
-            Some(Entry { value: Value::OneShot(k), .. }) => {
+            Value::OneShot(k) => {
                 // Oneshot modifiers are kept until the next keypress goes
                 // through.
-                self.oneshot |= *k;
+                self.oneshot |= k;
             }
-            Some(Entry { value: Value::Lock(k), .. }) => {
+            Value::Lock(k) => {
                 // Locked modifiers are a toggle of modifiers sent with
                 // everything form now on.
-                self.locked ^= *k;
+                self.locked ^= k;
             }
-            Some(Entry { value: Value::Sticky(k), .. }) => {
-                self.sticky |= *k;
+            Value::Sticky(k) => {
+                self.sticky |= k;
                 events.push(Event::Key(KeyAction::ModOnly(self.sticky)));
             }
-            Some(Entry { value: Value::Unstick, .. }) => {
+            Value::Unstick => {
                 // Release, if any are pressed.
                 if !self.sticky.is_empty() {
                     events.push(Event::Key(KeyAction::KeyRelease));
                 }
                 self.sticky = Mods::empty();
             }
-            Some(Entry { value: Value::Nav, .. }) => {
+            Value::Nav => {
                 // Toggle nav mode.
                 self.nav = !self.nav;
                 self.set_normal();
@@ -504,8 +538,7 @@ impl ArtseyManager {
                 };
                 events.push(Event::Indicator(ind));
             }
-            Some(Entry { value: Value::None, .. }) => (),
-            None => (),
+            Value::None => (),
         }
         self.seen = 0;
     }
@@ -16,16 +16,17 @@
 //! code, this should avoid keys getting stuck with weird combinations of combo
 //! keys and layers.
 
-use alloc::collections::{BTreeMap, VecDeque};
-use alloc::vec::Vec;
-use crate::Mods;
+use arraydeque::ArrayDeque;
+use crate::{KeyReport, Mods};
 use crate::log::warn;
 use usbd_human_interface_device::page::Keyboard;
 
 use crate::{KeyEvent, EventQueue, Event, KeyAction};
 
 pub struct QwertyManager {
-    down: BTreeMap<u8, Mapping>,
+    // The mapping each key was pressed with, indexed by key, and Dead for keys
+    // that aren't down.
+    down: [Mapping; NKEYS + NCOMBOS],
 
     // The combo mapper.
     combo: ComboHandler,
@@ -37,15 +38,6 @@ pub struct QwertyManager {
 type Layout = &'static [Mapping];
 
 struct ComboHandler {
-    // Cached bitmap of keys that are parts of combos. Avoids a longer search
-    // for keys that will never be part of one.
-    combos: u64,
-
-    // When we do send a down-event for a combo, indicate the keys pressed here,
-    // as we will need to take care, upon release, to make sure these keys are
-    // processed in the same layer they were pressed in.
-    comboed: u64,
-
     // Potentially pending key event. A down even will be placed here if it
     // might participate in a combo.
     pending: Option<(u8, Layout)>,
@@ -54,15 +46,16 @@ struct ComboHandler {
     // it?
     pending_age: usize,
 
-    // For each combo that is pressed down, record the keys contained in it, and
-    // some information about what layer it was in to be able to process the
-    // release properly.
-    down: BTreeMap<[u8; 2], ComboInfo>,
+    // When we do send a down-event for a combo, record it against both of the
+    // keys pressed, as we will need to take care, upon release, to make sure
+    // these keys are processed in the same layer they were pressed in.
+    down: [Option<ComboInfo>; NKEYS],
 
     // Key events ready to be handled. This will hide keys that are parts of
     // combos, giving the non-combo events, as well as the synthesized events
-    // from the combos.
-    ready: VecDeque<LayeredEvent>,
+    // from the combos.  These are drained after every event, which queues at
+    // most two.
+    ready: ArrayDeque<LayeredEvent, 4>,
 }
 
 struct LayeredEvent {
@@ -72,21 +65,11 @@ struct LayeredEvent {
 
 impl Default for ComboHandler {
     fn default() -> Self {
-        // Collect all of the keys that are parts of combos. Avoids the need to
-        // look up keys that aren't part of a combo.
-        let mut combos = 0;
-        for [a, b] in &COMBOS {
-            combos |= 1 << a;
-            combos |= 1 << b;
-        }
-
         ComboHandler {
-            combos,
-            comboed: 0,
             pending: None,
             pending_age: 0,
-            down: BTreeMap::new(),
-            ready: VecDeque::new(),
+            down: [None; NKEYS],
+            ready: ArrayDeque::new(),
         }
     }
 }
@@ -106,29 +89,22 @@ impl ComboHandler {
                 if self.possible_combo(key) {
                     if let Some((prior_key, layer)) = self.pending {
                         // There is a key, see if both of these make for a combo.
-                        let keys = if prior_key < key {
-                            [prior_key, key]
-                        } else {
-                            [key, prior_key]
-                        };
-                        if let Some(combo) = COMBOS.iter().position(|x| *x == keys) {
-                            let combo = (combo + NKEYS) as u8;
+                        let combo = COMBO_CODES[prior_key as usize][key as usize];
+                        if combo != 0 {
                             // We have a combo. Enqueue that up, and neither of
                             // the pending keys.
-                            self.ready.push_back(LayeredEvent { key: KeyEvent::Press(combo), layer });
-                            self.down.insert(keys, ComboInfo {
-                                code: combo,
-                                layer,
-                            });
-
-                            // Set the flags indicating both of these keys are down,
-                            // and part of a combo.
-                            self.comboed |= (1 << prior_key) | (1 << key);
+                            self.push(KeyEvent::Press(combo), layer);
+
+                            // Indicate both of these keys are down, and part of
+                            // a combo.
+                            let info = Some(ComboInfo { code: combo, layer });
+                            self.down[prior_key as usize] = info;
+                            self.down[key as usize] = info;
                         } else {
                             // Not a valid combo, press both keys, in the order
                             // we saw them in.
-                            self.ready.push_back(LayeredEvent { key: KeyEvent::Press(prior_key), layer });
-                            self.ready.push_back(LayeredEvent { key:  KeyEvent::Press(key), layer });
+                            self.push(KeyEvent::Press(prior_key), layer);
+                            self.push(KeyEvent::Press(key), layer);
                         }
                         // In either case, we've exhausted the pending key.
                         self.pending = None;
@@ -141,39 +117,24 @@ impl ComboHandler {
                 } else {
                     // This key can't be part of a combo, so just queue it up.
                     self.push_pending();
-                    self.ready.push_back(LayeredEvent { key: event, layer });
+                    self.push(event, layer);
                 }
             }
             KeyEvent::Release(key) => {
-                if self.part_of_pressed(key) {
-                    // Key is released, so indicate that.
-                    self.comboed &= !(1 << key);
-
-                    // Try to find a combo, where the key just released was part of it.
-                    if let Some([a, b]) = self.down.keys().find(|&&[a,b]| a == key || b == key) {
-                        let other = if *a == key { *b } else { *a };
-                        if self.part_of_pressed(other) {
-                            // The other key is still pressed, so nothing to do here.
-                        } else {
-                            if let Some(combo) = self.down.remove(&[*a, *b]) {
-                                // Both have been released, so release the combo.
-                                self.ready.push_back(LayeredEvent {
-                                    key: KeyEvent::Release(combo.code),
-                                    layer: combo.layer,
-                                });
-                            } else {
-                                // This is really an assertion failure.
-                                warn!("Combo vanished from map");
-                            }
-                        }
+                // Key is released, so take it out of any combo it was part of.
+                if let Some(combo) = self.down[key as usize].take() {
+                    let [a, b] = COMBOS[combo.code as usize - NKEYS];
+                    let other = if a == key { b } else { a };
+                    if self.part_of_pressed(other, combo.code) {
+                        // The other key is still pressed, so nothing to do here.
                     } else {
-                        // This shouldn't ever happen.
-                        warn!("Key missing from combo map");
+                        // Both have been released, so release the combo.
+                        self.push(KeyEvent::Release(combo.code), combo.layer);
                     }
                 } else {
                     // Not part of a pressed combo, just send a normal release.
                     // TODO: We probably need to handle layer changes here.
-                    self.ready.push_back(LayeredEvent { key: event, layer });
+                    self.push(event, layer);
                 }
             }
         }
@@ -182,7 +143,7 @@ impl ComboHandler {
     /// Handle a keypress in NKRO mode.  This is just a simple layer with no
     /// switching or combo keys.
     pub fn handle_nkro(&mut self, event: KeyEvent) {
-        self.ready.push_back(LayeredEvent { key: event, layer: &NKRO_MAP });
+        self.push(event, &NKRO_MAP);
     }
 
     /// Called as part of the tick handler. Ages potentially pressed keys, so
@@ -208,22 +169,32 @@ impl ComboHandler {
     // Move the pending event into the ready as just a press.
     fn push_pending(&mut self) {
         if let Some((key, layer)) = self.pending {
-            self.ready.push_back(LayeredEvent { key: KeyEvent::Press(key), layer });
+            self.push(KeyEvent::Press(key), layer);
             self.pending = None;
         }
     }
 
+    // Queue up an event to be handled.
+    fn push(&mut self, key: KeyEvent, layer: Layout) {
+        if self.ready.push_back(LayeredEvent { key, layer }).is_err() {
+            // This is really an assertion failure.
+            warn!("Combo queue overflow");
+        }
+    }
+
     // Is this code potentially in a combo?
     fn possible_combo(&self, key: u8) -> bool {
-        (self.combos & (1 << key)) != 0
+        (COMBO_KEYS & (1 << key)) != 0
     }
 
-    // Is this key part of a combo that was pressed?
-    fn part_of_pressed(&self, key: u8) -> bool {
-        (self.comboed & (1 << key)) != 0
+    // Is this key still held as part of the given pressed combo?  The key may
+    // have been released and pressed again as part of another one.
+    fn part_of_pressed(&self, key: u8, code: u8) -> bool {
+        matches!(self.down[key as usize], Some(combo) if combo.code == code)
     }
 }
 
+#[derive(Clone, Copy)]
 struct ComboInfo {
     // The combo keycode relevant here.
     code: u8,
@@ -234,7 +205,7 @@ struct ComboInfo {
 impl Default for QwertyManager {
     fn default() -> Self {
         QwertyManager {
-            down: BTreeMap::new(),
+            down: [Mapping::Dead; NKEYS + NCOMBOS],
             combo: ComboHandler::default(),
             layer: &ROOT_MAP,
         }
@@ -272,13 +243,13 @@ impl QwertyManager {
 
             // Get the mapping of a release event from the 'down' information, in case we have it.
             let code = if event.is_release() {
-                self.down.remove(&event.key())
+                core::mem::replace(&mut self.down[event.key() as usize], Mapping::Dead)
             } else {
-                None
+                Mapping::Dead
             };
 
             // If we don't have a mapping, look it up in the current layer.
-            let code = code.unwrap_or_else(|| layer[event.key() as usize]);
+            let code = if code.is_empty() { layer[event.key() as usize] } else { code };
             if code.is_empty() {
                 // Skip dead keys.
                 continue;
@@ -299,7 +270,7 @@ impl QwertyManager {
 
             // info!("Event: {}", event);
             if event.is_press() {
-                self.down.insert(event.key(), code);
+                self.down[event.key() as usize] = code;
                 self.show(events, Some(code));
             } else {
                 self.show(events, None);
@@ -308,7 +279,7 @@ impl QwertyManager {
     }
 
     fn show(&self, events: &mut dyn EventQueue, code: Option<Mapping>) {
-        let mut keys: Vec<Keyboard> = Vec::new();
+        let mut keys = KeyReport::new();
 
         // We first need to collect the modifiers from any keys that are
         // pressed. Keys that have built-in modifiers are handled a bit
@@ -321,7 +292,7 @@ impl QwertyManager {
         let mut sent = Mods::empty();
 
         // Go through every key, and add modifiers that are just modifier presses.
-        for m in self.down.values() {
+        for m in &self.down {
             if let Mapping::Key(m) = m {
                 if m.is_mod() {
                     if !sent.contains(m.mods) {
@@ -337,7 +308,7 @@ impl QwertyManager {
         }
 
         // Now push the rest of the non-modifier keys.
-        for m in self.down.values() {
+        for m in &self.down {
             if let Mapping::Key(m) = m {
                 if m.has_nonmmod() {
                     keys.push(m.key);
@@ -351,7 +322,7 @@ impl QwertyManager {
 
 // Push keys for any modifiers mentioned here. The 'sent' tracks those that have
 // already been pushed, so we don\t push redundant mods.
-fn push_mods(sent: &mut Mods, keys: &mut Vec<Keyboard>, mods: Mods) {
+fn push_mods(sent: &mut Mods, keys: &mut KeyReport, mods: Mods) {
     for (m, k) in &[
         (Mods::SHIFT, Keyboard::LeftShift),
         (Mods::CONTROL, Keyboard::LeftControl),
@@ -369,6 +340,9 @@ fn push_mods(sent: &mut Mods, keys: &mut Vec<Keyboard>, mods: Mods) {
 // from pairs of keys on the main keyboard.
 const NKEYS: usize = 48;
 
+// Number of combos, whose codes follow the keys.
+const NCOMBOS: usize = COMBOS.len();
+
 #[derive(Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
 enum Mapping {
     // This key doesn't do anything.
@@ -935,7 +909,7 @@ static NKRO_MAP: [Mapping; NKEYS] = [
 // Combination keys. Each of these pairs will register as the entry for its
 // index in this list, starting at NKEY. Each pair should have the lowest
 // scancode first.
-static COMBOS: [[u8; 2]; 23] = [
+const COMBOS: [[u8; 2]; 23] = [
     // Pairs with the top and middle row and the main fingers.
     [4, 5],
     [8, 9],
@@ -966,3 +940,30 @@ static COMBOS: [[u8; 2]; 23] = [
     [39, 43],
     [43, 47],
 ];
+
+// Bitmap of keys that are parts of combos. Avoids the need to look up keys
+// that will never be part of one.
+const COMBO_KEYS: u64 = {
+    let mut keys = 0;
+    let mut i = 0;
+    while i < NCOMBOS {
+        keys |= (1 << COMBOS[i][0]) | (1 << COMBOS[i][1]);
+        i += 1;
+    }
+    keys
+};
+
+// The combo code for each pair of keys, in either order, or zero if the pair
+// isn't a combo.
+static COMBO_CODES: [[u8; NKEYS]; NKEYS] = {
+    let mut codes = [[0; NKEYS]; NKEYS];
+    let mut i = 0;
+    while i < NCOMBOS {
+        let [a, b] = COMBOS[i];
+        assert!(a < b && codes[a as usize][b as usize] == 0, "Combos must be distinct, lowest scancode first");
+        codes[a as usize][b as usize] = (i + NKEYS) as u8;
+        codes[b as usize][a as usize] = (i + NKEYS) as u8;
+        i += 1;
+    }
+    codes
+};
@@ -1,6 +1,6 @@
 //! Steno key handling.
 
-use crate::{EventQueue, Event, KeyEvent};
+use crate::{EventQueue, Event, KeyBatch, KeyEvent};
 
 pub use bbq_steno::Stroke;
 use bbq_steno_macros::stroke;
@@ -12,17 +12,48 @@ use bbq_steno_macros::stroke;
 // "First up" works differently. As soon as a key is released, we send the
 // stroke of everything that was pressed. If an additional key is pressed, we
 // start recording new keys for possible additional strokes. This relies on good
-// debouncing to avoid seeing sprious interleaved events.
+// debouncing to avoid seeing sprious interleaved events.  This handler always
+// works in first up, which ends the stroke as early as possible.
+//
+// In addition, with the `hold-repeat` feature, a stroke that is held down
+// without change for HOLD_TICKS is sent right away, and then repeated every
+// REPEAT_TICKS until a key is released or pressed.  Releasing the keys then
+// doesn't send it again, so the first of these must be delivered, although
+// the repeats can be dropped.  Without the feature, pausing in the middle of
+// a stroke is fine, as it is only sent on the release.
+
+/// How long, in ticks, a stroke must be held before it repeats.
+const HOLD_TICKS: u32 = 500;
+
+/// How often, in ticks, a held stroke repeats.
+const REPEAT_TICKS: u32 = 50;
 
 pub struct RawStenoHandler {
     // Keys that are still pressed.
     down: Stroke,
 
-    // Have we enabled first-up mode.
-    // first_up: bool,
-
     // Toggle between pressing, and releasing.
     pressing: bool,
+
+    // Ticks since the last press, while pressing.
+    age: u32,
+
+    // Has the stroke being pressed already been sent by holding it?
+    repeated: bool,
+
+    // Do held strokes repeat?
+    hold: bool,
+}
+
+/// A held stroke, from `tick`.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub struct Held {
+    pub stroke: Stroke,
+    /// Is this a repeat, rather than the first time the stroke is sent?
+    pub repeat: bool,
+    /// Should it be typed raw, rather than translated?  Set by the layout
+    /// manager.
+    pub raw: bool,
 }
 
 // The steno handler goes through these states. In Up indicates nothing is
@@ -37,45 +68,86 @@ impl RawStenoHandler {
         RawStenoHandler {
             down: Stroke::empty(),
             pressing: true,
+            age: 0,
+            repeated: false,
+            hold: cfg!(feature = "hold-repeat"),
         }
     }
 
-    // For now, we don't do anything with the tick, but it will be needed when
-    // trying to implement the hold modes.
-    pub fn tick(&mut self) {}
+    /// Age a held stroke, returning it when it is time for it to be sent, or
+    /// to repeat.
+    pub fn tick(&mut self) -> Option<Held> {
+        if !self.hold || !self.pressing || self.down.is_empty() {
+            return None;
+        }
+
+        self.age += 1;
+        if self.age < HOLD_TICKS {
+            return None;
+        }
+
+        self.age = HOLD_TICKS - REPEAT_TICKS;
+        let repeat = self.repeated;
+        self.repeated = true;
+        Some(Held { stroke: self.down, repeat, raw: false })
+    }
+
     pub fn poll(&mut self) {}
 
     // Handle a single event.
     pub fn handle_event(&mut self, event: KeyEvent, events: &mut dyn EventQueue) {
-        let key = event.key();
-        if key as usize >= STENO_KEYS.len() {
-            return;
+        let bit: u64 = 1 << event.key();
+        let keys = if event.is_press() {
+            KeyBatch { pressed: bit, released: 0 }
+        } else {
+            KeyBatch { pressed: 0, released: bit }
+        };
+        if let Some(stroke) = self.handle_batch(keys) {
+            events.push(Event::RawSteno(stroke));
         }
-        if let Some(st) = STENO_KEYS[key as usize] {
-            match (event.is_press(), self.pressing) {
-                // We are expecting keys to be pressed.  Add to those seen.
-                (true, true) => {
-                    self.down |= st;
-                }
-                // Expecting press, and got a release. This is our first
-                // release, so send what is seen.
-                (false, true) => {
-                    events.push(Event::RawSteno(self.down));
-                    self.down &= !st;
-                    self.pressing = false;
-                }
-                // Expecting releases, if we see a down here, switch back to pressing mode.
-                (true, false) => {
-                    self.down |= st;
-                    self.pressing = true;
-                }
-                // Expecting release, and got one, just use the release.
-                (false, false) => {
-                    self.down &= !st;
+    }
+
+    /// Handle all of the key changes from a scan, returning the stroke, if
+    /// this completes one.  Presses in the same batch are taken as happening
+    /// before the releases.
+    pub fn handle_batch(&mut self, keys: KeyBatch) -> Option<Stroke> {
+        let mut stroke = None;
+
+        if let Some(st) = chord(keys.pressed) {
+            // Any press puts us back into pressing mode.
+            self.down |= st;
+            self.pressing = true;
+            self.age = 0;
+            self.repeated = false;
+        }
+
+        if let Some(st) = chord(keys.released) {
+            // The first release sends what has been seen, unless holding it
+            // already has.
+            if self.pressing {
+                if !self.repeated {
+                    stroke = Some(self.down);
                 }
+                self.pressing = false;
             }
+            self.down &= !st;
+        }
+
+        stroke
+    }
+}
+
+/// The steno keys for a mask of keys, or None if none of them are steno keys.
+fn chord(mut keys: u64) -> Option<Stroke> {
+    let mut result = None;
+    while keys != 0 {
+        let key = keys.trailing_zeros() as usize;
+        keys &= keys - 1;
+        if let Some(Some(st)) = STENO_KEYS.get(key) {
+            result = Some(result.unwrap_or(Stroke::empty()) | *st);
         }
     }
+    result
 }
 
 #[cfg(feature = "proto2")]
@@ -180,3 +252,42 @@ static STENO_KEYS: &[Option<Stroke>] = &[
     Some(stroke!("E")),
 
 ];
+
+#[test]
+fn test_hold_repeat() {
+    let mut raw = RawStenoHandler::new();
+    raw.hold = true;
+    let keys = (1 << 5) | (1 << 9);
+    let stroke = chord(keys).unwrap();
+    let press = KeyBatch { pressed: keys, released: 0 };
+
+    // A quick stroke is sent on the first release.
+    assert_eq!(raw.handle_batch(press), None);
+    assert_eq!(raw.tick(), None);
+    assert_eq!(raw.handle_batch(KeyBatch { pressed: 0, released: 1 << 5 }), Some(stroke));
+    assert_eq!(raw.handle_batch(KeyBatch { pressed: 0, released: 1 << 9 }), None);
+
+    // A held one is sent once held long enough, and then repeats, but isn't
+    // sent again when released.
+    assert_eq!(raw.handle_batch(press), None);
+    let sent: Vec<(u32, bool)> = (1..=HOLD_TICKS + 2 * REPEAT_TICKS)
+        .filter_map(|t| raw.tick().map(|held| {
+            assert_eq!(held.stroke, stroke);
+            (t, held.repeat)
+        }))
+        .collect();
+    assert_eq!(sent, [
+        (HOLD_TICKS, false),
+        (HOLD_TICKS + REPEAT_TICKS, true),
+        (HOLD_TICKS + 2 * REPEAT_TICKS, true),
+    ]);
+    assert_eq!(raw.handle_batch(KeyBatch { pressed: 0, released: keys }), None);
+    assert_eq!(raw.tick(), None);
+
+    // Without repeats, a pause in the middle of a stroke just waits for the
+    // release.
+    raw.hold = false;
+    assert_eq!(raw.handle_batch(press), None);
+    assert!((0..2 * HOLD_TICKS).all(|_| raw.tick().is_none()));
+    assert_eq!(raw.handle_batch(KeyBatch { pressed: 0, released: keys }), Some(stroke));
+}
@@ -8,7 +8,7 @@ extern crate core as std;
 
 extern crate alloc;
 
-use alloc::vec::Vec;
+use arrayvec::ArrayVec;
 
 use bbq_steno::Stroke;
 use smart_leds::RGB8;
@@ -94,15 +94,54 @@ impl KeyEvent {
     }
 }
 
+/// The keys that changed state in a single scan of the matrix.  Bit `n` of
+/// each mask is key `n`.
+#[derive(Clone, Copy, Eq, PartialEq, Debug, Default)]
+pub struct KeyBatch {
+    pub pressed: u64,
+    pub released: u64,
+}
+
+impl KeyBatch {
+    pub fn is_empty(&self) -> bool {
+        self.pressed | self.released == 0
+    }
+
+    /// The individual key events, in key order.
+    pub fn events(&self) -> impl Iterator<Item = KeyEvent> {
+        let pressed = self.pressed;
+        let mut keys = self.pressed | self.released;
+        core::iter::from_fn(move || {
+            if keys == 0 {
+                return None;
+            }
+            let key = keys.trailing_zeros() as u8;
+            keys &= keys - 1;
+            if pressed & (1 << key) != 0 {
+                Some(KeyEvent::Press(key))
+            } else {
+                Some(KeyEvent::Release(key))
+            }
+        })
+    }
+}
+
 /// Indicates keypress that should be sent to the host.
 #[derive(Clone, Debug)]
 pub enum KeyAction {
     KeyPress(Keyboard, Mods),
     ModOnly(Mods),
     KeyRelease,
-    KeySet(Vec<Keyboard>),
+    KeySet(KeyReport),
 }
 
+/// The most keys that can be down in a single report: every key of the
+/// keyboard, and the four modifiers.
+pub const KEY_REPORT_MAX: usize = 52;
+
+/// The keys to send down in a single report.
+pub type KeyReport = ArrayVec<Keyboard, KEY_REPORT_MAX>;
+
 bitflags! {
     /// A modifier map. This indicates what modifiers should be held down when
     /// this keypress is sent.
@@ -119,11 +158,8 @@ bitflags! {
 /// likely needs to be performed on it.
 #[derive(Debug)]
 pub enum Event {
-    /// Events from the Matrix layer indicating changes in key actions.
-    Matrix(KeyEvent),
-
     /// Events from the inner layer indicating changes in key actions.
-    InterKey(KeyEvent),
+    InterKey(KeyBatch),
 
     /// Indication of a "raw" steno stroke from the steno layer.  This is
     /// untranslated and should just be typed.
@@ -152,9 +188,6 @@ pub enum Event {
 
     /// Message received from the primary side to set out LEDs.
     RecvLed(RGB8),
-
-    /// Led value to be sent to the other side.
-    SendLed(RGB8),
 }
 
 /// A generalized event queue.  TODO: Handle the error better.  For now, we
@@ -1,12 +1,8 @@
 //! Serialization of the inter protocol.
 
-extern crate alloc;
-
-use core::mem::replace;
-use alloc::vec::Vec;
-
 use arraydeque::ArrayDeque;
-use crc::{Crc, CRC_16_IBM_SDLC, Digest};
+use arrayvec::ArrayVec;
+use crc::{Crc, CRC_16_IBM_SDLC};
 use smart_leds::RGB8;
 
 #[cfg(not(feature = "std"))]
@@ -17,11 +13,9 @@ use crate::log::warn;
 
 // TODO: Make the hardcoded sizes part of the board support.
 
-use crate::{Side, KeyEvent};
+use crate::Side;
 
-pub type PacketBuffer = ArrayDeque<u8, 28>;
-// pub type EventVec = ArrayVec<KeyEvent, 21>;
-pub type EventVec = Vec<KeyEvent>;
+pub type PacketBuffer = ArrayDeque<u8, FRAME_MAX>;
 
 /// The CRC generator we are using.
 pub const CRC: Crc<u16> = Crc::<u16>::new(&CRC_16_IBM_SDLC);
@@ -40,308 +34,230 @@ pub enum Packet {
         side: Side,
         /// Set the LEDs to this value (probably should be more of a state)
         led: RGB8,
+        /// The sequence number of a Secondary packet with key changes that was
+        /// just received.
+        ack: Option<u8>,
     },
     Secondary {
         /// Which side of the keyboard we are.
         side: Side,
-        /// Key events.
-        keys: EventVec,
+        /// The state of the keys, with a bit set for each key that is down.
+        keys: u64,
     },
 }
 
-/// The version of the protocol described by this code.  It is a fatal error for
-/// there to be a mismatch.  This is a value less than 128.
-//const VERSION: u8 = 1;
+/// The version of the protocol described by this code.  Packets of any other
+/// version are discarded, as there is no negotiation, so both halves must be
+/// flashed with the same protocol version.
+pub const VERSION: u8 = 2;
 
-// The protocol itself is byte-oriented.  The high bit indicates whether or not
-// this is a control byte, the 0x40 bit indicates which side this packet
-// originates from.  The other bits indicate the particular value being sent.
-// This initial version only has three bytes:
+// Each packet is a payload of:
+//
+// - A header byte.  The upper 4 bits are the protocol version, bit 3 indicates
+//   which side this packet originates from (set for the right), and the low 3
+//   bits are the packet type:
+//   1 - Idle.
+//   2 - Primary.  Followed by the 3 bytes of the RGB8 value, and optionally
+//       the sequence number being acknowledged.
+//   3 - Secondary.  Followed by the key state, as a little-endian bitmap with
+//       the trailing zero bytes left off.
+// - An 8-bit sequence number.  This could be used to help diagnose dropped
+//   packets.
+// - The body, as above.
+// - The CRC16 of all of the above, little endian.
 //
-// 1 - Indicates idle.  (0x81 and 0xc1)
-//     followed by a 7-bit sequence number.  This could be used to help diagnose
-//     dropped packets.
-// 2 - Primary (0x82 and 0xc2)
-//     7-bit sequence number
-//     3 7-bit numbers of RGB8 values.  The low bit of the intensity is
-//     discarded.
-// 3 - Slave (0x83 and 0xc3)
-//     7-bit sequence number
-//     7-bit bytes of key events
-// 3f - CRC (0xff) (note that the CRC is the same for either side)
-//     2 7-bit bytes, representing the low 14 bits of the CRC16
+// The payload is COBS encoded, so that it contains no zero bytes, and a zero
+// byte ends each packet.  A receiver can start listening at any point, and
+// will pick up at the next packet.
 //
-// The key events are encoded as the low 6 bits (0-63) are the key number, and
-// the next bit (64) indicates that this is a release event.
+// As the secondary sends the whole state of its keys, a lost packet only
+// delays key changes until the next one arrives.
+
+/// The largest payload: header, sequence, LEDs and ack, and CRC.
+const PAYLOAD_MAX: usize = 2 + 8 + 2;
+
+/// The largest encoded packet: the payload, the COBS code byte, and the
+/// terminator.
+pub const FRAME_MAX: usize = PAYLOAD_MAX + 2;
+
+type Payload = ArrayVec<u8, PAYLOAD_MAX>;
 
 impl Packet {
     /// Encode this packet for the on stream.  The encoding will be placed in
     /// the given buffer.
     pub fn encode(&self, buf: &mut PacketBuffer, seq: &mut u8) {
-        buf.clear();
+        let mut payload = Payload::new();
         match self {
             Packet::Idle { side } => {
-                buf.push_back(token(1, *side)).unwrap();
-                buf.push_back(*seq).unwrap();
+                payload.push(header(1, *side));
+                payload.push(*seq);
             }
-            Packet::Primary { side, led } => {
-                buf.push_back(token(2, *side)).unwrap();
-                buf.push_back(*seq).unwrap();
-                buf.push_back(led.r >> 1).unwrap();
-                buf.push_back(led.g >> 1).unwrap();
-                buf.push_back(led.b >> 1).unwrap();
+            Packet::Primary { side, led, ack } => {
+                payload.push(header(2, *side));
+                payload.push(*seq);
+                payload.push(led.r);
+                payload.push(led.g);
+                payload.push(led.b);
+                if let Some(ack) = ack {
+                    payload.push(*ack);
+                }
             }
             Packet::Secondary { side, keys } => {
-                buf.push_back(token(3, *side)).unwrap();
-                buf.push_back(*seq).unwrap();
-                for elt in keys {
-                    let b = match elt {
-                        KeyEvent::Press(code) => *code,
-                        KeyEvent::Release(code) => *code | 64,
-                    };
-                    buf.push_back(b).unwrap();
-                }
+                payload.push(header(3, *side));
+                payload.push(*seq);
+                let len = 8 - (keys.leading_zeros() as usize / 8);
+                payload.extend(keys.to_le_bytes()[..len].iter().cloned());
             }
         }
 
-        // Compute and encode the CRC.
-        buf.push_back(0xff).unwrap();
-        let (a, b) = crc_split(get_crc(buf));
-        buf.push_back(a).unwrap();
-        buf.push_back(b).unwrap();
+        let crc = CRC.checksum(&payload);
+        payload.extend(crc.to_le_bytes());
+
+        buf.clear();
+        cobs_encode(&payload, buf);
+        buf.push_back(0).unwrap();
+
+        *seq = seq.wrapping_add(1);
+    }
 
-        let tmp = seq.wrapping_add(1);
-        *seq = if tmp < 0x80 { tmp } else { 0 };
+    /// Decode a payload, once the CRC has been checked and removed.
+    fn decode(payload: &[u8]) -> Option<Packet> {
+        let (&head, body) = payload.split_first()?;
+        if head >> 4 != VERSION {
+            warn!("Inter protocol version {} from other side, expected {}", head >> 4, VERSION);
+            return None;
+        }
+        let side = if (head & 0x08) == 0 { Side::Left } else { Side::Right };
+        // The sequence number is only used by the caller.
+        let body = body.get(1..)?;
+
+        match head & 0x07 {
+            1 => Some(Packet::Idle { side }),
+            2 => {
+                let (led, ack) = match body {
+                    &[r, g, b] => (RGB8::new(r, g, b), None),
+                    &[r, g, b, ack] => (RGB8::new(r, g, b), Some(ack)),
+                    _ => return None,
+                };
+                Some(Packet::Primary { side, led, ack })
+            }
+            3 => {
+                if body.len() > 8 {
+                    return None;
+                }
+                let mut bytes = [0u8; 8];
+                bytes[..body.len()].copy_from_slice(body);
+                Some(Packet::Secondary { side, keys: u64::from_le_bytes(bytes) })
+            }
+            _ => None,
+        }
     }
 }
 
 /// A packet decoder.  This maintains all the necessary internal state to decode
-/// incoming packets, and return them when they are ready.
+/// incoming packets, and return them when they are ready.  Nothing is
+/// allocated: bytes are collected into a fixed buffer until the end of the
+/// packet.
 pub struct Decoder {
-    state: DecodeState,
+    frame: ArrayVec<u8, FRAME_MAX>,
+    /// The frame was too long, discard until the end of it.
+    overrun: bool,
+    /// The sequence number of the packet last decoded.
+    seq: u8,
 }
 
 impl Decoder {
     pub fn new() -> Decoder {
         Decoder {
-            state: DecodeState::Init,
+            frame: ArrayVec::new(),
+            overrun: false,
+            seq: 0,
         }
     }
 
+    /// The sequence number of the most recently decoded packet.
+    pub fn seq(&self) -> u8 {
+        self.seq
+    }
+
     /// Handle another incoming byte.  Returns a decoded packet when completed.
     pub fn add_byte(&mut self, byte: u8) -> Option<Packet> {
-        // Is this a CRC indicator.
-        if byte == 0xff {
-            let state = replace(&mut self.state, DecodeState::Init);
-            self.state = state.start_crc();
-            return None;
-        }
-        // Check for tokens.  These will already reset to this "first state"
-        if (byte & 0x80) != 0 {
-            self.state = DecodeState::First { token: byte };
+        if byte != 0 {
+            if self.frame.try_push(byte).is_err() {
+                self.overrun = true;
+            }
             return None;
         }
 
-        // Otherwise deal with the data.  This isn't a full match because we
-        // want to move out of some states (potentially), and use the data in
-        // place in others.
-        if let DecodeState::First { token } = self.state {
-            let side = if (token & 0x40) == 0 { Side::Left } else { Side::Right };
-            let mut crc = CRC.digest();
-            let inner = match token & 0x3f {
-                1 => Some(InnerDecodeState::Idle),
-                2 => Some(InnerDecodeState::Primary {
-                    leds: [0, 0, 0],
-                    pos: 0,
-                }),
-                3 => Some(InnerDecodeState::Secondary {
-                    events: EventVec::new(),
-                }),
-                // Otherwise, invalid, start over.
-                _ => None,
-            };
-            match inner {
-                None => self.state = DecodeState::Init,
-                Some(s) => self.state = {
-                    // Note that we basically ignore the sequence number, other than
-                    // using it for the CRC.
-                    crc.update(&[token, byte]);
-                    DecodeState::Inside {
-                        inner: s,
-                        crc: crc,
-                        side: side,
-                    }
-                }
-            }
+        // The end of a frame.
+        let overrun = core::mem::replace(&mut self.overrun, false);
+        if overrun || self.frame.is_empty() {
+            self.frame.clear();
             return None;
         }
 
-        if let DecodeState::Init = self.state {
+        let mut payload = Payload::new();
+        let decoded = cobs_decode(&self.frame, &mut payload);
+        self.frame.clear();
+        decoded?;
+
+        if payload.len() < 4 {
             return None;
         }
-
-        if let DecodeState::Inside { inner, crc, side } = &mut self.state {
-            crc.update(&[byte]);
-            if byte == 0xff {
-                // Transition to the CRC state.
-                self.state = DecodeState::CRC {
-                    inner: inner.clone(),
-                    expected_crc: crc_split(crc.clone().finalize()),
-                    gotten: [0, 0],
-                    pos: 0,
-                    side: *side,
-                };
-                return None;
-            }
-            inner.decode(byte);
+        let (data, crc) = payload.split_at(payload.len() - 2);
+        if CRC.checksum(data).to_le_bytes() != crc {
+            warn!("Invalid CRC received");
             return None;
         }
 
-        // Otherwise, we are in the CRC state.
-        let (packet, done) = if let DecodeState::CRC { inner, expected_crc, gotten, pos, side } = &mut self.state {
-            gotten[*pos] = byte;
-            *pos += 1;
-
-            if *pos == 2 {
-                if *expected_crc == (gotten[0], gotten[1]) {
-                    // The packet is valid.
-                    // TODO: This clone is excessive copying.
-                    (Some(inner.clone().into_packet(*side)), true)
-                } else {
-                    warn!("Invalid CRC received");
-                    (None, true)
-                }
-            } else {
-                (None, false)
-            }
-        } else {
-            panic!("State error");
-        };
-        if done {
-            self.state = DecodeState::Init;
-        }
-        packet
+        let packet = Packet::decode(data)?;
+        self.seq = data[1];
+        Some(packet)
     }
 }
 
-/// Outer decoder state.
-enum DecodeState {
-    /// Between packets.
-    Init,
-    /// We got a token, but don't yet have the sequence number.
-    First {
-        token: u8,
-    },
-    /// We got the token and are inside the packet.
-    Inside {
-        inner: InnerDecodeState,
-        crc: Digest<'static, u16>,
-        side: Side,
-    },
-    /// We got the CRC header, waiting for the two bytes of the CRC.
-    CRC {
-        inner: InnerDecodeState,
-        expected_crc: (u8, u8),
-        gotten: [u8; 2],
-        pos: usize,
-        side: Side,
-    },
-}
-
-impl DecodeState {
-    fn start_crc(self) -> Self {
-        match self {
-            DecodeState::Inside { inner, mut crc, side } => {
-                crc.update(&[0xff]);
-                let result = crc.finalize();
-                DecodeState::CRC {
-                    inner: inner,
-                    expected_crc: crc_split(result),
-                    gotten: [0, 0],
-                    pos: 0,
-                    side,
-                }
-            }
-            _ => {
-                // If we aren't excpecting a CRC, just reset back to the
-                // Init state.
-                DecodeState::Init
-            }
+/// COBS encode the payload into the buffer.  Each run of non-zero bytes is
+/// preceded by a code of its length plus one, with the zero that follows it
+/// implied.
+fn cobs_encode(payload: &[u8], buf: &mut PacketBuffer) {
+    let mut code_pos = buf.len();
+    buf.push_back(0).unwrap();
+    let mut code = 1u8;
+    for &byte in payload {
+        if byte != 0 {
+            buf.push_back(byte).unwrap();
+            code += 1;
         }
-    }
-}
-
-/// Internal decoder state, once we know what token this is.
-#[derive(Clone)]
-enum InnerDecodeState {
-    Idle,
-    /// Primary token and sequence received.  Waiting for the 3 LED values.
-    Primary {
-        /// Digest so far.
-        leds: [u8; 3],
-        /// Position within the components.
-        pos: usize,
-    },
-    Secondary {
-        /// Digest so far.
-        events: EventVec,
-    },
-}
-
-impl InnerDecodeState {
-    fn decode(&mut self, byte: u8) {
-        match self {
-            // This is invalid, but just ignore.
-            InnerDecodeState::Idle => (),
-            // Primary, stores the LED values.
-            InnerDecodeState::Primary { leds, pos } => {
-                if *pos < 3 {
-                    leds[*pos] = byte << 1;
-                    *pos += 1;
-                }
-                // If past end, just discard.
-            }
-            InnerDecodeState::Secondary { events } => {
-                let ev = if (byte & 64) == 0 {
-                    KeyEvent::Press(byte)
-                } else {
-                    KeyEvent::Release(byte & 63)
-                };
-                events.push(ev);
-            }
+        if byte == 0 || code == 0xff {
+            *buf.get_mut(code_pos).unwrap() = code;
+            code_pos = buf.len();
+            buf.push_back(0).unwrap();
+            code = 1;
         }
     }
+    *buf.get_mut(code_pos).unwrap() = code;
+}
 
-    fn into_packet(self, side: Side) -> Packet {
-        match self {
-            InnerDecodeState::Idle => Packet::Idle { side },
-            InnerDecodeState::Primary { leds, pos: _ } => {
-                let led = RGB8::new(leds[0], leds[1], leds[2]);
-                Packet::Primary { side, led }
-            }
-            InnerDecodeState::Secondary { events } => Packet::Secondary { side, keys: events }
+/// Decode a COBS frame, without its terminator.  Returns None if the frame is
+/// malformed.
+fn cobs_decode(frame: &[u8], payload: &mut Payload) -> Option<()> {
+    let mut pos = 0;
+    while pos < frame.len() {
+        let code = frame[pos] as usize;
+        let run = frame.get(pos + 1..pos + code)?;
+        payload.try_extend_from_slice(run).ok()?;
+        pos += code;
+        if code < 0xff && pos < frame.len() {
+            payload.try_push(0).ok()?;
         }
     }
+    Some(())
 }
 
-/// Calculate the CRC of the contents of the buffer.  Note that we only use the
-/// low 14-bits of the CRC.
-fn get_crc(buf: &PacketBuffer) -> u16 {
-    let mut digest = CRC.digest();
-    let (a, b) = buf.as_slices();
-    digest.update(a);
-    digest.update(b);
-    digest.finalize()
-}
-
-fn crc_split(crc: u16) -> (u8, u8) {
-    ((crc & 0x7f) as u8, ((crc >> 7) & 0x7f) as u8)
-}
-
-fn token(code: u8, side : Side) -> u8 {
-    0x80 | code | (match side {
+fn header(code: u8, side: Side) -> u8 {
+    (VERSION << 4) | code | (match side {
         Side::Left => 0x00,
-        Side::Right => 0x40,
+        Side::Right => 0x08,
     })
 }
 
@@ -363,38 +279,51 @@ fn test_serialize() {
         }
     }
     assert_eq!(Some(a), aa);
+    assert_eq!(decoder.seq(), 1);
 
-    let b = Packet::Primary {
-        side: Side::Right,
-        led: RGB8::new(16, 12, 34),
-    };
-    b.encode(&mut buf, &mut seq);
+    for ack in [None, Some(0), Some(17)] {
+        let b = Packet::Primary {
+            side: Side::Right,
+            led: RGB8::new(16, 0, 255),
+            ack,
+        };
+        b.encode(&mut buf, &mut seq);
 
-    let mut bb = None;
-    for ch in buf.iter() {
-        if let Some(decoded) = decoder.add_byte(*ch) {
-            bb = Some(decoded);
+        let mut bb = None;
+        for ch in buf.iter() {
+            if let Some(decoded) = decoder.add_byte(*ch) {
+                bb = Some(decoded);
+            }
         }
+        assert_eq!(Some(b), bb);
     }
-    assert_eq!(Some(b), bb);
-
-    let mut keys = EventVec::new();
-    keys.push(KeyEvent::Press(5));
-    keys.push(KeyEvent::Press(18));
-    keys.push(KeyEvent::Release(18));
-    keys.push(KeyEvent::Release(5));
-    keys.push(KeyEvent::Release(7));
-    let c = Packet::Secondary {
-        side: Side::Left,
-        keys,
-    };
-    c.encode(&mut buf, &mut seq);
-
-    let mut cc = None;
-    for ch in buf.iter() {
+
+    for keys in [0, 1 << 5 | 1 << 18, 1 << 47, u64::MAX] {
+        let c = Packet::Secondary {
+            side: Side::Left,
+            keys,
+        };
+        c.encode(&mut buf, &mut seq);
+
+        let mut cc = None;
+        for ch in buf.iter() {
+            if let Some(decoded) = decoder.add_byte(*ch) {
+                cc = Some(decoded);
+            }
+        }
+        assert_eq!(Some(c), cc);
+    }
+
+    // A corrupted packet is dropped, and the next one is still seen.
+    Packet::Idle { side: Side::Right }.encode(&mut buf, &mut seq);
+    let mut bad: ArrayVec<u8, FRAME_MAX> = buf.iter().cloned().collect();
+    bad[2] ^= 0x10;
+    let mut count = 0;
+    for ch in bad.iter().chain(buf.iter()) {
         if let Some(decoded) = decoder.add_byte(*ch) {
-            cc = Some(decoded);
+            assert_eq!(decoded, Packet::Idle { side: Side::Right });
+            count += 1;
         }
     }
-    assert_eq!(Some(c), cc);
+    assert_eq!(count, 1);
 }
@@ -1,16 +1,33 @@
 //! USB keyboard typer
 //!
 //! Accept strings and simulate typing them on a USB HID keyboard.
+//!
+//! Text is first compiled into a report stream, a sequence of steps that are
+//! each a single keypress.  Characters outside of ASCII are typed with the
+//! host's Unicode input sequence.  The text can be a compiled definition, and
+//! its key presses are sent as they are.
 
 // The keytable represents the keys as u16's, with the low 8 bits corresponding
-// to the Keyboard enum value, and the upper bits indicating modifiers.
+// to the Keyboard enum value, and the upper bits indicating modifiers.  A step
+// of the report stream uses the same encoding.
 
+use arrayvec::ArrayVec;
+use bbq_steno::dict::ops::{self, Piece};
 use usbd_human_interface_device::page::Keyboard;
 
 use crate::{KeyAction, Mods};
 
+/// A single step of a report stream: a key, and the modifiers held with it.
+pub type Step = u16;
+
 /// A shift modifier.
 const SHIFT: u16 = 0x100;
+/// A control modifier.
+const CONTROL: u16 = 0x200;
+/// An alt modifier.
+const ALT: u16 = 0x400;
+/// A gui modifier.
+const GUI: u16 = 0x800;
 
 /// An empty character, one we don't support sending.
 const NONE: u16 = 0xffff;
@@ -156,6 +173,62 @@ static KEY_TABLE: [u16; 128] = [
     NONE, // 0x7F, Delete (often represented as DEL)
 ];
 
+/// The longest sequence of steps a single character can need.  This is the
+/// Unicode entry: its prefix, up to 6 hex digits, and the terminator.
+const CHAR_STEPS: usize = 8;
+
+/// Compile text into a report stream.  ASCII characters with no key are
+/// dropped.
+pub fn compile(text: &str) -> impl Iterator<Item = Step> + '_ {
+    ops::pieces(text).flat_map(|piece| match piece {
+        Piece::Char(ch) => char_steps(ch),
+        // The modifier bits are the same as those of a step.
+        Piece::Key(mods, usage) => [(mods as u16) << 8 | usage as u16].into_iter().collect(),
+    })
+}
+
+/// The steps to type a single character.
+fn char_steps(ch: char) -> ArrayVec<Step, CHAR_STEPS> {
+    let mut steps = ArrayVec::new();
+    if ch.is_ascii() {
+        let code = KEY_TABLE[ch as usize];
+        if code != NONE {
+            steps.push(code);
+        }
+        return steps;
+    }
+
+    // The Ctrl-Shift-U entry used by GTK and IBus: the sequence, the code
+    // point in hex, and a space to end it.
+    steps.push(CONTROL | SHIFT | Keyboard::U as u16);
+    let code = ch as u32;
+    let digits = ((32 - code.leading_zeros() + 3) / 4).max(1);
+    for digit in (0..digits).rev() {
+        let nibble = (code >> (digit * 4)) & 0xf;
+        steps.push(KEY_TABLE[b"0123456789abcdef"[nibble as usize] as usize]);
+    }
+    steps.push(n(Keyboard::Space));
+    steps
+}
+
+/// The keypress for a single step.
+pub fn step_action(step: Step) -> KeyAction {
+    let mut mods = Mods::empty();
+    if step & SHIFT != 0 {
+        mods |= Mods::SHIFT;
+    }
+    if step & CONTROL != 0 {
+        mods |= Mods::CONTROL;
+    }
+    if step & ALT != 0 {
+        mods |= Mods::ALT;
+    }
+    if step & GUI != 0 {
+        mods |= Mods::GUI;
+    }
+    KeyAction::KeyPress(((step & 0xFF) as u8).into(), mods)
+}
+
 /// An ActionHandler is something that is able to take actions.
 pub trait ActionHandler {
     fn enqueue_actions<I: Iterator<Item = KeyAction>>(&mut self, events: I);
@@ -163,18 +236,5 @@ pub trait ActionHandler {
 
 /// Enqueue an action as keypresses.
 pub fn enqueue_action<H: ActionHandler>(usb: &mut H, text: &str) {
-    for ch in text.chars() {
-        if ch < (128 as char) {
-            let code = KEY_TABLE[ch as usize];
-            if code == NONE {
-                continue;
-            }
-            let shifted = (code & SHIFT) != 0;
-            let code: Keyboard = ((code & 0xFF) as u8).into();
-            let action = KeyAction::KeyPress(code, if shifted {Mods::SHIFT} else {Mods::empty()});
-
-            usb.enqueue_actions([action.clone()].iter().cloned());
-            usb.enqueue_actions([KeyAction::KeyRelease].iter().cloned());
-        }
-    }
+    usb.enqueue_actions(compile(text).flat_map(|step| [step_action(step), KeyAction::KeyRelease]));
 }
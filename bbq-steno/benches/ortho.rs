@@ -0,0 +1,76 @@
+//! Benchmark the orthography rules against the suffix entries of the main
+//! dictionary.
+//!
+//! For every entry ending in -G, -Z, -S, or -D, where the entry without the
+//! suffix stroke is also a plain word, this combines the word and the suffix,
+//! and compares the result against the dictionary's own entry.
+
+use std::{collections::BTreeMap, fs::File, hint::black_box, time::Instant};
+
+use anyhow::Result;
+use bbq_steno::{dict::ortho, stroke::StenoWord, Stroke};
+use bbq_steno_macros::stroke;
+
+fn main() -> Result<()> {
+    let data: BTreeMap<String, String> =
+        serde_json::from_reader(File::open("../dict-convert/lapwing-base.json")?)?;
+    let mut dict = BTreeMap::new();
+    for (k, v) in data {
+        dict.insert(StenoWord::parse(&k)?.0, v);
+    }
+
+    let mut cases = Vec::new();
+    for (k, full) in &dict {
+        let last = k.len() - 1;
+        let ending = match to_ending(k[last]) {
+            Some(ending) => ending,
+            None => continue,
+        };
+        if let Some(short) = dict.get(&k[..last]) {
+            if short.chars().all(|ch| ch.is_ascii_alphabetic()) {
+                cases.push((short.as_str(), ending, full.as_str()));
+            }
+        }
+    }
+
+    let agree = cases.iter()
+        .filter(|(short, ending, full)| ortho::combine(short, ending) == *full)
+        .count();
+    println!("{} suffix entries, {} agree with the dictionary", cases.len(), agree);
+
+    const ROUNDS: usize = 100;
+
+    let start = Instant::now();
+    for _ in 0..ROUNDS {
+        for (short, ending, _) in &cases {
+            black_box(ortho::attach(black_box(short), black_box(ending)));
+        }
+    }
+    report("attach", start, ROUNDS * cases.len());
+
+    let start = Instant::now();
+    for _ in 0..ROUNDS {
+        for (short, ending, _) in &cases {
+            black_box(ortho::combine(black_box(short), black_box(ending)));
+        }
+    }
+    report("combine", start, ROUNDS * cases.len());
+
+    Ok(())
+}
+
+fn to_ending(stroke: Stroke) -> Option<&'static str> {
+    match stroke {
+        st if st == stroke!("-G") => Some("ing"),
+        st if st == stroke!("-Z") => Some("s"),
+        st if st == stroke!("-S") => Some("s"),
+        st if st == stroke!("-D") => Some("ed"),
+        _ => None,
+    }
+}
+
+fn report(name: &str, start: Instant, count: usize) {
+    let elapsed = start.elapsed();
+    println!("{:>8}: {:.1}ns per word ({} words in {:?})",
+             name, elapsed.as_nanos() as f64 / count as f64, count, elapsed);
+}
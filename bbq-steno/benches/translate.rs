@@ -0,0 +1,167 @@
+//! Benchmark the translator, replaying a stroke log through it.
+//!
+//! The log is read from the file named by `STROKE_LOG`, with whitespace
+//! separated steno, such as `TH/-S S KWRAOEPL`.  Without one, a log is made up
+//! of entries picked from the dictionary, with the occasional undo.  The log is
+//! replayed over the main dictionary loaded as a `RamDict`, and, if it has been
+//! built, over the `MemDict` image in `lapwing-base.bin`.
+
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    collections::BTreeMap,
+    fs::File,
+    hint::black_box,
+    sync::atomic::{AtomicUsize, Ordering},
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, bail, Result};
+use bbq_steno::{
+    dict::{Dict, MapDictBuilder, Translator},
+    memdict::MemDict,
+    stroke::StenoWord,
+    Stroke,
+};
+use bbq_steno_macros::stroke;
+
+/// Count the allocations, to check that translating doesn't go to the heap.
+struct Counting;
+
+static ALLOCS: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCS.fetch_add(1, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: Counting = Counting;
+
+/// Length of the made up log.
+const LOG_STROKES: usize = 20_000;
+
+fn main() -> Result<()> {
+    let data: BTreeMap<String, String> =
+        serde_json::from_reader(File::open("../dict-convert/lapwing-base.json")?)?;
+    let mut builder = MapDictBuilder::new();
+    for (k, v) in data {
+        builder.insert(StenoWord::parse(&k)?.0, v);
+    }
+    let ram: Dict = Box::leak(Box::new(builder.into_ram_dict()));
+
+    let log = match std::env::var("STROKE_LOG") {
+        Ok(path) => read_log(&path)?,
+        Err(_) => make_log(ram),
+    };
+    println!("{} strokes", log.len());
+
+    run("RamDict", ram, &log);
+
+    match load_image("../dict-convert/lapwing-base.bin") {
+        Some(image) => {
+            let ptr = image.as_ptr() as *const u8;
+            let mem = unsafe { MemDict::from_raw_ptr(ptr) }.ok_or_else(|| anyhow!("Invalid lapwing-base.bin"))?;
+            run("MemDict", Box::leak(Box::new(mem)), &log);
+            let mem = unsafe { MemDict::from_raw_ptr(ptr) }.unwrap().with_cache(1024);
+            run("Cached", Box::leak(Box::new(mem)), &log);
+        }
+        None => println!("No lapwing-base.bin, skipping MemDict"),
+    }
+
+    Ok(())
+}
+
+fn read_log(path: &str) -> Result<Vec<Stroke>> {
+    let text = std::fs::read_to_string(path)?;
+    let mut log = Vec::new();
+    for word in text.split_whitespace() {
+        log.extend(StenoWord::parse(word)?.0);
+    }
+    if log.is_empty() {
+        bail!("No strokes in {}", path);
+    }
+    Ok(log)
+}
+
+/// Make up a log from the dictionary's own entries.  The entries are picked
+/// with a fixed generator, so runs are comparable.
+fn make_log(dict: Dict) -> Vec<Stroke> {
+    let mut seed = 0x2545f491u32;
+    let mut next = move || {
+        seed = seed.wrapping_mul(1664525).wrapping_add(1013904223);
+        seed
+    };
+
+    let mut log = Vec::new();
+    while log.len() < LOG_STROKES {
+        if next() % 20 == 0 {
+            log.push(stroke!("*"));
+        } else {
+            let pick = next() as usize % dict.len();
+            log.extend_from_slice(dict.key(pick));
+        }
+    }
+    log
+}
+
+/// Load a dictionary image.  The image is copied into a buffer that is aligned
+/// for the tables in it.
+fn load_image(path: &str) -> Option<&'static [u32]> {
+    let bytes = std::fs::read(path).ok()?;
+    let mut buf = vec![0u32; (bytes.len() + 3) / 4];
+    unsafe {
+        std::ptr::copy_nonoverlapping(bytes.as_ptr(), buf.as_mut_ptr() as *mut u8, bytes.len());
+    }
+    Some(Box::leak(buf.into_boxed_slice()))
+}
+
+fn run(name: &str, dict: Dict, log: &[Stroke]) {
+    let mut xlat = Translator::new(dict);
+
+    // Warm up, and leave the history full.
+    replay(&mut xlat, log);
+
+    let mut times = Vec::with_capacity(log.len());
+    let mut selectors = 0;
+    let mut most_selectors = 0;
+    let allocs = ALLOCS.load(Ordering::Relaxed);
+    let start = Instant::now();
+    for &st in log {
+        let begin = Instant::now();
+        replay(&mut xlat, &[st]);
+        times.push(begin.elapsed());
+
+        let live = xlat.live_selectors();
+        selectors += live;
+        most_selectors = most_selectors.max(live);
+    }
+    let elapsed = start.elapsed();
+    let allocs = ALLOCS.load(Ordering::Relaxed) - allocs;
+
+    times.sort();
+    let count = log.len();
+    println!("{:>8}: {:.0} strokes/s, p50 {:?}, p99 {:?}, max {:?}",
+             name, count as f64 / elapsed.as_secs_f64(),
+             percentile(&times, 50), percentile(&times, 99), times[count - 1]);
+    println!("{:>8}  {:.2} allocations per stroke, {:.1} selectors per stroke (max {})",
+             "", allocs as f64 / count as f64, selectors as f64 / count as f64, most_selectors);
+}
+
+fn replay(xlat: &mut Translator, strokes: &[Stroke]) {
+    for &st in strokes {
+        xlat.add(st);
+        while let Some(action) = xlat.next_action() {
+            black_box(action);
+        }
+    }
+}
+
+fn percentile(times: &[Duration], pct: usize) -> Duration {
+    times[(times.len() - 1) * pct / 100]
+}
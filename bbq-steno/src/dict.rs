@@ -9,24 +9,26 @@
 
 extern crate alloc;
 
-use alloc::rc::Rc;
-use alloc::string::{String, ToString};
-
 use crate::Stroke;
 
-pub use self::mapdict::{RamDict, MapDictBuilder};
+pub use self::mapdict::{MapDict, RamDict, MapDictBuilder};
 pub use self::translate::Translator;
 pub use self::typer::TypeAction;
 
 mod mapdict;
-mod ortho;
+pub mod ops;
+pub mod ortho;
 mod translate;
 mod typer;
 
-pub type Dict = Rc<dyn DictImpl>;
+/// Dictionaries are borrowed for the life of the program.  On the device,
+/// they live in flash, and on the host they can be leaked from a Box.  This
+/// keeps selectors plain values that can be copied without touching the heap.
+pub type Dict = &'static dyn DictImpl;
 
 /// A Selector over a dictionary tracks a range of the dictionary that specifies
 /// a range of entries in the dictionary that cover a given prefix.
+#[derive(Clone, Copy)]
 pub struct Selector {
     /// The dictionary this entry applies to.
     dict: Dict,
@@ -39,6 +41,10 @@ pub struct Selector {
     /// lookups where stop is inclusive.
     pub left: usize,
     pub right: usize,
+
+    /// Dictionaries with an index use this to track where in the index this
+    /// selector is.  The value has no meaning to the selector itself.
+    node: u32,
 }
 
 impl alloc::fmt::Debug for Selector {
@@ -59,34 +65,30 @@ impl Selector {
             left,
             right,
             count: 0,
+            node: 0,
         }
     }
 
     /// Perform a single lookup step.  Returns a new cursor that matches the
     /// given token.  If there are zero entries in the dictionary that match,
     /// this will return None.
-    pub fn lookup_step(&self, key: Stroke) -> Option<(Selector, Option<String>)> {
-        let left = self.dict.scan(self.left, self.right, self.count, key);
-        // println!("left = {}", left);
-        let right = self.dict.scan(self.left, self.right, self.count, key.succ());
-        // println!("right = {}", right);
-        if right > left {
-            let key = self.dict.key(left);
-            let text = if key.len() == self.count + 1 {
-                Some(self.dict.value(left).to_string())
-            } else {
-                None
-            };
-            Some((Selector {
-                dict: self.dict.clone(),
-                count: self.count + 1,
-                left,
-                right,
-            },
-                  text))
+    pub fn lookup_step(&self, key: Stroke) -> Option<(Selector, Option<&'static str>)> {
+        let (left, right, node) = self.dict.step(self.left, self.right, self.count, self.node, key)?;
+        // println!("left = {}, right = {}", left, right);
+        let key = self.dict.key(left);
+        let text = if key.len() == self.count + 1 {
+            Some(self.dict.value(left))
         } else {
             None
-        }
+        };
+        Some((Selector {
+            dict: self.dict,
+            count: self.count + 1,
+            left,
+            right,
+            node,
+        },
+              text))
     }
 
     /// Is this selector uniqueue, meaning will any additional strokes possibly
@@ -103,6 +105,12 @@ pub trait DictImpl {
     fn key(&self, index: usize) -> &[Stroke];
     fn value(&self, index: usize) -> &str;
 
+    /// The number of strokes in the longest key.  This scans the whole
+    /// dictionary, which dictionaries that know already can avoid.
+    fn longest_key(&self) -> usize {
+        (0..self.len()).map(|i| self.key(i).len()).max().unwrap_or(0)
+    }
+
     /// For a given range of the dictionary, do a binary search for the given
     /// key as the nth character of a key.
     fn scan(&self, a: usize, b: usize, pos: usize, needle: Stroke) -> usize {
@@ -131,4 +139,88 @@ pub trait DictImpl {
         // Not found, this is our first key greater than the current one.
         left
     }
+
+    /// Find the range of entries within `[a, b)` whose stroke at `pos` is
+    /// `needle`.  The result is the same as two calls to `scan`, for `needle`
+    /// and `needle.succ()`, but the two searches share their work up until the
+    /// point where they would diverge.  Returns an empty range at the insertion
+    /// point if nothing matches.
+    fn equal_range(&self, a: usize, b: usize, pos: usize, needle: Stroke) -> (usize, usize) {
+        equal_range_by(a, b, needle, |i| self.key(i).get(pos).copied())
+    }
+
+    /// Narrow the range `[a, b)`, whose keys all share the same first `pos`
+    /// strokes, to those whose next stroke is `needle`.  `node` is the
+    /// dictionary's own index position for this range (0 for the full
+    /// dictionary).  Returns the new range, and its index position, or None if
+    /// no entries match.
+    ///
+    /// The default implementation doesn't have an index, and just searches the
+    /// sorted keys.
+    fn step(&self, a: usize, b: usize, pos: usize, node: u32, needle: Stroke) -> Option<(usize, usize, u32)> {
+        let _ = node;
+        scan_step(self, a, b, pos, needle)
+    }
+}
+
+/// Perform a lookup step by searching the sorted keys for the range.  This is
+/// the behavior of `DictImpl::step` for dictionaries without an index, and is
+/// available for those that have an index, but can't use it for a particular
+/// range.
+pub fn scan_step<D: DictImpl + ?Sized>(dict: &D, a: usize, b: usize, pos: usize, needle: Stroke) -> Option<(usize, usize, u32)> {
+    let (left, right) = dict.equal_range(a, b, pos, needle);
+    if right > left {
+        Some((left, right, 0))
+    } else {
+        None
+    }
+}
+
+/// The search behind `DictImpl::equal_range`.  `stroke_at` returns the stroke
+/// of the given entry at the position being searched, or None if that key is
+/// too short to have one (which sorts before any stroke).  Dictionaries can use
+/// this with an accessor that is cheaper than building the whole key.
+pub fn equal_range_by<F>(a: usize, b: usize, needle: Stroke, stroke_at: F) -> (usize, usize)
+    where F: Fn(usize) -> Option<Stroke>
+{
+    let mut left = a;
+    let mut right = b;
+    while left < right {
+        let mid = left + (right - left) / 2;
+        match stroke_at(mid) {
+            Some(st) if st == needle => {
+                // This is inside of the range, so the lower bound is in
+                // [left, mid], and the upper bound in [mid + 1, right].  Every
+                // entry before mid is either a match or less than it, and every
+                // one after is either a match or greater.
+                let mut lo = left;
+                let mut hi = mid;
+                while lo < hi {
+                    let m = lo + (hi - lo) / 2;
+                    if stroke_at(m) == Some(needle) {
+                        hi = m;
+                    } else {
+                        lo = m + 1;
+                    }
+                }
+                let low = lo;
+
+                let mut lo = mid + 1;
+                let mut hi = right;
+                while lo < hi {
+                    let m = lo + (hi - lo) / 2;
+                    if stroke_at(m) == Some(needle) {
+                        lo = m + 1;
+                    } else {
+                        hi = m;
+                    }
+                }
+                return (low, lo);
+            }
+            Some(st) if st > needle => right = mid,
+            _ => left = mid + 1,
+        }
+    }
+
+    (left, left)
 }
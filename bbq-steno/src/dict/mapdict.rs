@@ -1,10 +1,10 @@
 //! Simple dictionary implemented with maps.
 
 use alloc::collections::BTreeMap;
-use alloc::string::String;
+use alloc::string::{String, ToString};
 use alloc::vec::Vec;
 
-use super::DictImpl;
+use super::{equal_range_by, ops, DictImpl};
 use crate::Stroke;
 
 extern crate alloc;
@@ -41,6 +41,19 @@ impl DictImpl for RamDict {
         let b = b as usize;
         &self.text[a..b]
     }
+
+    /// Search the stroke table directly, without building each key.
+    fn equal_range(&self, a: usize, b: usize, pos: usize, needle: Stroke) -> (usize, usize) {
+        equal_range_by(a, b, needle, |i| {
+            let (start, end) = self.keys[i];
+            let p = start as usize + pos;
+            if p < end as usize {
+                Some(self.strokes[p])
+            } else {
+                None
+            }
+        })
+    }
 }
 
 /// A dictionary builder.
@@ -48,26 +61,75 @@ pub struct MapDictBuilder {
     map: BTreeMap<Vec<Stroke>, String>,
 }
 
-/*
-impl Dict for MapDict {
-    fn lookup<'a>(&'a self, query: &[Stroke]) -> Option<&'a str> {
-        self.map.get(query).map(|s| s.as_ref())
+/// A dictionary for working with on the host, such as by the tools that check
+/// dictionaries.  Along with the sorted entries, this keeps an index of them by
+/// their definitions, so that lookups can be done in either direction.
+pub struct MapDict {
+    /// The entries, sorted by key.
+    entries: Vec<(Vec<Stroke>, String)>,
+    /// The index of each entry, sorted by definition, then key.
+    by_text: Vec<u32>,
+    longest: usize,
+}
+
+impl MapDict {
+    /// Look up the definition of exactly these strokes.
+    pub fn lookup(&self, key: &[Stroke]) -> Option<&str> {
+        let pos = self.entries.binary_search_by(|(k, _)| k.as_slice().cmp(key)).ok()?;
+        Some(&self.entries[pos].1)
     }
 
-    fn longest_key(&self) -> usize {
-        self.longest
+    /// Iterate over the keys in the dictionary, in order.
+    pub fn keys(&self) -> impl Iterator<Item = &[Stroke]> {
+        self.entries.iter().map(|(k, _)| k.as_slice())
+    }
+
+    /// Iterate over the entries in the dictionary, in order.
+    pub fn iter(&self) -> impl Iterator<Item = (&[Stroke], &str)> {
+        self.entries.iter().map(|(k, v)| (k.as_slice(), v.as_str()))
+    }
+
+    /// Iterate over the entries whose keys start with the given strokes,
+    /// including the entry for exactly those strokes.
+    pub fn prefix(&self, prefix: &[Stroke]) -> impl Iterator<Item = (&[Stroke], &str)> {
+        let start = self.entries.partition_point(|(k, _)| k.as_slice() < prefix);
+        let len = self.entries[start..].partition_point(|(k, _)| k.starts_with(prefix));
+        self.entries[start..start + len].iter().map(|(k, v)| (k.as_slice(), v.as_str()))
+    }
+
+    /// Iterate over the keys that have the given definition, in order.
+    pub fn strokes_for<'a>(&'a self, text: &'a str) -> impl Iterator<Item = &'a [Stroke]> {
+        let start = self.by_text.partition_point(|&i| self.entries[i as usize].1.as_str() < text);
+        self.by_text[start..].iter()
+            .map(move |&i| &self.entries[i as usize])
+            .take_while(move |(_, v)| v == text)
+            .map(|(k, _)| k.as_slice())
+    }
+
+    /// The entries, as a slice, so they can be split up to be worked on in
+    /// parallel.
+    pub fn entries(&self) -> &[(Vec<Stroke>, String)] {
+        &self.entries
     }
 }
-*/
 
-/*
-impl MapDict {
-    /// Iterate over the keys in the dictionary.
-    pub fn keys(&self) -> impl Iterator<Item = &[Stroke]> {
-        self.map.keys().map(|k| k.as_slice())
+impl DictImpl for MapDict {
+    fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    fn key(&self, index: usize) -> &[Stroke] {
+        &self.entries[index].0
+    }
+
+    fn value(&self, index: usize) -> &str {
+        &self.entries[index].1
+    }
+
+    fn longest_key(&self) -> usize {
+        self.longest
     }
 }
-*/
 
 impl MapDictBuilder {
     pub fn new() -> MapDictBuilder {
@@ -76,21 +138,31 @@ impl MapDictBuilder {
         }
     }
 
-    /// Insert a definition.
+    /// Insert a definition, in Plover's notation.
     pub fn insert(&mut self, key: Vec<Stroke>, definition: String) {
-        self.map.insert(key, definition);
+        self.map.insert(key, ops::compile(&definition));
     }
 
-    /*
-    /// Freeze the dictionary.
+    /// Add every entry of another dictionary, replacing any existing
+    /// definitions.  Merging a stack of dictionaries this way, lowest priority
+    /// first, gives a single dictionary with the same translations as the
+    /// stack, that is searched in a single walk, instead of once per layer.
+    /// The definitions are already compiled.
+    pub fn merge(&mut self, dict: &dyn DictImpl) {
+        for i in 0..dict.len() {
+            self.map.insert(dict.key(i).to_vec(), dict.value(i).to_string());
+        }
+    }
+
+    /// Freeze into a MapDict.
     pub fn into_map_dict(self) -> MapDict {
         let longest = self.map.keys().map(|k| k.len()).max().unwrap_or(0);
-        MapDict {
-            map: self.map,
-            longest,
-        }
+        let entries: Vec<_> = self.map.into_iter().collect();
+        let mut by_text: Vec<u32> = (0..entries.len() as u32).collect();
+        // The sort is stable, so the keys for each definition stay in order.
+        by_text.sort_by(|&a, &b| entries[a as usize].1.cmp(&entries[b as usize].1));
+        MapDict { entries, by_text, longest }
     }
-    */
 
     /// Freeze into a RamDict.
     pub fn into_ram_dict(self) -> RamDict {
@@ -0,0 +1,362 @@
+//! Compiled definitions.
+//!
+//! Definitions in Plover's notation mix the text to type with commands in
+//! braces.  When a dictionary is built, these are compiled into the text with
+//! each command replaced by a control character, so that nothing has to parse
+//! the notation while translating.  The compiled form is still valid UTF-8, so
+//! it can be borrowed directly from the dictionary as a `&str`, and plain
+//! definitions, which are most of them, compile to themselves.
+//!
+//! The operations are:
+//! - `ATTACH`: no space between the text on either side.  `{^}`, and the `^`
+//!   of `{^ing}` or `{in^}`.
+//! - `CAP` and `LOWER`: change the case of the next letter typed.  `{-|}` and
+//!   `{>}`.
+//! - `GLUE`: the text attaches to neighbouring text that is also glued.
+//!   `{&a}`.
+//! - `KEY`: a key press, followed by the modifiers as `'@'` plus the `MOD_`
+//!   bits, and the HID usage as two hex digits.  `{#Control_L(a)}`.
+//!
+//! The typer handles the operations at the start and the end of a definition,
+//! which decide how it joins with its neighbours.  Of those in the middle, only
+//! `KEY` does anything.  Commands that can't be done here, such as Plover's
+//! mode changes, are dropped.
+
+extern crate alloc;
+
+use alloc::string::String;
+
+pub const ATTACH: char = '\x01';
+pub const CAP: char = '\x02';
+pub const LOWER: char = '\x03';
+pub const GLUE: char = '\x04';
+pub const KEY: char = '\x05';
+
+/// The modifier bits of a `KEY`.  These are the upper byte of a report stream
+/// step.
+pub const MOD_SHIFT: u8 = 0x01;
+pub const MOD_CONTROL: u8 = 0x02;
+pub const MOD_ALT: u8 = 0x04;
+pub const MOD_GUI: u8 = 0x08;
+
+/// Is this character one of the operations?
+pub fn is_op(ch: char) -> bool {
+    (ATTACH..=KEY).contains(&ch)
+}
+
+/// Does the compiled text have no operations in it, so that it is exactly what
+/// appears on the screen?
+pub fn is_plain(text: &str) -> bool {
+    !text.contains(is_op)
+}
+
+/// A piece of compiled text, as it is typed.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum Piece {
+    Char(char),
+    /// A key press, with the `MOD_` bits, and the HID usage.
+    Key(u8, u8),
+}
+
+/// The pieces of compiled text that are typed.  Operations other than `KEY`
+/// are left out.
+pub fn pieces(text: &str) -> Pieces<'_> {
+    Pieces(text)
+}
+
+pub struct Pieces<'a>(&'a str);
+
+impl<'a> Iterator for Pieces<'a> {
+    type Item = Piece;
+
+    fn next(&mut self) -> Option<Piece> {
+        loop {
+            let mut chars = self.0.chars();
+            let ch = chars.next()?;
+            self.0 = chars.as_str();
+            if ch == KEY {
+                let code = self.0.get(..3)?;
+                self.0 = &self.0[3..];
+                let mods = code.as_bytes()[0].wrapping_sub(b'@');
+                if let Ok(usage) = u8::from_str_radix(&code[1..], 16) {
+                    return Some(Piece::Key(mods & 0x0f, usage));
+                }
+            } else if !is_op(ch) {
+                return Some(Piece::Char(ch));
+            }
+        }
+    }
+}
+
+/// The number of characters of compiled text that appear on the screen.
+pub fn visible_len(text: &str) -> usize {
+    pieces(text).filter(|p| matches!(p, Piece::Char(_))).count()
+}
+
+/// The case change of `CAP` and `LOWER`.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum Case {
+    Upper,
+    Lower,
+}
+
+/// A compiled definition, split into the text to type, and the operations
+/// around it that decide how it joins with what is typed before and after.
+#[derive(Debug, Default)]
+pub struct Definition {
+    pub text: &'static str,
+    /// No space before the text.
+    pub attach_before: bool,
+    /// No space before the next text.
+    pub attach_after: bool,
+    /// The text is glued.
+    pub glue: bool,
+    /// Change the case of the start of the text.
+    pub case_before: Option<Case>,
+    /// Change the case of the start of the next text.
+    pub case_after: Option<Case>,
+}
+
+impl Definition {
+    /// Split a compiled definition.  If it is nothing but operations, they all
+    /// apply to the text that follows.
+    pub fn split(def: &'static str) -> Definition {
+        let mut result = Definition::default();
+        // The code of a `KEY` has no operations in it, so the key stays in the
+        // text.
+        let body = def.trim_end_matches(|ch| is_op(ch) && ch != KEY);
+        for ch in def[body.len()..].chars() {
+            result.apply(ch, false);
+        }
+
+        let text = body.trim_start_matches(|ch| is_op(ch) && ch != KEY);
+        for ch in body[..body.len() - text.len()].chars() {
+            result.apply(ch, true);
+        }
+        result.text = text;
+        result
+    }
+
+    fn apply(&mut self, op: char, before: bool) {
+        match op {
+            ATTACH if before => self.attach_before = true,
+            ATTACH => self.attach_after = true,
+            GLUE => self.glue = true,
+            CAP | LOWER => {
+                let case = Some(if op == CAP { Case::Upper } else { Case::Lower });
+                if before {
+                    self.case_before = case;
+                } else {
+                    self.case_after = case;
+                }
+            }
+            _ => (),
+        }
+    }
+}
+
+/// Compile a definition in Plover's notation.
+pub fn compile(def: &str) -> String {
+    let mut out = String::with_capacity(def.len());
+    compile_into(&mut out, def);
+    out
+}
+
+/// Compile a definition in Plover's notation, appending it to `out`.
+pub fn compile_into(out: &mut String, def: &str) {
+    let mut rest = def;
+    while let Some(ch) = rest.chars().next() {
+        rest = &rest[ch.len_utf8()..];
+        match ch {
+            '\\' if rest.starts_with(['{', '}']) => {
+                out.push_str(&rest[..1]);
+                rest = &rest[1..];
+            }
+            '{' => {
+                let end = rest.find('}').unwrap_or(rest.len());
+                command(out, &rest[..end]);
+                rest = rest.get(end + 1..).unwrap_or("");
+            }
+            '\n' => push_key(out, 0, RETURN),
+            '\t' => push_key(out, 0, TAB),
+            ch if is_op(ch) => (),
+            ch => out.push(ch),
+        }
+    }
+}
+
+/// Compile a single command, the text inside of the braces.
+fn command(out: &mut String, cmd: &str) {
+    match cmd {
+        "" => return,
+        "^" => return out.push(ATTACH),
+        "-|" => return out.push(CAP),
+        ">" => return out.push(LOWER),
+        "." | "?" | "!" => {
+            out.push(ATTACH);
+            out.push_str(cmd);
+            out.push(CAP);
+            return;
+        }
+        "," | ":" | ";" => {
+            out.push(ATTACH);
+            out.push_str(cmd);
+            return;
+        }
+        _ => (),
+    }
+
+    if let Some(keys) = cmd.strip_prefix('#') {
+        // All or nothing, so a typo doesn't press half of the keys.
+        let mut combos = [(0, 0); 8];
+        let mut count = 0;
+        for combo in keys.split_whitespace() {
+            match (parse_combo(combo), combos.get_mut(count)) {
+                (Some(key), Some(slot)) => *slot = key,
+                _ => return,
+            }
+            count += 1;
+        }
+        for &(mods, usage) in &combos[..count] {
+            push_key(out, mods, usage);
+        }
+        return;
+    }
+
+    if let Some(text) = cmd.strip_prefix('&') {
+        out.push(GLUE);
+        out.push_str(text);
+        return;
+    }
+
+    let (before, inner) = match cmd.strip_prefix('^') {
+        Some(inner) => (true, inner),
+        None => (false, cmd),
+    };
+    let (after, inner) = match inner.strip_suffix('^') {
+        Some(inner) => (true, inner),
+        None => (false, inner),
+    };
+    // Carrying the capitalization across the text isn't supported, just type
+    // the text.
+    let inner = inner.strip_prefix("~|").unwrap_or(inner);
+
+    // The retroactive commands, and Plover's own, such as `{PLOVER:...}` and
+    // `{MODE:...}`, can't be done here.
+    if !(before || after) && (inner.starts_with('*') || inner.contains(':')) {
+        return;
+    }
+
+    if before {
+        out.push(ATTACH);
+    }
+    for ch in inner.chars() {
+        match ch {
+            '\n' => push_key(out, 0, RETURN),
+            '\t' => push_key(out, 0, TAB),
+            ch if is_op(ch) => (),
+            ch => out.push(ch),
+        }
+    }
+    if after {
+        out.push(ATTACH);
+    }
+}
+
+fn push_key(out: &mut String, mods: u8, usage: u8) {
+    const HEX: &[u8] = b"0123456789abcdef";
+    out.push(KEY);
+    out.push((b'@' + mods) as char);
+    out.push(HEX[usage as usize >> 4] as char);
+    out.push(HEX[usage as usize & 0xf] as char);
+}
+
+/// Parse a key combination, such as `Control_L(Shift_L(a))`.
+fn parse_combo(combo: &str) -> Option<(u8, u8)> {
+    if let Some(open) = combo.find('(') {
+        let inner = combo[open + 1..].strip_suffix(')')?;
+        let name = &combo[..open];
+        let modifier = MODIFIERS.iter().find(|(n, _)| n.eq_ignore_ascii_case(name))?.1;
+        let (mods, usage) = parse_combo(inner)?;
+        return Some((mods | modifier, usage));
+    }
+    key_usage(combo).map(|usage| (0, usage))
+}
+
+const RETURN: u8 = 0x28;
+const TAB: u8 = 0x2b;
+
+/// The modifiers, by their X keysym names.
+const MODIFIERS: &[(&str, u8)] = &[
+    ("shift", MOD_SHIFT), ("shift_l", MOD_SHIFT), ("shift_r", MOD_SHIFT),
+    ("control", MOD_CONTROL), ("control_l", MOD_CONTROL), ("control_r", MOD_CONTROL),
+    ("alt", MOD_ALT), ("alt_l", MOD_ALT), ("alt_r", MOD_ALT),
+    ("option", MOD_ALT),
+    ("super", MOD_GUI), ("super_l", MOD_GUI), ("super_r", MOD_GUI),
+    ("command", MOD_GUI), ("windows", MOD_GUI),
+];
+
+/// The HID usages of the keys that aren't letters, digits or function keys,
+/// by their X keysym names.
+const KEYS: &[(&str, u8)] = &[
+    ("return", RETURN), ("escape", 0x29), ("backspace", 0x2a), ("tab", TAB),
+    ("space", 0x2c), ("minus", 0x2d), ("equal", 0x2e), ("bracketleft", 0x2f),
+    ("bracketright", 0x30), ("backslash", 0x31), ("semicolon", 0x33),
+    ("apostrophe", 0x34), ("grave", 0x35), ("comma", 0x36), ("period", 0x37),
+    ("slash", 0x38), ("print", 0x46), ("pause", 0x48), ("insert", 0x49),
+    ("home", 0x4a), ("page_up", 0x4b), ("delete", 0x4c), ("end", 0x4d),
+    ("page_down", 0x4e), ("right", 0x4f), ("left", 0x50), ("down", 0x51),
+    ("up", 0x52),
+];
+
+/// The HID usage of a key, by its X keysym name.
+fn key_usage(name: &str) -> Option<u8> {
+    let bytes = name.as_bytes();
+    match bytes {
+        [ch @ b'a'..=b'z'] | [ch @ b'A'..=b'Z'] => Some(0x04 + (ch.to_ascii_lowercase() - b'a')),
+        [b'0'] => Some(0x27),
+        [ch @ b'1'..=b'9'] => Some(0x1e + (ch - b'1')),
+        [b'F' | b'f', ..] => match name[1..].parse::<u8>() {
+            Ok(n @ 1..=12) => Some(0x3a + n - 1),
+            _ => None,
+        },
+        _ => KEYS.iter().find(|(n, _)| n.eq_ignore_ascii_case(name)).map(|&(_, usage)| usage),
+    }
+}
+
+#[test]
+fn test_compile() {
+    let cases = [
+        ("word", "word"),
+        ("{^ing}", "\x01ing"),
+        ("{in^}", "in\x01"),
+        ("{.}", "\x01.\x02"),
+        ("{,}", "\x01,"),
+        ("{-|}", "\x02"),
+        ("{&a}", "\x04a"),
+        ("{#Return}", "\x05@28"),
+        ("{#Control_L(Shift_L(z)) BackSpace}", "\x05C1d\x05@2a"),
+        ("{#Hyper(a)}", ""),
+        ("{PLOVER:TOGGLE}", ""),
+        ("{*-|}Street", "Street"),
+        ("{^:25}", "\x01:25"),
+        ("\\{{^}", "{\x01"),
+        ("{.}{^\n^}{-|}", "\x01.\x02\x01\x05@28\x01\x02"),
+    ];
+    for (def, compiled) in cases {
+        assert_eq!(compile(def), compiled, "compiling {:?}", def);
+    }
+
+    let def = Definition::split("\x01.\x02");
+    assert_eq!(def.text, ".");
+    assert!(def.attach_before && !def.attach_after);
+    assert_eq!(def.case_after, Some(Case::Upper));
+
+    let def = Definition::split("\x02");
+    assert_eq!(def.text, "");
+    assert_eq!((def.case_before, def.case_after), (None, Some(Case::Upper)));
+
+    assert_eq!(pieces("a\x05C1d\x01b").collect::<alloc::vec::Vec<_>>(),
+               [Piece::Char('a'), Piece::Key(MOD_CONTROL | MOD_SHIFT, 0x1d), Piece::Char('b')]);
+    assert_eq!(visible_len("\x01a\x05@28b"), 2);
+}
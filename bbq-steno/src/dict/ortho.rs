@@ -1,214 +1,397 @@
 //! English orthography rules.
 
-// These are taken directly from the orthography rules in plover. The regexes
-// have been converted to work with safe-regex which compiles the regexes to a
-// state machine at compile time.
-
-#![allow(dead_code)]
-
-#[cfg(any())]
-mod engine {
-    extern crate alloc;
-    use alloc::{string::String, format, vec::Vec};
-
-    use safe_regex::regex;
-
-    /// Pattern code for patterns that have 1 captured pattern.
-    macro_rules! pat1 {
-        ($src: expr, $re: expr, $replacement:expr) => {
-            if let Some((a,)) =
-                $re.match_slices($src.as_bytes())
-            {
-                return replace(&[a], $replacement);
-            }
-        };
+// These are taken directly from the orthography rules in plover.  Rather than
+// running each regex in turn, every rule is written out as a pattern on the end
+// of the left word, and a set of suffixes it applies to.  Tables, built at
+// compile time, select the rules that could apply from the last character of
+// the word and the first character of the suffix, so only a handful of rules
+// are ever tried.  Rules are still tried in plover's order, and the first match
+// wins.
+
+extern crate alloc;
+
+use alloc::{string::String, format};
+
+use arrayvec::ArrayString;
+
+/// How to attach a suffix to a word.
+#[derive(Debug, Eq, PartialEq)]
+pub struct Attach {
+    /// The number of bytes to remove from the end of the word.
+    pub drop: usize,
+    /// Text to insert between the word and the suffix.
+    pub insert: ArrayString<4>,
+    /// The number of bytes to skip at the start of the suffix.
+    pub skip: usize,
+}
+
+/// Combine a word and a suffix, following the orthography rules.
+pub fn combine(left: &str, right: &str) -> String {
+    match attach(left, right) {
+        Some(att) => format!("{}{}{}", &left[..left.len() - att.drop], att.insert, &right[att.skip..]),
+        None => format!("{}{}", left, right),
     }
+}
 
-    /// Pattern code for patterns that have 2 captured patterns.
-    macro_rules! pat2 {
-        ($src: expr, $re: expr, $replacement:expr) => {
-            if let Some((a, b)) =
-                $re.match_slices($src.as_bytes())
-            {
-                return replace(&[a, b], $replacement);
+/// Determine how a suffix should attach to a word.  Returns None if no rule
+/// applies, and the two should just be joined.
+pub fn attach(left: &str, right: &str) -> Option<Attach> {
+    let (last, first) = match (left.as_bytes().last(), right.as_bytes().first()) {
+        (Some(&last), Some(&first)) => (last, first),
+        _ => return None,
+    };
+
+    let mut candidates = LEFT_INDEX[slot(last)] & RIGHT_INDEX[slot(first)];
+    while candidates != 0 {
+        let rule = &RULES[candidates.trailing_zeros() as usize];
+        candidates &= candidates - 1;
+        if rule.matches(left.as_bytes(), right) {
+            let mut insert = ArrayString::new();
+            insert.push_str(rule.insert);
+            if rule.double {
+                insert.push(left.as_bytes()[left.len() - 1] as char);
             }
-        };
+            return Some(Attach { drop: rule.drop, insert, skip: rule.skip });
+        }
     }
+    None
+}
 
-    /// Pattern code for patterns that have 2 captured patterns.
-    macro_rules! pat3 {
-        ($src: expr, $re: expr, $replacement:expr) => {
-            if let Some((a, b, c)) =
-                $re.match_slices($src.as_bytes())
-            {
-                return replace(&[a, b, c], $replacement);
-            }
-        };
+/// A single orthography rule.
+struct Rule {
+    /// Character classes that the end of the left word must match, one per
+    /// character.  A class starting with '^' matches any character not
+    /// listed.
+    left: &'static [&'static str],
+    /// The minimum number of characters in the word before these.
+    stem: usize,
+    /// The suffixes this rule applies to.
+    right: Right,
+    /// Number of characters to remove from the end of the word.
+    drop: usize,
+    /// Text to insert between the word and suffix.
+    insert: &'static str,
+    /// Whether the last character of the word should be doubled.
+    double: bool,
+    /// Number of characters to remove from the start of the suffix.
+    skip: usize,
+}
+
+enum Right {
+    /// One of these exact suffixes.
+    Exact(&'static [&'static str]),
+    /// A suffix starting with a character of the class, of at least the given
+    /// length.
+    Starts(&'static str, usize),
+}
+
+impl Rule {
+    fn matches(&self, left: &[u8], right: &str) -> bool {
+        if left.len() < self.stem + self.left.len() {
+            return false;
+        }
+        let tail = &left[left.len() - self.left.len()..];
+        if !self.left.iter().zip(tail).all(|(class, &ch)| in_class(class, ch)) {
+            return false;
+        }
+        match self.right {
+            Right::Exact(words) => words.iter().any(|w| *w == right),
+            Right::Starts(class, min) => right.len() >= min && in_class(class, right.as_bytes()[0]),
+        }
     }
+}
 
-    fn replace(caps: &[&[u8]], replacement: &str) -> String {
-        let caps: Vec<_> = caps.into_iter().map(|s| String::from_utf8(s.to_vec()).unwrap()).collect();
-        let mut dollar = false;
-        let mut result = String::new();
-        for ch in replacement.chars() {
-            if dollar {
-                match ch {
-                    '1' ..= '9' => {
-                        let offset = (ch as usize) - ('1' as usize);
-                        result.push_str(&caps[offset])
-                    }
-                    '$' => {
-                        result.push('$');
+fn in_class(class: &str, ch: u8) -> bool {
+    match class.as_bytes() {
+        [b'^', rest @ ..] => !rest.contains(&ch),
+        all => all.contains(&ch),
+    }
+}
+
+/// Rules are indexed by character, a-z and everything else.
+const SLOTS: usize = 27;
+
+const fn slot(ch: u8) -> usize {
+    if ch >= b'a' && ch <= b'z' {
+        (ch - b'a') as usize
+    } else {
+        SLOTS - 1
+    }
+}
+
+/// The slots a character class can match, as a bitmask.
+const fn class_slots(class: &str) -> u32 {
+    let bytes = class.as_bytes();
+    let negate = !bytes.is_empty() && bytes[0] == b'^';
+    let mut mask = 0;
+    let mut i = if negate { 1 } else { 0 };
+    while i < bytes.len() {
+        mask |= 1 << slot(bytes[i]);
+        i += 1;
+    }
+    if negate {
+        !mask & ((1 << SLOTS) - 1)
+    } else {
+        mask
+    }
+}
+
+/// Build the index of rules that could apply to words ending with each
+/// character, or suffixes starting with each character.
+const fn build_index(rules: &[Rule], left: bool) -> [u64; SLOTS] {
+    let mut index = [0u64; SLOTS];
+    let mut r = 0;
+    while r < rules.len() {
+        let rule = &rules[r];
+        let slots = if left {
+            class_slots(rule.left[rule.left.len() - 1])
+        } else {
+            match rule.right {
+                Right::Exact(words) => {
+                    let mut slots = 0;
+                    let mut w = 0;
+                    while w < words.len() {
+                        slots |= 1 << slot(words[w].as_bytes()[0]);
+                        w += 1;
                     }
-                    _ => panic!("Invalid escape char: {:?}", ch),
-                }
-                dollar = false;
-            } else {
-                if ch == '$' {
-                    dollar = true;
-                } else {
-                    result.push(ch)
+                    slots
                 }
+                Right::Starts(class, _) => class_slots(class),
+            }
+        };
+        let mut s = 0;
+        while s < SLOTS {
+            if slots & (1 << s) != 0 {
+                index[s] |= 1 << r;
             }
+            s += 1;
         }
-        result
-    }
-
-    pub fn combine(left: &str, right: &str) -> String {
-        let text = format!("{} ^ {}", left, right);
-
-        // These are taken directly from the plover english orthography rules. The
-        // changes are: 1. Make the regex's br"" strings, 2. change the replacement
-        // to an r"", 3. Replace the backslashes in the replacement with dollar (not
-        // really needed, but I'd already done it for regex. 4. Insert into macro to
-        // handle. 5. Remove the '^' and '$' from the patterns (these don't work
-        // with safe regex, the patterns are always full matches.
-
-        // == +ly ==
-        // artistic + ly = artistically
-        pat1!(text, regex!(br"(.*[aeiou]c) \^ ly"), r"$1ally");
-        // humble + ly = humbly (*humblely)
-        // questionable +ly = questionably
-        // triple +ly = triply
-        pat1!(text, regex!(br"(.+[aeioubmnp])le \^ ly"), r"$1ly");
-
-        // == +ry ==
-        // statute + ry = statutory
-        pat2!(text, regex!(br"(.*t)e \^ (ry|ary)"), r"$1ory");
-        // confirm +tory = confirmatory (*confirmtory)
-        pat2!(text, regex!(br"(.+)m \^ tor(y|ily)"), r"$1mator$2");
-        // supervise +ary = supervisory (*supervisary)
-        pat2!(text, regex!(br"(.+)se \^ ar(y|ies)"), r"$1sor$2");
-
-        // == t +cy ==
-        // frequent + cy = frequency (tcy/tecy removal)
-        pat1!(text, regex!(br"(.*[naeiou])te? \^ cy"), r"$1cy");
-
-        // == +s ==
-        // establish + s = establishes (sibilant pluralization)
-        pat1!(text, regex!(br"(.*(?:s|sh|x|z|zh)) \^ s"), r"$1es");
-
-        // speech + s = speeches (soft ch pluralization)
-        // PERL crap: TODO: Can we do this without this?
-        // (r"^(.*(?:oa|ea|i|ee|oo|au|ou|l|n|(?<![gin]a)r|t)ch) \^ s$", r"$1es"),
-        pat1!(text, regex!(br"(.*(?:oa|ea|i|ee|oo|au|ou|l|n|[^gin]ar|t)ch) \^ s"), r"$1es");
-
-        // cherry + s = cherries (consonant + y pluralization)
-        pat1!(text, regex!(br"(.+[bcdfghjklmnpqrstvwxz])y \^ s"), r"$1ies");
-
-        // == y ==
-        // die+ing = dying
-        pat1!(text, regex!(br"(.+)ie \^ ing"), r"$1ying");
-        // metallurgy + ist = metallurgist
-        pat1!(text, regex!(br"(.+[cdfghlmnpr])y \^ ist"), r"$1ist");
-        // beauty + ful = beautiful (y -> i)
-        pat2!(text, regex!(br"(.+[bcdfghjklmnpqrstvwxz])y \^ ([a-hj-xz].*)"), r"$1i$2");
-
-        // == +en ==
-        // write + en = written
-        pat1!(text, regex!(br"(.+)te \^ en"), r"$1tten");
-        // Minessota +en = Minessotan (*Minessotaen)
-        pat2!(text, regex!(br"(.+[ae]) \^ e(n|ns)"), r"$1$2");
-
-        // == +ial ==
-        // ceremony +ial = ceremonial (*ceremonyial)
-        pat2!(text, regex!(br"(.+)y \^ (ial|ially)"), r"$1$2");
-        // == +if ==
-        // spaghetti +ification = spaghettification (*spaghettiification)
-        pat2!(text, regex!(br"(.+)i \^ if(y|ying|ied|ies|ication|ications)"), r"$1if$2");
-
-        // == +ical ==
-        // fantastic +ical = fantastical (*fantasticcal)
-        pat2!(text, regex!(br"(.+)ic \^ (ical|ically)"), r"$1$2");
-        // epistomology +ical = epistomological
-        pat2!(text, regex!(br"(.+)ology \^ ic(al|ally)"), r"$1ologic$2");
-        // oratory +ical = oratorical (*oratoryical)
-        pat2!(text, regex!(br"(.*)ry \^ ica(l|lly|lity)"), r"$1rica$2");
-
-        // == +ist ==
-        // radical +ist = radicalist (*radicallist)
-        pat2!(text, regex!(br"(.*[l]) \^ is(t|ts)"), r"$1is$2");
-
-        // == +ity ==
-        // complementary +ity = complementarity (*complementaryity)
-        pat1!(text, regex!(br"(.*)ry \^ ity"), r"$1rity");
-        // disproportional +ity = disproportionality (*disproportionallity)
-        pat1!(text, regex!(br"(.*)l \^ ity"), r"$1lity");
-
-        // == +ive, +tive ==
-        // perform +tive = performative (*performtive)
-        pat2!(text, regex!(br"(.+)rm \^ tiv(e|ity|ities)"), r"$1rmativ$2");
-        // restore +tive = restorative
-        pat2!(text, regex!(br"(.+)e \^ tiv(e|ity|ities)"), r"$1ativ$2");
-
-        // == +ize ==
-        // token +ize = tokenize (*tokennize)
-        // token +ise = tokenise (*tokennise)
-        pat2!(text, regex!(br"(.+)y \^ iz(e|es|ing|ed|er|ers|ation|ations|able|ability)"), r"$1iz$2");
-        pat2!(text, regex!(br"(.+)y \^ is(e|es|ing|ed|er|ers|ation|ations|able|ability)"), r"$1is$2");
-        // conditional +ize = conditionalize (*conditionallize)
-        pat2!(text, regex!(br"(.+)al \^ iz(e|ed|es|ing|er|ers|ation|ations|m|ms|able|ability|abilities)"), r"$1aliz$2");
-        pat2!(text, regex!(br"(.+)al \^ is(e|ed|es|ing|er|ers|ation|ations|m|ms|able|ability|abilities)"), r"$1alis$2");
-        // spectacular +ization = spectacularization (*spectacularrization)
-        pat2!(text, regex!(br"(.+)ar \^ iz(e|ed|es|ing|er|ers|ation|ations|m|ms)"), r"$1ariz$2");
-        pat2!(text, regex!(br"(.+)ar \^ is(e|ed|es|ing|er|ers|ation|ations|m|ms)"), r"$1aris$2");
-
-        // category +ize/+ise = categorize/categorise (*categoryize/ *categoryise)
-        // custom +izable/+isable = customizable/customisable (*custommizable/ *custommisable)
-        // fantasy +ize = fantasize (*fantasyize)
-        pat2!(text, regex!(br"(.*[lmnty]) \^ iz(e|es|ing|ed|er|ers|ation|ations|m|ms|able|ability|abilities)"), r"$1iz$2");
-        pat2!(text, regex!(br"(.*[lmnty]) \^ is(e|es|ing|ed|er|ers|ation|ations|m|ms|able|ability|abilities)"), r"$1is$2");
-
-        // == +olog ==
-        // criminal + ology = criminology
-        // criminal + ologist = criminalogist (*criminallologist)
-        pat2!(text, regex!(br"(.+)al \^ olog(y|ist|ists|ical|ically)"), r"$1olog$2");
-
-        // == +ish ==
-        // similar +ish = similarish (*similarrish)
-        pat2!(text, regex!(br"(.+)(ar|er|or) \^ ish"), r"$1$2ish");
-
-        // free + ed = freed
-        pat2!(text, regex!(br"(.+e)e \^ (e.+)"), r"$1$2");
-        // narrate + ing = narrating (silent e)
-        pat2!(text, regex!(br"(.+[bcdfghjklmnpqrstuvwxz])e \^ ([aeiouy].*)"), r"$1$2");
-
-        // == misc ==
-        // defer + ed = deferred (consonant doubling)   XXX monitor(stress not on last syllable)
-        pat3!(text, regex!(br"(.*(?:[bcdfghjklmnprstvwxyz]|qu)[aeiou])([bcdfgklmnprtvz]) \^ ([aeiouy].*)"), r"$1$2$2$3");
-
-        format!("{}{}", left, right)
+        r += 1;
     }
+    index
 }
 
-#[cfg(all())]
-mod engine {
-    extern crate alloc;
-    use alloc::{string::String, format};
+static LEFT_INDEX: [u64; SLOTS] = build_index(RULES, true);
+static RIGHT_INDEX: [u64; SLOTS] = build_index(RULES, false);
+
+// The index is a u64.
+const _: () = assert!(RULES.len() <= 64);
+
+const fn rule(
+    left: &'static [&'static str],
+    stem: usize,
+    right: Right,
+    drop: usize,
+    insert: &'static str,
+    skip: usize,
+) -> Rule {
+    Rule { left, stem, right, drop, insert, double: false, skip }
+}
 
-    pub fn combine(left: &str, right: &str) -> String {
-        format!("{}{}", left, right)
+const CONSONANT: &str = "bcdfghjklmnpqrstvwxz";
+const VOWEL: &str = "aeiou";
+
+const TIVE: &[&str] = &["tive", "tivity", "tivities"];
+const IZE_Y: &[&str] = &[
+    "ize", "izes", "izing", "ized", "izer", "izers", "ization", "izations", "izable", "izability",
+];
+const ISE_Y: &[&str] = &[
+    "ise", "ises", "ising", "ised", "iser", "isers", "isation", "isations", "isable", "isability",
+];
+const IZE: &[&str] = &[
+    "ize", "ized", "izes", "izing", "izer", "izers", "ization", "izations", "izm", "izms",
+    "izable", "izability", "izabilities",
+];
+const ISE: &[&str] = &[
+    "ise", "ised", "ises", "ising", "iser", "isers", "isation", "isations", "ism", "isms",
+    "isable", "isability", "isabilities",
+];
+const IZE_AR: &[&str] = &[
+    "ize", "ized", "izes", "izing", "izer", "izers", "ization", "izations", "izm", "izms",
+];
+const ISE_AR: &[&str] = &[
+    "ise", "ised", "ises", "ising", "iser", "isers", "isation", "isations", "ism", "isms",
+];
+
+const RULES: &[Rule] = &[
+    // == +ly ==
+    // artistic + ly = artistically
+    rule(&[VOWEL, "c"], 0, Right::Exact(&["ly"]), 0, "al", 0),
+    // humble + ly = humbly (*humblely)
+    // questionable +ly = questionably
+    // triple +ly = triply
+    rule(&["aeioubmnp", "l", "e"], 1, Right::Exact(&["ly"]), 2, "", 0),
+
+    // == +ry ==
+    // statute + ry = statutory
+    rule(&["t", "e"], 0, Right::Exact(&["ry"]), 1, "o", 0),
+    rule(&["t", "e"], 0, Right::Exact(&["ary"]), 1, "o", 1),
+    // confirm +tory = confirmatory (*confirmtory)
+    rule(&["m"], 1, Right::Exact(&["tory", "torily"]), 0, "a", 0),
+    // supervise +ary = supervisory (*supervisary)
+    rule(&["s", "e"], 1, Right::Exact(&["ary", "aries"]), 1, "o", 1),
+
+    // == t +cy ==
+    // frequent + cy = frequency (tcy/tecy removal)
+    rule(&["naeiou", "t", "e"], 0, Right::Exact(&["cy"]), 2, "", 0),
+    rule(&["naeiou", "t"], 0, Right::Exact(&["cy"]), 1, "", 0),
+
+    // == +s ==
+    // establish + s = establishes (sibilant pluralization)
+    rule(&["sxz"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    rule(&["sz", "h"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    // speech + s = speeches (soft ch pluralization)
+    rule(&["eo", "a", "c", "h"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    rule(&["i", "c", "h"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    rule(&["e", "e", "c", "h"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    rule(&["o", "o", "c", "h"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    rule(&["ao", "u", "c", "h"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    rule(&["lnt", "c", "h"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    rule(&["^gin", "a", "r", "c", "h"], 0, Right::Exact(&["s"]), 0, "e", 0),
+    // cherry + s = cherries (consonant + y pluralization)
+    rule(&[CONSONANT, "y"], 1, Right::Exact(&["s"]), 1, "ie", 0),
+
+    // == y ==
+    // die+ing = dying
+    rule(&["i", "e"], 1, Right::Exact(&["ing"]), 2, "y", 0),
+    // metallurgy + ist = metallurgist
+    rule(&["cdfghlmnpr", "y"], 1, Right::Exact(&["ist"]), 1, "", 0),
+    // beauty + ful = beautiful (y -> i)
+    rule(&[CONSONANT, "y"], 1, Right::Starts("abcdefghjklmnopqrstuvwxz", 1), 1, "i", 0),
+
+    // == +en ==
+    // write + en = written
+    rule(&["t", "e"], 1, Right::Exact(&["en"]), 1, "t", 0),
+    // Minessota +en = Minessotan (*Minessotaen)
+    rule(&["ae"], 1, Right::Exact(&["en", "ens"]), 0, "", 1),
+
+    // == +ial ==
+    // ceremony +ial = ceremonial (*ceremonyial)
+    rule(&["y"], 1, Right::Exact(&["ial", "ially"]), 1, "", 0),
+    // == +if ==
+    // spaghetti +ification = spaghettification (*spaghettiification)
+    rule(&["i"], 1, Right::Exact(&["ify", "ifying", "ified", "ifies", "ification", "ifications"]), 1, "", 0),
+
+    // == +ical ==
+    // fantastic +ical = fantastical (*fantasticcal)
+    rule(&["i", "c"], 1, Right::Exact(&["ical", "ically"]), 2, "", 0),
+    // epistomology +ical = epistomological
+    rule(&["o", "l", "o", "g", "y"], 1, Right::Exact(&["ical", "ically"]), 1, "", 0),
+    // oratory +ical = oratorical (*oratoryical)
+    rule(&["r", "y"], 0, Right::Exact(&["ical", "ically", "icality"]), 1, "", 0),
+
+    // == +ist ==
+    // radical +ist = radicalist (*radicallist)
+    rule(&["l"], 0, Right::Exact(&["ist", "ists"]), 0, "", 0),
+
+    // == +ity ==
+    // complementary +ity = complementarity (*complementaryity)
+    rule(&["r", "y"], 0, Right::Exact(&["ity"]), 1, "", 0),
+    // disproportional +ity = disproportionality (*disproportionallity)
+    rule(&["l"], 0, Right::Exact(&["ity"]), 0, "", 0),
+
+    // == +ive, +tive ==
+    // perform +tive = performative (*performtive)
+    rule(&["r", "m"], 1, Right::Exact(TIVE), 0, "a", 0),
+    // restore +tive = restorative
+    rule(&["e"], 1, Right::Exact(TIVE), 1, "a", 0),
+
+    // == +ize ==
+    // token +ize = tokenize (*tokennize)
+    // token +ise = tokenise (*tokennise)
+    rule(&["y"], 1, Right::Exact(IZE_Y), 1, "", 0),
+    rule(&["y"], 1, Right::Exact(ISE_Y), 1, "", 0),
+    // conditional +ize = conditionalize (*conditionallize)
+    rule(&["a", "l"], 1, Right::Exact(IZE), 0, "", 0),
+    rule(&["a", "l"], 1, Right::Exact(ISE), 0, "", 0),
+    // spectacular +ization = spectacularization (*spectacularrization)
+    rule(&["a", "r"], 1, Right::Exact(IZE_AR), 0, "", 0),
+    rule(&["a", "r"], 1, Right::Exact(ISE_AR), 0, "", 0),
+
+    // category +ize/+ise = categorize/categorise (*categoryize/ *categoryise)
+    // custom +izable/+isable = customizable/customisable (*custommizable/ *custommisable)
+    // fantasy +ize = fantasize (*fantasyize)
+    rule(&["lmnty"], 0, Right::Exact(IZE), 0, "", 0),
+    rule(&["lmnty"], 0, Right::Exact(ISE), 0, "", 0),
+
+    // == +olog ==
+    // criminal + ology = criminology
+    // criminal + ologist = criminalogist (*criminallologist)
+    rule(&["a", "l"], 1, Right::Exact(&["ology", "ologist", "ologists", "ological", "ologically"]), 2, "", 0),
+
+    // == +ish ==
+    // similar +ish = similarish (*similarrish)
+    rule(&["aeo", "r"], 1, Right::Exact(&["ish"]), 0, "", 0),
+
+    // free + ed = freed
+    rule(&["e", "e"], 1, Right::Starts("e", 2), 1, "", 0),
+    // narrate + ing = narrating (silent e)
+    rule(&["bcdfghjklmnpqrstuvwxz", "e"], 1, Right::Starts("aeiouy", 1), 1, "", 0),
+
+    // == misc ==
+    // defer + ed = deferred (consonant doubling)   XXX monitor(stress not on last syllable)
+    Rule {
+        left: &["bcdfghjklmnprstvwxyz", VOWEL, "bcdfgklmnprtvz"],
+        stem: 0,
+        right: Right::Starts("aeiouy", 1),
+        drop: 0,
+        insert: "",
+        double: true,
+        skip: 0,
+    },
+    Rule {
+        left: &["q", "u", VOWEL, "bcdfgklmnprtvz"],
+        stem: 0,
+        right: Right::Starts("aeiouy", 1),
+        drop: 0,
+        insert: "",
+        double: true,
+        skip: 0,
+    },
+];
+
+#[test]
+fn ortho_examples() {
+    for (left, right, result) in [
+        ("artistic", "ly", "artistically"),
+        ("humble", "ly", "humbly"),
+        ("statute", "ry", "statutory"),
+        ("confirm", "tory", "confirmatory"),
+        ("supervise", "ary", "supervisory"),
+        ("frequent", "cy", "frequency"),
+        ("establish", "s", "establishes"),
+        ("speech", "s", "speeches"),
+        ("march", "s", "marches"),
+        ("search", "s", "searches"),
+        ("monarch", "s", "monarchs"),
+        ("cherry", "s", "cherries"),
+        ("die", "ing", "dying"),
+        ("metallurgy", "ist", "metallurgist"),
+        ("beauty", "ful", "beautiful"),
+        ("write", "en", "written"),
+        ("Minessota", "en", "Minessotan"),
+        ("ceremony", "ial", "ceremonial"),
+        ("spaghetti", "ification", "spaghettification"),
+        ("fantastic", "ical", "fantastical"),
+        ("epistomology", "ical", "epistomological"),
+        ("oratory", "ical", "oratorical"),
+        ("radical", "ist", "radicalist"),
+        ("complementary", "ity", "complementarity"),
+        ("disproportional", "ity", "disproportionality"),
+        ("perform", "tive", "performative"),
+        ("restore", "tive", "restorative"),
+        ("token", "ize", "tokenize"),
+        ("conditional", "ize", "conditionalize"),
+        ("spectacular", "ization", "spectacularization"),
+        ("category", "ize", "categorize"),
+        ("criminal", "ology", "criminology"),
+        ("similar", "ish", "similarish"),
+        ("free", "ed", "freed"),
+        ("narrate", "ing", "narrating"),
+        ("defer", "ed", "deferred"),
+        ("quit", "ing", "quitting"),
+        ("run", "zzz", "runzzz"),
+    ] {
+        assert_eq!(combine(left, right), result, "{} + {}", left, right);
     }
 }
-
-pub use engine::combine;
@@ -1,10 +1,7 @@
 //! Live translation
 
-extern crate alloc;
-
-use alloc::string::{String, ToString};
-use alloc::vec;
-use alloc::vec::Vec;
+use arraydeque::{ArrayDeque, Wrapping};
+use arrayvec::{ArrayString, ArrayVec};
 
 use super::typer::{Typer, TypeAction};
 use super::{Dict, Selector};
@@ -15,12 +12,15 @@ use crate::Stroke;
 use crate::println;
 
 /// Track a series of translations captured in real-time as they are input.
+///
+/// All of the state used while translating a stroke is of fixed size, so that
+/// adding a stroke does not need to go to the allocator.
 pub struct Translator {
     /// The dictionaries to use for the lookups.
-    dicts: Vec<Dict>,
+    dicts: ArrayVec<Dict, DICT_MAX>,
 
-    /// The nodes at each state.
-    history: Vec<Entry>,
+    /// The nodes at each state.  Once full, the oldest entries are dropped.
+    history: ArrayDeque<Entry, HIST_MAX, Wrapping>,
 
     // Tracker of what was typed.
     typer: Typer<HIST_MAX>,
@@ -29,36 +29,53 @@ pub struct Translator {
 /// At a given state, these are the possible places we can go.
 #[derive(Debug)]
 struct Entry {
-    nodes: Vec<Selector>,
-    _text: String,
+    nodes: ArrayVec<Selector, NODE_MAX>,
+    /// The translation typed for this stroke, or None if the raw steno was
+    /// typed.
+    text: Option<&'static str>,
+    stroke: Stroke,
+    /// The number of strokes the translation covers, including this one.
+    strokes: usize,
 
     // How far back in the history have we successfully typed?  0 means we have
     // typed up to the current entry.
     last_typed: usize,
 }
 
-impl Entry {
-    fn new() -> Entry {
-        Entry { nodes: Vec::new(), _text: String::new(), last_typed: 0 }
-    }
-}
-
-#[derive(Debug, Eq, PartialEq)]
-struct Translation {
-    /// The actual definition.
-    definition: String,
-}
-
 // Maxinum number of entries to keep for undo history. Note that if this is made
 // shorter than entries in the dictionary, those entries will never be found.
 // const HIST_MAX: usize = 100;
 const HIST_MAX: usize = 20;
 
+// Maximum number of dictionaries that can be searched.
+const DICT_MAX: usize = 4;
+
+// Maximum number of live selectors in a single entry.  There is at most one per
+// dictionary for each stroke that is still part of a possible longer
+// translation, which is normally only a handful.
+const NODE_MAX: usize = 32;
+
 impl Translator {
+    /// The number of strokes kept in the history.  Entries with more strokes
+    /// than this can never be translated.
+    pub const HISTORY: usize = HIST_MAX;
+
     pub fn new(dict: Dict) -> Self {
+        Self::with_dicts(&[dict])
+    }
+
+    /// Create a translator over a stack of dictionaries.  Each dictionary
+    /// takes priority over those before it, for entries of the same length.
+    /// Panics if there are more than DICT_MAX.
+    ///
+    /// Each dictionary in the stack is searched separately for every stroke,
+    /// so dictionaries that are built together should be merged ahead of time
+    /// (see `MapDictBuilder::merge`), leaving only those that are programmed
+    /// separately, such as the user dictionary, as separate layers.
+    pub fn with_dicts(dicts: &[Dict]) -> Self {
         Translator {
-            dicts: vec![dict],
-            history: vec![Entry::new()],
+            dicts: dicts.iter().copied().collect(),
+            history: ArrayDeque::new(),
             typer: Typer::new(),
         }
     }
@@ -73,16 +90,19 @@ impl Translator {
     }
 
     fn add_stroke(&mut self, stroke: Stroke) {
-        let last = self.history.last().unwrap();
+        let (last_nodes, last_typed) = match self.history.back() {
+            Some(last) => (&last.nodes[..], last.last_typed),
+            None => (&[][..], 0),
+        };
 
-        let mut nodes = vec!();
+        let mut nodes = ArrayVec::new();
         let mut best_len = 0;
         let mut best_text = None;
 
         // Iterate over all current nodes, along with an additional epislon node
         // for each dictionary.
-        let fresh: Vec<_> = self.dicts.iter().map(|d| Selector::new(d.clone())).collect();
-        for entry in last.nodes.iter().chain(fresh.iter()) {
+        let fresh = self.dicts.iter().map(|d| Selector::new(*d));
+        for entry in last_nodes.iter().copied().chain(fresh) {
             if let Some((sel, text)) = entry.lookup_step(stroke) {
                 // Dictionaries are in priority order.  Any new entries override
                 // those of the same length.
@@ -93,37 +113,93 @@ impl Translator {
                     }
                 }
 
-                // Unless this node is unique, push it for additional nodes.
-                if !sel.unique() {
-                    nodes.push(sel);
+                // Unless this node is unique, and its one entry has been fully
+                // matched, push it for additional nodes.  If there are too
+                // many, the extra ones are just not followed.
+                if !sel.unique() || text.is_none() {
+                    let _ = nodes.try_push(sel);
                 }
             }
         }
 
-        // Determine how much previously typed text needs to be deleted.
-        let text = if let Some(best) = best_text {
-            for _ent in &self.history[self.history.len() - (best_len - 1) .. self.history.len()] {
-                self.typer.remove();
-            }
-            self.typer.add(0, true, &best);
-            best
+        // The new translation replaces what the previous strokes in it typed.
+        // The typer works out how much of that actually has to change.
+        if let Some(best) = best_text {
+            let words = self.words_covering(best_len - 1);
+            self.typer.add(words, true, best);
         } else {
             // There is no translation for the current stroke.  Type out the raw
             // steno.
-            let text = stroke.to_string();
-            self.typer.add(0, true, &text);
-            text
-        };
+            self.type_raw(false, stroke);
+        }
 
-        self.history.push(Entry { nodes, _text: text, last_typed: last.last_typed + 1 });
+        self.history.push_back(Entry {
+            nodes,
+            text: best_text,
+            stroke,
+            strokes: best_len.max(1),
+            last_typed: last_typed + 1,
+        });
     }
 
     fn undo(&mut self) {
-        if let Some(_entry) = self.history.pop() {
+        if let Some(entry) = self.history.pop_back() {
+            // Bring back the translations that this one replaced, oldest first.
+            // The first of these replaces the text of the entry being undone.
+            let mut tops = ArrayVec::<usize, HIST_MAX>::new();
+            let end = self.history.len();
+            let start = end.saturating_sub(entry.strokes - 1);
+            let mut pos = end;
+            while pos > start {
+                tops.push(pos - 1);
+                pos = pos.saturating_sub(self.history[pos - 1].strokes);
+            }
+
+            if tops.is_empty() {
+                self.typer.remove();
+            }
+            for (i, &index) in tops.iter().rev().enumerate() {
+                let remove = if i == 0 { 1 } else { 0 };
+                let prior = &self.history[index];
+                match prior.text {
+                    Some(text) => self.typer.add(remove, true, text),
+                    None => {
+                        let stroke = prior.stroke;
+                        self.type_raw(remove > 0, stroke);
+                    }
+                }
+            }
+        }
+    }
+
+    /// The number of typed words that cover the last `strokes` entries of the
+    /// history.
+    fn words_covering(&self, strokes: usize) -> usize {
+        let end = self.history.len().saturating_sub(strokes);
+        let mut pos = self.history.len();
+        let mut words = 0;
+        while pos > end {
+            words += 1;
+            pos = pos.saturating_sub(self.history[pos - 1].strokes);
+        }
+        words
+    }
+
+    /// Type out the raw steno for a stroke, optionally replacing the last word.
+    fn type_raw(&mut self, replace: bool, stroke: Stroke) {
+        let mut text = ArrayString::<26>::new();
+        stroke.to_arraystring(&mut text);
+        if replace {
             self.typer.remove();
         }
+        self.typer.add_raw(true, &text);
     }
 
+    /// The number of selectors still following longer translations after the
+    /// last stroke.  Each of these is searched again by the next stroke.
+    pub fn live_selectors(&self) -> usize {
+        self.history.back().map(|e| e.nodes.len()).unwrap_or(0)
+    }
 
     /// Retrieve the next action from the typer.
     pub fn next_action(&mut self) -> Option<TypeAction> {
@@ -136,8 +212,11 @@ impl Translator {
         // Just print the latest history, as the history doesn't change.
 
         use crate::stroke::StenoWord;
-        let entry = self.history.last().unwrap();
-        println!("Entry: {:?}", entry._text);
+        let entry = match self.history.back() {
+            Some(entry) => entry,
+            None => return,
+        };
+        println!("Entry: {} {:?}", entry.stroke, entry.text);
         for node in &entry.nodes {
             println!("   {:?}", node);
             // Sometimes, it is useful to see all of the entries.
@@ -6,82 +6,308 @@
 
 extern crate alloc;
 
-use alloc::string::String;
-use alloc::vec::Vec;
 use alloc::collections::VecDeque;
+use core::fmt;
+
+use arraydeque::{ArrayDeque, Wrapping};
+use arrayvec::ArrayString;
+
+use super::ops::{self, Case, Definition};
 
 #[cfg(not(feature = "std"))]
 use crate::println;
 
 /// The typing tracker.  LIMIT is the limit of the history.
 pub struct Typer<const LIMIT: usize> {
-    _words: Vec<Word>,
+    _words: ArrayDeque<Word, LIMIT, Wrapping>,
 
     /// Things to be typed.
     to_type: VecDeque<TypeAction>,
 }
 
+/// Capacity of the short text that is kept alongside the borrowed text.  This
+/// needs to hold a space and the longest raw steno stroke.
+pub const PREFIX_MAX: usize = 32;
+
 /// A single thing that has been typed.
+#[derive(Clone)]
 struct Word {
     /// Characters that typing removed.  These are used to make slight changes
     /// to the previous word, such as fixing word endings and such.
-    remove: String,
+    remove: ArrayString<PREFIX_MAX>,
     /// The new characters that were typed.
-    typed: String,
+    typed: TypeAction,
+    /// How the next word joins onto this one.
+    join: Join,
+}
+
+/// How a word joins onto the one before it, from the operations at the end of
+/// that one's definition.
+#[derive(Clone, Copy, Default)]
+struct Join {
+    /// No space before the next word.
+    attach: bool,
+    /// This word was glued, so the next one attaches if it is glued too.
+    glue: bool,
+    /// Change the case of the start of the next word.
+    case: Option<Case>,
 }
 
-/// The action that results from text being typed.
+/// The action that results from text being typed.  The text is typed as
+/// `prefix` followed by `text`.  The text of a definition is borrowed directly
+/// from the dictionary, so only small pieces, such as the space between words,
+/// or raw steno, are ever copied.  The text is compiled, and can have key
+/// presses in it, see `ops::pieces`.
+#[derive(Clone)]
 pub struct TypeAction {
     /// How many characters to remove before typing this text.
     pub remove: usize,
-    /// The text to type.
-    pub text: String,
+    /// Short text to type first.
+    pub prefix: ArrayString<PREFIX_MAX>,
+    /// The text to type, borrowed from the dictionary.
+    pub text: &'static str,
 }
 
+impl TypeAction {
+    /// Length of the text to type.
+    pub fn len(&self) -> usize {
+        self.prefix.len() + self.text.len()
+    }
+
+    /// Is there no text to type?
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Length of the text to type, in the characters that appear on the
+    /// screen.
+    fn char_count(&self) -> usize {
+        self.prefix.chars().count() + ops::visible_len(self.text)
+    }
+
+    /// Does this text start a new word?
+    fn starts_word(&self) -> bool {
+        self.prefix.chars().chain(self.text.chars()).next() == Some(' ')
+    }
+}
+
+impl fmt::Display for TypeAction {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "{}{}", self.prefix, self.text)
+    }
+}
+
+/// Working buffer for reconstructing the end of what is on the screen.  If the
+/// text involved in a change doesn't fit, the typer falls back to backspacing
+/// over the words and retyping them.
+type Scratch = ArrayString<SCRATCH_MAX>;
+const SCRATCH_MAX: usize = 128;
+
 impl<const LIMIT: usize> Typer<LIMIT> {
     pub fn new() -> Self {
         Typer {
-            _words: Vec::new(),
+            _words: ArrayDeque::new(),
             to_type: VecDeque::new(),
         }
     }
 
     /// Add a track of words that we have typed.  The space will be inserted
-    /// before if it is needed.
-    #[allow(dead_code)]
-    pub fn add(&mut self, remove: usize, space: bool, typed: &str) {
-        if self._words.len() > LIMIT {
-            self._words.remove(0);
+    /// before if it is needed.  This translation replaces the last `remove`
+    /// words typed.  Only the characters that differ between what is on the
+    /// screen, and what should be, are sent.
+    ///
+    /// The definition is compiled, see `ops`.  Text that attaches to the
+    /// previous word, as from `{^ing}`, uses the orthography rules.
+    pub fn add(&mut self, remove: usize, space: bool, typed: &'static str) {
+        let remove = remove.min(self._words.len());
+        let def = Definition::split(typed);
+        let keep = self._words.len() - remove;
+        let last = if keep > 0 { self._words[keep - 1].join } else { Join::default() };
+
+        // Only text gets a space, not a key press, or nothing at all.
+        let space = space
+            && !def.attach_before
+            && !last.attach
+            && !(last.glue && def.glue)
+            && def.text.starts_with(|ch| !ops::is_op(ch));
+        let suffix = def.attach_before && !def.text.is_empty() && ops::is_plain(def.text);
+
+        let case = def.case_before.or(last.case);
+        let mut word = Word {
+            remove: ArrayString::new(),
+            typed: TypeAction { remove: 0, prefix: ArrayString::new(), text: def.text },
+            join: Join { attach: def.attach_after, glue: def.glue, case: def.case_after },
+        };
+        if space {
+            word.typed.prefix.push(' ');
+        }
+        // If there was nothing to change the case of, or to attach to, they
+        // carry on to the next word.
+        let changed = !suffix && change_case(&mut word.typed, case);
+        if !changed && word.join.case.is_none() {
+            word.join.case = case;
+        }
+        if def.text.is_empty() {
+            word.join.attach |= last.attach;
         }
 
-        // TODO: remove
-        let _ = remove;
+        if remove == 0 && !suffix {
+            self.push(word);
+        } else if self.replace(remove, word.clone(), suffix).is_none() {
+            for _ in 0..remove {
+                self.remove();
+            }
+            self.push(word);
+        }
+    }
 
-        let mut word = String::new();
+    /// Add text that doesn't come from a dictionary, such as raw steno.  This
+    /// text is copied, and must fit, along with the space, in PREFIX_MAX.
+    pub fn add_raw(&mut self, space: bool, typed: &str) {
+        let mut word = Word {
+            remove: ArrayString::new(),
+            typed: TypeAction { remove: 0, prefix: ArrayString::new(), text: "" },
+            join: Join::default(),
+        };
         if space {
-            word.push(' ');
+            word.typed.prefix.push(' ');
         }
-        word.push_str(typed);
+        word.typed.prefix.push_str(typed);
+        self.push(word);
+    }
 
-        self.to_type.push_back(TypeAction { remove: 0, text: word.clone() });
-        // Search something that won't match to excercise all of the patterns.
-        let _combined = super::ortho::combine("run", "zzz");
-        // println!("*** remove: {}, type: {:?}", 0, word);
+    /// Type a word as is, after what is already there.
+    fn push(&mut self, word: Word) {
+        self.to_type.push_back(word.typed.clone());
+        self._words.push_back(word);
+    }
+
+    /// Replace the last `remove` words with `word`, attaching it to the
+    /// previous word with the orthography rules if it is a suffix.  Returns
+    /// None if the text involved is too large to work with, or has key presses
+    /// in it.
+    fn replace(&mut self, remove: usize, mut word: Word, suffix: bool) -> Option<()> {
+        let keep = self._words.len() - remove;
+        if !ops::is_plain(word.typed.text) {
+            return None;
+        }
 
-        self._words.push(Word {
-            remove: String::new(),
-            typed: word,
-        });
+        // Orthography needs the whole previous word, which can be made of
+        // several things typed.
+        let base = if suffix { self.word_start(keep) } else { keep };
+
+        // What is on the screen after `base`, and what would be there once the
+        // replaced words are gone.  Undoing them also restores anything they
+        // removed from before `base`.
+        let (restored_all, shown) = self.fold(base, self._words.len())?;
+        let (restored, kept) = self.fold(base, keep)?;
+        let extra = restored_all.strip_suffix(restored.as_str())?;
+        let mut head = Scratch::new();
+        head.try_push_str(extra).ok()?;
+        head.try_push_str(&kept).ok()?;
+
+        if suffix {
+            orthography(&mut head, &mut word)?;
+        }
+        head.try_push_str(&word.typed.prefix).ok()?;
+
+        // The new text is `head` followed by the definition.  Find what it
+        // shares with the screen.
+        let mut common = 0;
+        let mut common_len = 0;
+        for (a, b) in shown.chars().zip(head.chars().chain(word.typed.text.chars())) {
+            if a != b {
+                break;
+            }
+            common += 1;
+            common_len += a.len_utf8();
+        }
+        let backspace = shown.chars().count() - common;
+        if common_len >= head.len() {
+            self.emit(backspace, "", &word.typed.text[common_len - head.len()..]);
+        } else {
+            self.emit(backspace, &head[common_len..], word.typed.text);
+        }
+
+        for _ in 0..remove {
+            self._words.pop_back();
+        }
+        self._words.push_back(word);
+        Some(())
+    }
+
+    /// Index of the word that begins the text word that ends before `end`.
+    fn word_start(&self, end: usize) -> usize {
+        let mut start = end;
+        while start > 0 {
+            start -= 1;
+            if self._words[start].typed.starts_word() {
+                break;
+            }
+        }
+        start
+    }
+
+    /// Play back the words from `start` to `end`.  Returns the text before the
+    /// words that they removed, and the text that they leave on the screen.
+    fn fold(&self, start: usize, end: usize) -> Option<(Scratch, Scratch)> {
+        let mut restored = Scratch::new();
+        let mut shown = Scratch::new();
+        for word in self._words.iter().skip(start).take(end - start) {
+            if !ops::is_plain(word.typed.text) {
+                return None;
+            }
+            let count = word.remove.chars().count();
+            let have = shown.chars().count();
+            if count <= have {
+                pop_chars(&mut shown, count);
+            } else {
+                // This removes past the start, so it is the first part of the
+                // removed text that came from before it.
+                shown.clear();
+                let cut = word.remove.char_indices().nth(count - have)
+                    .map(|(i, _)| i)
+                    .unwrap_or(word.remove.len());
+                let mut before = Scratch::new();
+                before.try_push_str(&word.remove[..cut]).ok()?;
+                before.try_push_str(&restored).ok()?;
+                restored = before;
+            }
+            shown.try_push_str(&word.typed.prefix).ok()?;
+            shown.try_push_str(word.typed.text).ok()?;
+        }
+        Some((restored, shown))
+    }
+
+    /// Queue up the remove, and the text to type.  The copied text is split
+    /// across as many actions as needed.
+    fn emit(&mut self, remove: usize, mut copied: &str, text: &'static str) {
+        let mut remove = remove;
+        while copied.len() > PREFIX_MAX {
+            let mut cut = PREFIX_MAX;
+            while !copied.is_char_boundary(cut) {
+                cut -= 1;
+            }
+            let mut prefix = ArrayString::new();
+            prefix.push_str(&copied[..cut]);
+            self.to_type.push_back(TypeAction { remove, prefix, text: "" });
+            remove = 0;
+            copied = &copied[cut..];
+        }
+        if remove > 0 || !copied.is_empty() || !text.is_empty() {
+            let mut prefix = ArrayString::new();
+            prefix.push_str(copied);
+            self.to_type.push_back(TypeAction { remove, prefix, text });
+        }
     }
 
     /// Remove the latest thing we typed.
     pub fn remove(&mut self) {
-        if let Some(word) = self._words.pop() {
-            let _ = word.typed;
-            let _ = word.remove;
+        if let Some(word) = self._words.pop_back() {
             println!("*** remove: {}, type: {:?}", word.typed.len(), word.remove);
-            // TODO: Use the ortho rules.
-            self.to_type.push_back(TypeAction { remove: word.typed.len(), text: word.remove });
+            // A word with nothing on the screen, such as a key press, has
+            // nothing to take back.
+            self.emit(word.typed.char_count(), &word.remove, "");
         }
     }
 
@@ -90,3 +316,47 @@ impl<const LIMIT: usize> Typer<LIMIT> {
         self.to_type.pop_front()
     }
 }
+
+/// Change the case of the first letter typed, moving it into the prefix.
+/// Returns false if the text doesn't start with a letter to change.
+fn change_case(typed: &mut TypeAction, case: Option<Case>) -> bool {
+    let case = match case {
+        Some(case) => case,
+        None => return false,
+    };
+    let mut chars = typed.text.chars();
+    match chars.next() {
+        Some(ch) if !ops::is_op(ch) => {
+            match case {
+                Case::Upper => ch.to_uppercase().for_each(|ch| typed.prefix.push(ch)),
+                Case::Lower => ch.to_lowercase().for_each(|ch| typed.prefix.push(ch)),
+            }
+            typed.text = chars.as_str();
+            true
+        }
+        _ => false,
+    }
+}
+
+/// Attach the text of `word` to the last word in `head`, using the orthography
+/// rules.  `head` is left with what remains of the word before the new text,
+/// and `word` records what it removed and typed.
+fn orthography(head: &mut Scratch, word: &mut Word) -> Option<()> {
+    let start = head.rfind(' ').map(|p| p + 1).unwrap_or(0);
+    let suffix = word.typed.text;
+    if let Some(attach) = super::ortho::attach(&head[start..], suffix) {
+        let keep = head.len() - attach.drop;
+        word.remove = ArrayString::from(&head[keep..]).ok()?;
+        word.typed.prefix.push_str(&attach.insert);
+        word.typed.text = &suffix[attach.skip..];
+        head.truncate(keep);
+    }
+    Some(())
+}
+
+/// Remove `count` characters from the end of the text.
+fn pop_chars(text: &mut Scratch, count: usize) {
+    for _ in 0..count {
+        text.pop();
+    }
+}
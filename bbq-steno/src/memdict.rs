@@ -6,10 +6,57 @@
 //! Note that we will treat these as static lifetime. Testing might use
 //! temporary arrays, and it is important to make sure they aren't moved.
 
-use crate::{stroke::Stroke, dict::DictImpl};
+extern crate alloc;
+
+use alloc::{boxed::Box, vec::Vec};
+use core::cell::Cell;
+
+use crate::{stroke::Stroke, dict::{self, equal_range_by, DictImpl}};
+
+#[cfg(feature = "std")]
+pub mod encode;
 
 pub const MAGIC1: &[u8] = b"stenodct";
 
+/// Magic value of the versioned images.  It is followed by the version of the
+/// layout.
+pub const MAGIC2: &[u8] = b"stenodcv";
+
+/// The version of the layout described by `RawMemDict2`.
+pub const VERSION2: u32 = 2;
+
+/// The same layout as `VERSION2`, but with the definitions compiled, see
+/// `dict::ops`.  This is what the converter writes.
+pub const VERSION3: u32 = 3;
+
+/// Magic value marking the presence of the optional section table.  Older
+/// images have the build information text at this location, which will never
+/// match.
+pub const SECTIONS_MAGIC: &[u8] = b"sect";
+
+/// Tag of the stroke trie section.
+pub const TRIE_TAG: &[u8] = b"trie";
+
+/// Tag of the information section, a `RawInfo`.
+pub const INFO_TAG: &[u8] = b"info";
+
+/// Tag of the reverse index, from definitions to the entries that have them.
+/// The section is a u32 count of buckets, which is a power of two, followed by
+/// the u32 start of each bucket in the entry list, and one more for the end of
+/// the last, then the list of u32 entry indices.  The entries are in the bucket
+/// given by the low bits of the `text_hash` of their text, and in order within
+/// each bucket.
+pub const REVERSE_TAG: &[u8] = b"rvrs";
+
+/// The hash of a definition used by the reverse index.  This is 32-bit FNV-1a.
+pub fn text_hash(text: &[u8]) -> u32 {
+    text.iter().fold(0x811c9dc5, |hash, &b| (hash ^ b as u32).wrapping_mul(0x01000193))
+}
+
+/// Space reserved in the image for the header, the section table pointer, and
+/// the build information.
+pub const HEADER_SIZE: usize = 256;
+
 /// This structure encodes the above. It is intended to be able to process the
 /// directly-mapped structure, and as such, doesn't use pointers, but offsets.
 #[repr(C)]
@@ -30,27 +77,199 @@ pub struct RawMemDict {
     text_table_offset: u32,
 }
 
+/// The version 2 header.  The key table is as in the original layout, and the
+/// search only needs it and the strokes.  The text table is split into an
+/// array of offsets and an array of lengths, so definitions can be longer than
+/// 255 bytes, and the text larger than 16MB.
+#[repr(C)]
+#[derive(Debug)]
+pub struct RawMemDict2 {
+    magic: [u8; 8],
+    version: u32,
+    /// Number of entries in this dictionary.
+    size: u32,
+    /// Byte position of the keys, and the number of strokes in them.
+    keys_offset: u32,
+    keys_length: u32,
+    /// Byte position of the key table.
+    key_pos_offset: u32,
+    /// Byte offset of the text block, and its length.
+    text_offset: u32,
+    text_length: u32,
+    /// Byte offset of the text offsets, a u32 for each entry.
+    text_starts_offset: u32,
+    /// Byte offset of the text lengths, a u16 for each entry.
+    text_lengths_offset: u32,
+}
+
+/// The header of either layout.
+#[derive(Debug)]
+pub enum RawHeader {
+    V1(&'static RawMemDict),
+    V2(&'static RawMemDict2),
+}
+
+/// Immediately following the header, there may be a pointer to a table of
+/// optional sections.  Readers that don't understand a given section can just
+/// ignore it.
+#[repr(C)]
+#[derive(Debug)]
+pub struct RawSections {
+    magic: [u8; 4],
+    /// Byte offset of the table of `RawSection` entries.
+    offset: u32,
+    /// The number of entries in the table.
+    count: u32,
+}
+
+/// A single optional section.
+#[repr(C)]
+#[derive(Debug)]
+pub struct RawSection {
+    pub tag: [u8; 4],
+    /// Byte offset of the section.
+    pub offset: u32,
+    /// Length of the section, in bytes.
+    pub length: u32,
+}
+
+/// Facts about the dictionary that the converter works out, so the device
+/// doesn't have to scan the whole dictionary for them.
+#[repr(C)]
+#[derive(Debug)]
+pub struct RawInfo {
+    /// The number of strokes in the longest key.
+    pub longest_key: u32,
+}
+
+/// A node of the stroke trie.  Every distinct prefix of the keys that covers
+/// more than one entry has a node, and the children of a node are the distinct
+/// strokes that can follow that prefix.  The nodes are stored in breadth-first
+/// order, which keeps the children of each node together, and sorted by
+/// stroke.  Node 0 is the root (the empty prefix), and the table ends with a
+/// sentinel node so that the children of node `n` are always
+/// `first_child[n]..first_child[n+1]`.
+///
+/// The range of entries covered by a child starts at its `left`, and runs up to
+/// the `left` of the next child, or, for the last child, to the end of the
+/// parent's range.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub struct TrieNode {
+    /// The stroke that leads to this node from its parent.
+    pub stroke: u32,
+    /// The first entry covered by this node.
+    pub left: u32,
+    /// The index of the first child of this node.
+    pub first_child: u32,
+}
+
+/// The selector node value used when a range is not represented in the trie.
+pub const NO_NODE: u32 = u32::MAX;
+
 /// The saner MemDict representation. This holds the above header, and some more
 /// friendly information and has methods for better accessing the structure.
 pub struct MemDict {
     /// The raw header.
-    pub raw: &'static RawMemDict,
+    pub raw: RawHeader,
     /// The keys are just an array of strokes in memory.
     pub keys: &'static [Stroke],
     /// The key table store in an encoded manner, the key element.
     pub key_offsets: &'static [u32],
     /// The text.
     pub text: &'static [u8],
-    /// The text offset table.
+    /// The text offset table.  In the original layout, the lengths are encoded
+    /// into it, as in the key table.
     pub text_offsets: &'static [u32],
+    /// The text lengths.  Empty in the original layout.
+    pub text_lengths: &'static [u16],
+    /// The stroke trie.  Empty if the image doesn't have one.
+    pub trie: &'static [TrieNode],
+    /// The number of strokes in the longest key.
+    pub longest_key: usize,
+    /// The start of each bucket of the reverse index, and the end of the last.
+    /// Empty if the image doesn't have one.
+    pub reverse_starts: &'static [u32],
+    /// The entries in the buckets of the reverse index.
+    pub reverse_entries: &'static [u32],
+    /// Are the definitions compiled?  Images from before compiled definitions
+    /// are still read, but braces in them are typed as they are.
+    pub compiled: bool,
+    /// Cache of the first step of lookups, see `with_cache`.  Empty unless
+    /// asked for.
+    cache: Box<[Cell<CacheSlot>]>,
+}
+
+/// A slot of the step cache.  This holds the result of the step from the whole
+/// dictionary by `stroke`, with an empty range if nothing starts with it.
+#[derive(Clone, Copy)]
+struct CacheSlot {
+    stroke: u32,
+    left: u32,
+    right: u32,
+    node: u32,
 }
 
+/// No stroke has all of the bits set, so this marks a slot that has never been
+/// filled.
+const EMPTY_SLOT: CacheSlot = CacheSlot { stroke: u32::MAX, left: 0, right: 0, node: NO_NODE };
+
 // TODO: Come up with error handling.
 
 impl MemDict {
+    /// Map the image at `ptr`.  Returns None if it isn't an image, or is a
+    /// version we don't know.  Check `compiled` before trusting the
+    /// definitions, as there is no way to warn from here.
     pub unsafe fn from_raw_ptr(ptr: *const u8) -> Option<MemDict> {
+        let magic = core::slice::from_raw_parts(ptr, 8);
+        if magic == MAGIC1 {
+            Self::from_raw_v1(ptr)
+        } else if magic == MAGIC2 {
+            Self::from_raw_v2(ptr)
+        } else {
+            None
+        }
+    }
+
+    unsafe fn from_raw_v1(ptr: *const u8) -> Option<MemDict> {
         let raw = &*(ptr as *const RawMemDict);
-        if raw.magic != MAGIC1 {
+        let keys = core::slice::from_raw_parts(
+            ptr.add(raw.keys_offset as usize) as *const Stroke,
+            raw.keys_length as usize,
+        );
+        let key_offsets = core::slice::from_raw_parts(
+            ptr.add(raw.key_pos_offset as usize) as *const u32,
+            raw.size as usize,
+        );
+        let text = core::slice::from_raw_parts(
+            ptr.add(raw.text_offset as usize) as *const u8,
+            raw.text_length as usize,
+        );
+        let text_offsets = core::slice::from_raw_parts(
+            ptr.add(raw.text_table_offset as usize) as *const u32,
+            raw.size as usize,
+        );
+        let trie = find_trie(ptr, core::mem::size_of::<RawMemDict>());
+
+        Some(MemDict {
+            raw: RawHeader::V1(raw),
+            keys,
+            key_offsets,
+            text,
+            text_offsets,
+            text_lengths: &[],
+            trie,
+            longest_key: 0,
+            reverse_starts: &[],
+            reverse_entries: &[],
+            compiled: false,
+            cache: Box::new([]),
+        }.with_sections(ptr, core::mem::size_of::<RawMemDict>()))
+    }
+
+    unsafe fn from_raw_v2(ptr: *const u8) -> Option<MemDict> {
+        let raw = &*(ptr as *const RawMemDict2);
+        if raw.version != VERSION2 && raw.version != VERSION3 {
             return None;
         }
 
@@ -67,18 +286,166 @@ impl MemDict {
             raw.text_length as usize,
         );
         let text_offsets = core::slice::from_raw_parts(
-            ptr.add(raw.text_table_offset as usize) as *const u32,
+            ptr.add(raw.text_starts_offset as usize) as *const u32,
+            raw.size as usize,
+        );
+        let text_lengths = core::slice::from_raw_parts(
+            ptr.add(raw.text_lengths_offset as usize) as *const u16,
             raw.size as usize,
         );
+        let trie = find_trie(ptr, core::mem::size_of::<RawMemDict2>());
 
         Some(MemDict {
-            raw,
+            raw: RawHeader::V2(raw),
             keys,
             key_offsets,
             text,
             text_offsets,
-        })
+            text_lengths,
+            trie,
+            longest_key: 0,
+            reverse_starts: &[],
+            reverse_entries: &[],
+            compiled: raw.version == VERSION3,
+            cache: Box::new([]),
+        }.with_sections(ptr, core::mem::size_of::<RawMemDict2>()))
+    }
+
+    /// Fill in what comes from the optional sections.  Without the info
+    /// section, the longest key is found by scanning the key table.
+    unsafe fn with_sections(mut self, ptr: *const u8, header: usize) -> MemDict {
+        self.longest_key = match find_section(ptr, header, INFO_TAG) {
+            Some(sect) => (*(ptr.add(sect.offset as usize) as *const RawInfo)).longest_key as usize,
+            None => self.key_offsets.iter().map(|&code| code as usize >> 24).max().unwrap_or(0),
+        };
+
+        if let Some(sect) = find_section(ptr, header, REVERSE_TAG) {
+            let base = ptr.add(sect.offset as usize) as *const u32;
+            let buckets = *base as usize;
+            self.reverse_starts = core::slice::from_raw_parts(base.add(1), buckets + 1);
+            self.reverse_entries = core::slice::from_raw_parts(base.add(buckets + 2), self.len());
+        }
+        self
+    }
+
+    /// The entries whose definition is exactly `text`, in order.  This needs
+    /// the reverse index, and finds nothing in images without one.
+    pub fn entries_for<'a>(&'a self, text: &'a str) -> impl Iterator<Item = usize> + 'a {
+        let bucket = if self.reverse_starts.len() > 1 {
+            let bucket = text_hash(text.as_bytes()) as usize & (self.reverse_starts.len() - 2);
+            self.reverse_starts[bucket] as usize..self.reverse_starts[bucket + 1] as usize
+        } else {
+            0..0
+        };
+        self.reverse_entries[bucket].iter()
+            .map(|&index| index as usize)
+            .filter(move |&index| self.value(index) == text)
     }
+
+    /// The shortest key that types `text`.  Of keys of the same length, this is
+    /// the first.
+    pub fn shortest_key(&self, text: &str) -> Option<&[Stroke]> {
+        self.entries_for(text).map(|index| self.key(index)).min_by_key(|key| key.len())
+    }
+
+    /// Add a cache, in RAM, of the first step of each lookup, with the given
+    /// number of slots, which must be a power of two.  Every stroke starts a
+    /// new lookup from the whole dictionary, and most are the common single
+    /// stroke entries, so with the cache those skip the search of the flash
+    /// entirely.  The cache is direct-mapped and filled as strokes are seen;
+    /// each slot is 16 bytes, and there can be at most 65536 of them.
+    pub fn with_cache(mut self, slots: usize) -> MemDict {
+        assert!(slots.is_power_of_two() && slots <= 1 << 16);
+        let mut cache = Vec::with_capacity(slots);
+        cache.resize_with(slots, || Cell::new(EMPTY_SLOT));
+        self.cache = cache.into_boxed_slice();
+        self
+    }
+
+    /// The step from the whole dictionary, through the cache.
+    fn cached_step(&self, needle: Stroke) -> Option<(usize, usize, u32)> {
+        let raw = needle.into_raw();
+        // Multiplicative hashing spreads strokes that differ in only a few keys
+        // across the table.
+        let hash = (raw.wrapping_mul(0x9e3779b9) >> 16) as usize;
+        let slot = &self.cache[hash & (self.cache.len() - 1)];
+
+        let entry = slot.get();
+        if entry.stroke == raw {
+            return if entry.right > entry.left {
+                Some((entry.left as usize, entry.right as usize, entry.node))
+            } else {
+                None
+            };
+        }
+
+        let result = self.search_step(0, self.len(), 0, 0, needle);
+        let (left, right, node) = result.unwrap_or((0, 0, NO_NODE));
+        slot.set(CacheSlot { stroke: raw, left: left as u32, right: right as u32, node });
+        result
+    }
+
+    /// The lookup step, without the cache.
+    fn search_step(&self, a: usize, b: usize, pos: usize, node: u32, needle: Stroke) -> Option<(usize, usize, u32)> {
+        if self.trie.is_empty() || node == NO_NODE {
+            return dict::scan_step(self, a, b, pos, needle);
+        }
+
+        if b - a == 1 {
+            // Unique ranges are not in the trie, just check the single key.
+            let key = self.key(a);
+            return if key.len() > pos && key[pos] == needle {
+                Some((a, b, NO_NODE))
+            } else {
+                None
+            };
+        }
+
+        self.trie_step(b, node, needle)
+    }
+
+    /// Perform a step using the trie.  The caller has already determined that
+    /// the range is not unique.
+    fn trie_step(&self, b: usize, node: u32, needle: Stroke) -> Option<(usize, usize, u32)> {
+        let node = node as usize;
+        let first = self.trie[node].first_child as usize;
+        let last = self.trie[node + 1].first_child as usize;
+        let children = &self.trie[first..last];
+
+        let pos = children.binary_search_by_key(&needle.into_raw(), |n| n.stroke).ok()?;
+        let left = children[pos].left as usize;
+        let right = if pos + 1 < children.len() {
+            children[pos + 1].left as usize
+        } else {
+            b
+        };
+        Some((left, right, (first + pos) as u32))
+    }
+}
+
+/// Locate the trie section, if the image has one.
+unsafe fn find_trie(ptr: *const u8, header: usize) -> &'static [TrieNode] {
+    match find_section(ptr, header, TRIE_TAG) {
+        Some(sect) => core::slice::from_raw_parts(
+            ptr.add(sect.offset as usize) as *const TrieNode,
+            sect.length as usize / core::mem::size_of::<TrieNode>(),
+        ),
+        None => &[],
+    }
+}
+
+/// Locate an optional section in the image, by tag.  The section table pointer
+/// follows the header, which is `header` bytes long.
+unsafe fn find_section(ptr: *const u8, header: usize, tag: &[u8]) -> Option<&'static RawSection> {
+    let sections = &*(ptr.add(header) as *const RawSections);
+    if sections.magic != SECTIONS_MAGIC {
+        return None;
+    }
+    let table = core::slice::from_raw_parts(
+        ptr.add(sections.offset as usize) as *const RawSection,
+        sections.count as usize,
+    );
+    table.iter().find(|s| s.tag == tag)
 }
 
 impl DictImpl for MemDict {
@@ -96,13 +463,43 @@ impl DictImpl for MemDict {
 
     /// Get the text. Panics if the key is out of range.
     fn value(&self, n: usize) -> &'static str {
-        let code = self.text_offsets[n] as usize;
-        let offset = code & ((1 << 24) - 1);
-        let length = code >> 24;
-        // println!("get text:{} (raw:{:x}) offset:{:x} len:{}", n, code, offset, length);
+        let (offset, length) = if self.text_lengths.is_empty() {
+            let code = self.text_offsets[n] as usize;
+            (code & ((1 << 24) - 1), code >> 24)
+        } else {
+            (self.text_offsets[n] as usize, self.text_lengths[n] as usize)
+        };
         let raw = &self.text[offset..offset + length];
         unsafe { core::str::from_utf8_unchecked(raw) }
     }
+
+    fn longest_key(&self) -> usize {
+        self.longest_key
+    }
+
+    /// Decode only the key table entry and the one stroke needed by each probe.
+    fn equal_range(&self, a: usize, b: usize, pos: usize, needle: Stroke) -> (usize, usize) {
+        equal_range_by(a, b, needle, |i| {
+            let code = self.key_offsets[i] as usize;
+            let offset = code & ((1 << 24) - 1);
+            let length = code >> 24;
+            if pos < length {
+                Some(self.keys[offset + pos])
+            } else {
+                None
+            }
+        })
+    }
+
+    /// With a trie, the lookup is a single search through the children of the
+    /// current node, instead of two binary searches over the whole range.  The
+    /// first step can also come from the cache.
+    fn step(&self, a: usize, b: usize, pos: usize, node: u32, needle: Stroke) -> Option<(usize, usize, u32)> {
+        if pos == 0 && !self.cache.is_empty() && a == 0 && b == self.len() {
+            return self.cached_step(needle);
+        }
+        self.search_step(a, b, pos, node, needle)
+    }
 }
 
 /*
@@ -0,0 +1,322 @@
+//! Building memory dictionary images.
+//!
+//! This is the writing side of `memdict`, used by dict-convert, and by the
+//! tests to check that what is written reads back.
+
+use std::collections::VecDeque;
+use std::vec::Vec;
+
+use super::{
+    text_hash, HEADER_SIZE, INFO_TAG, MAGIC1, MAGIC2, REVERSE_TAG, SECTIONS_MAGIC, TRIE_TAG,
+    VERSION3,
+};
+use crate::Stroke;
+
+/// Which header layout to write.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum Layout {
+    /// The original layout, `RawMemDict`.  Definitions are limited to 255
+    /// bytes, and the text to 16MB.
+    V1,
+    /// `RawMemDict2`, with the definitions compiled.
+    V2,
+}
+
+/// What to put in the image.
+#[derive(Clone, Copy, Debug)]
+pub struct Options {
+    pub layout: Layout,
+    /// Write the stroke trie section.
+    pub trie: bool,
+    /// Write the reverse index section.
+    pub reverse: bool,
+}
+
+impl Default for Options {
+    fn default() -> Self {
+        Options { layout: Layout::V2, trie: true, reverse: true }
+    }
+}
+
+#[derive(Debug)]
+pub enum Error {
+    /// A definition, of the given length, is too long for the layout.
+    TooLong(usize),
+    /// The image is too large for the offsets of the layout.
+    TooLarge,
+}
+
+impl std::fmt::Display for Error {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        match self {
+            Error::TooLong(length) => write!(f, "definition of {} bytes is too long", length),
+            Error::TooLarge => write!(f, "dictionary is too large"),
+        }
+    }
+}
+
+impl std::error::Error for Error {}
+
+type Result<T> = std::result::Result<T, Error>;
+
+/// Encode the sorted entries of a dictionary as an image.  The definitions
+/// should already be compiled, see `dict::ops`.  `stamp` is the build
+/// information, which is truncated to fit in the header.
+pub fn encode_dict(dict: &[(&[Stroke], &str)], options: &Options, stamp: &str) -> Result<Vec<u8>> {
+    // The header gets a placeholder for now.
+    let mut result = vec![0; HEADER_SIZE];
+    let mut header = Vec::new();
+    match options.layout {
+        Layout::V1 => header.extend(MAGIC1),
+        Layout::V2 => {
+            header.extend(MAGIC2);
+            put32(&mut header, VERSION3);
+        }
+    }
+    put32(&mut header, dict.len() as u32);
+
+    // Write out the key table.
+    let key_table = result.len();
+    let dict_keys: Vec<&[Stroke]> = dict.iter().map(|(k, _)| *k).collect();
+    let (strokes, keys) = share_keys(&dict_keys);
+    for st in &strokes {
+        put32(&mut result, st.into_raw());
+    }
+    put32(&mut header, key_table as u32);
+    put32(&mut header, strokes.len() as u32);
+
+    pad(&mut result, 8);
+    put32(&mut header, result.len() as u32);
+    for pos in &keys {
+        put32(&mut result, pos.encoded()?);
+    }
+
+    pad(&mut result, 8);
+    // Encode all of the text strings.
+    let text_table = result.len();
+    let dict_texts: Vec<&str> = dict.iter().map(|(_, v)| *v).collect();
+    let (text, texts) = share_texts(&dict_texts);
+    result.extend_from_slice(&text);
+    pad(&mut result, 8);
+    put32(&mut header, text_table as u32);
+    put32(&mut header, text.len().try_into().map_err(|_| Error::TooLarge)?);
+
+    match options.layout {
+        Layout::V1 => {
+            put32(&mut header, result.len() as u32);
+            for pos in &texts {
+                put32(&mut result, pos.encoded()?);
+            }
+        }
+        // The text offsets and lengths are separate tables.
+        Layout::V2 => {
+            put32(&mut header, result.len() as u32);
+            for pos in &texts {
+                put32(&mut result, pos.offset.try_into().map_err(|_| Error::TooLarge)?);
+            }
+
+            pad(&mut result, 8);
+            put32(&mut header, result.len() as u32);
+            for pos in &texts {
+                let length: u16 = pos.length.try_into().map_err(|_| Error::TooLong(pos.length))?;
+                result.extend_from_slice(&length.to_le_bytes());
+            }
+        }
+    }
+
+    pad(&mut result, 8);
+
+    // The optional sections.
+    let mut sections = Vec::new();
+
+    if options.trie {
+        let start = result.len();
+        for node in build_trie(&dict_keys) {
+            put32(&mut result, node.stroke);
+            put32(&mut result, node.left);
+            put32(&mut result, node.first_child);
+        }
+        sections.push((TRIE_TAG, start, result.len() - start));
+        pad(&mut result, 8);
+    }
+
+    if options.reverse {
+        let start = result.len();
+        // Around four entries to a bucket keeps the probes short without
+        // making the bucket table large.
+        let buckets = (dict.len() / 4).next_power_of_two();
+        let mut order: Vec<(u32, u32)> = dict.iter().enumerate()
+            .map(|(i, (_, text))| (text_hash(text.as_bytes()) & (buckets as u32 - 1), i as u32))
+            .collect();
+        order.sort_unstable();
+
+        put32(&mut result, buckets as u32);
+        let mut pos = 0;
+        for bucket in 0..=buckets as u32 {
+            while pos < order.len() && order[pos].0 < bucket {
+                pos += 1;
+            }
+            put32(&mut result, pos as u32);
+        }
+        for &(_, index) in &order {
+            put32(&mut result, index);
+        }
+        sections.push((REVERSE_TAG, start, result.len() - start));
+        pad(&mut result, 8);
+    }
+
+    let start = result.len();
+    let longest = dict.iter().map(|(k, _)| k.len()).max().unwrap_or(0);
+    put32(&mut result, longest as u32);
+    sections.push((INFO_TAG, start, result.len() - start));
+    pad(&mut result, 8);
+
+    // The section table itself.
+    let section_table = result.len();
+    for (tag, offset, length) in &sections {
+        result.extend_from_slice(tag);
+        put32(&mut result, *offset as u32);
+        put32(&mut result, *length as u32);
+    }
+    header.extend(SECTIONS_MAGIC);
+    put32(&mut header, section_table as u32);
+    put32(&mut header, sections.len() as u32);
+
+    // Stamp the header in place.
+    result[0..header.len()].copy_from_slice(&header);
+    let stamp = &stamp.as_bytes()[..stamp.len().min(HEADER_SIZE - header.len())];
+    result[header.len()..header.len() + stamp.len()].copy_from_slice(stamp);
+
+    Ok(result)
+}
+
+/// Lay out the strokes of the sorted keys.  A key that is a prefix of the key
+/// after it, such as "ST" before "ST/OP", doesn't need strokes of its own, and
+/// just points at the start of that one.
+fn share_keys(keys: &[&[Stroke]]) -> (Vec<Stroke>, Vec<TablePos>) {
+    let mut strokes = Vec::new();
+    let mut pos: Vec<TablePos> = keys.iter().map(|k| TablePos { offset: 0, length: k.len() }).collect();
+    let shared = |i: usize| i + 1 < keys.len() && keys[i + 1].starts_with(keys[i]);
+
+    for (i, k) in keys.iter().enumerate() {
+        if !shared(i) {
+            pos[i].offset = strokes.len();
+            strokes.extend_from_slice(k);
+        }
+    }
+    // Prefixes can chain, so resolve them back from the end.
+    for i in (0..keys.len()).rev() {
+        if shared(i) {
+            pos[i].offset = pos[i + 1].offset;
+        }
+    }
+    (strokes, pos)
+}
+
+/// Lay out the definition text.  Identical definitions share a single copy,
+/// and a definition that is the tail of another, such as "ing" of "thing",
+/// points at the end of that one.
+fn share_texts(texts: &[&str]) -> (Vec<u8>, Vec<TablePos>) {
+    // Sorting by the reversed bytes puts every text just before the texts it
+    // is a suffix of, if there are any.
+    let mut order: Vec<usize> = (0..texts.len()).collect();
+    order.sort_by(|&a, &b| texts[a].bytes().rev().cmp(texts[b].bytes().rev()));
+
+    // Each text, in that order, is either placed, or is the tail of the text
+    // after it.  Work from the end, so that the one after is always known.
+    let mut block = Vec::new();
+    let mut placed = vec![0; texts.len()];
+    for n in (0..order.len()).rev() {
+        let text = texts[order[n]].as_bytes();
+        placed[order[n]] = match order.get(n + 1) {
+            Some(&next) if texts[next].as_bytes().ends_with(text) => {
+                placed[next] + texts[next].len() - text.len()
+            }
+            _ => {
+                block.extend_from_slice(text);
+                block.len() - text.len()
+            }
+        };
+    }
+
+    let pos = texts.iter().zip(placed).map(|(t, offset)| TablePos { offset, length: t.len() }).collect();
+    (block, pos)
+}
+
+/// A trie node, as it is written to the image.
+struct TrieNode {
+    stroke: u32,
+    left: u32,
+    first_child: u32,
+}
+
+/// Build the stroke trie over the sorted keys.  The nodes are generated
+/// breadth-first, so the children of each node end up adjacent to each other.
+/// Ranges that only cover a single entry don't get children, as the lookup can
+/// just compare against that one key.
+fn build_trie(keys: &[&[Stroke]]) -> Vec<TrieNode> {
+    let mut nodes = vec![TrieNode { stroke: 0, left: 0, first_child: 0 }];
+
+    // Nodes whose children still need to be generated: (index, depth, left, right).
+    let mut work = VecDeque::new();
+    work.push_back((0, 0, 0, keys.len()));
+
+    while let Some((index, depth, left, right)) = work.pop_front() {
+        nodes[index].first_child = nodes.len() as u32;
+        if right - left < 2 {
+            continue;
+        }
+
+        // Keys that end at this depth sort first, and don't have a child.
+        let mut pos = left;
+        while pos < right && keys[pos].len() == depth {
+            pos += 1;
+        }
+
+        while pos < right {
+            let stroke = keys[pos][depth];
+            let mut end = pos + 1;
+            while end < right && keys[end][depth] == stroke {
+                end += 1;
+            }
+            work.push_back((nodes.len(), depth + 1, pos, end));
+            nodes.push(TrieNode { stroke: stroke.into_raw(), left: pos as u32, first_child: 0 });
+            pos = end;
+        }
+    }
+
+    // The sentinel, so the children of the last node can be determined.
+    let count = nodes.len() as u32;
+    nodes.push(TrieNode { stroke: 0, left: keys.len() as u32, first_child: count });
+    nodes
+}
+
+// Must match the endianness of our target.
+fn put32(buf: &mut Vec<u8>, value: u32) {
+    buf.extend_from_slice(&value.to_le_bytes());
+}
+
+fn pad(buf: &mut Vec<u8>, count: usize) {
+    while (buf.len() % count) > 0 {
+        buf.push(0);
+    }
+}
+
+struct TablePos {
+    offset: usize,
+    length: usize,
+}
+
+impl TablePos {
+    /// The key table encoding, which puts the length as the upper 8 bits, and
+    /// the offset in the lower.
+    fn encoded(&self) -> Result<u32> {
+        if self.length >= (1 << 8) {
+            return Err(Error::TooLong(self.length));
+        }
+        if self.offset >= (1 << 24) {
+            return Err(Error::TooLarge);
+        }
+        Ok(((self.length << 24) as u32) | (self.offset as u32))
+    }
+}
@@ -1,11 +1,14 @@
 // Test dictionaries.
 
-use std::{collections::BTreeMap, fs::File, rc::Rc};
+use std::{collections::BTreeMap, fs::File};
 
 use anyhow::Result;
 use bbq_steno::{
-    dict::{RamDict, MapDictBuilder, Selector},
+    dict::{Dict, DictImpl, RamDict, MapDictBuilder, Selector, Translator},
+    dict::ops,
+    memdict::{MemDict, encode::{encode_dict, Layout, Options}},
     stroke::StenoWord,
+    Stroke,
 };
 use bbq_steno_macros::stroke;
 
@@ -20,18 +23,372 @@ fn ramdict() {
         "ST/OP/-G".to_string(),
     );
     // b.insert(vec![stroke!("ST-Z")], "S".to_string());
-    let dict = Rc::new(b.into_ram_dict());
+    let dict: &'static RamDict = Box::leak(Box::new(b.into_ram_dict()));
 
     let pos = Selector::new(dict);
     // println!("full: {:?}", pos);
     let (posb, text) = pos.lookup_step(stroke!("ST")).unwrap();
     // println!("ST: {:?}", posb);
-    assert_eq!(text, Some("ST".to_string()));
+    assert_eq!(text, Some("ST"));
     let (_posc, text) = posb.lookup_step(stroke!("OP")).unwrap();
-    assert_eq!(text, Some("ST/OP".to_string()));
+    assert_eq!(text, Some("ST/OP"));
     // println!("ST/OP: {:?}", posc);
 }
 
+#[test]
+fn mapdict() {
+    let mut b = MapDictBuilder::new();
+    for (key, text) in [
+        ("ST", "interest"),
+        ("ST/OP", "interesting"),
+        ("ST/OP/HREU", "interestingly"),
+        ("STOP", "stop"),
+        ("STO*P", "stop"),
+        ("T", "the"),
+    ] {
+        b.insert(StenoWord::parse(key).unwrap().0, text.to_string());
+    }
+    let dict = b.into_map_dict();
+
+    assert_eq!(dict.lookup(&[stroke!("ST"), stroke!("OP")]), Some("interesting"));
+    assert_eq!(dict.lookup(&[stroke!("OP")]), None);
+    assert_eq!(dict.longest_key(), 3);
+
+    let texts: Vec<_> = dict.prefix(&[stroke!("ST")]).map(|(_, text)| text).collect();
+    assert_eq!(texts, ["interest", "interesting", "interestingly"]);
+
+    let keys: Vec<_> = dict.strokes_for("stop").map(|k| StenoWord(k.to_vec()).to_string()).collect();
+    assert_eq!(keys, ["STOP", "STO*P"]);
+    assert_eq!(dict.strokes_for("start").count(), 0);
+}
+
+#[test]
+fn equal_range() {
+    let mut b = MapDictBuilder::new();
+    for key in ["S", "ST", "ST/OP", "ST/OP/-G", "ST/-G", "ST/-Z", "STO", "T", "T/T", "T/T/T"] {
+        b.insert(StenoWord::parse(key).unwrap().0, key.to_string());
+    }
+    let dict = b.into_ram_dict();
+
+    // The single pass search must agree with the two binary searches, for the
+    // range of every prefix in the dictionary, and for strokes that aren't
+    // present.
+    let probes = [stroke!("S"), stroke!("ST"), stroke!("OP"), stroke!("-G"),
+                  stroke!("-Z"), stroke!("T"), stroke!("A")];
+    for i in 0..dict.len() {
+        let key = dict.key(i).to_vec();
+        let (mut a, mut b) = (0, dict.len());
+        for pos in 0..key.len() {
+            for needle in probes.iter() {
+                let left = dict.scan(a, b, pos, *needle);
+                let right = dict.scan(a, b, pos, needle.succ());
+                let (l, r) = dict.equal_range(a, b, pos, *needle);
+                if right > left {
+                    assert_eq!((l, r), (left, right));
+                } else {
+                    assert_eq!(l, r);
+                }
+            }
+            (a, b) = dict.equal_range(a, b, pos, key[pos]);
+            assert!(a <= i && i < b);
+        }
+    }
+}
+
+#[test]
+fn translator_history() {
+    let mut b = MapDictBuilder::new();
+    b.insert(vec![stroke!("ST")], "ST".to_string());
+    b.insert(vec![stroke!("ST"), stroke!("OP")], "ST/OP".to_string());
+    let dict: &'static RamDict = Box::leak(Box::new(b.into_ram_dict()));
+    let mut xlat = Translator::new(dict);
+
+    // Run well past the history limit, and then undo past the start of it.
+    for _ in 0..100 {
+        xlat.add(stroke!("ST"));
+    }
+    for _ in 0..100 {
+        xlat.add(stroke!("*"));
+    }
+    while xlat.next_action().is_some() {
+    }
+
+    xlat.add(stroke!("ST"));
+    xlat.add(stroke!("OP"));
+    let mut typed = Vec::new();
+    while let Some(action) = xlat.next_action() {
+        typed.push((action.remove, action.to_string()));
+    }
+    assert_eq!(typed, vec![
+        (0, " ST".to_string()),
+        (0, "/OP".to_string()),
+    ]);
+}
+
+#[test]
+fn translator_retype() {
+    let mut b = MapDictBuilder::new();
+    for (key, text) in [
+        ("T", "the"),
+        ("ST", "interest"),
+        ("ST/OP", "interesting"),
+        ("ST/OP/HREU", "interestingly"),
+        ("-G", "{^ing}"),
+    ] {
+        b.insert(StenoWord::parse(key).unwrap().0, text.to_string());
+    }
+    let dict: &'static RamDict = Box::leak(Box::new(b.into_ram_dict()));
+    let mut xlat = Translator::new(dict);
+
+    // Only the characters that change should be typed.
+    let mut typed = Vec::new();
+    for st in [stroke!("T"), stroke!("ST"), stroke!("OP"), stroke!("HREU"),
+               stroke!("*"), stroke!("*"), stroke!("-G"), stroke!("*")] {
+        xlat.add(st);
+        while let Some(action) = xlat.next_action() {
+            typed.push((action.remove, action.to_string()));
+        }
+    }
+    assert_eq!(typed, vec![
+        (0, " the".to_string()),
+        (0, " interest".to_string()),
+        (0, "ing".to_string()),
+        (0, "ly".to_string()),
+        (2, "".to_string()),
+        (3, "".to_string()),
+        (0, "ing".to_string()),
+        (3, "".to_string()),
+    ]);
+}
+
+#[test]
+fn translator_ops() {
+    let mut b = MapDictBuilder::new();
+    for (key, text) in [
+        ("T", "the"),
+        ("TP-PL", "{.}"),
+        ("KW-BG", "{,}"),
+        ("PRE", "{pre^}"),
+        ("A*", "{&a}"),
+        ("PW*", "{&b}"),
+        ("R-R", "{#Return}"),
+    ] {
+        b.insert(StenoWord::parse(key).unwrap().0, text.to_string());
+    }
+    let dict: &'static RamDict = Box::leak(Box::new(b.into_ram_dict()));
+    let mut xlat = Translator::new(dict);
+
+    let mut typed = Vec::new();
+    for st in [stroke!("T"), stroke!("TP-PL"), stroke!("T"), stroke!("KW-BG"),
+               stroke!("PRE"), stroke!("T"), stroke!("A*"), stroke!("PW*"),
+               stroke!("R-R"), stroke!("*"), stroke!("*")] {
+        xlat.add(st);
+        while let Some(action) = xlat.next_action() {
+            typed.push((action.remove, action.to_string()));
+        }
+    }
+    assert_eq!(typed, vec![
+        (0, " the".to_string()),
+        (0, ".".to_string()),
+        (0, " The".to_string()),
+        (0, ",".to_string()),
+        (0, " pre".to_string()),
+        (0, "the".to_string()),
+        (0, " a".to_string()),
+        (0, "b".to_string()),
+        (0, "\x05@28".to_string()),
+        // The key press can't be taken back.
+        (1, "".to_string()),
+    ]);
+}
+
+#[test]
+fn dict_stack() {
+    let mut layers = Vec::new();
+    for entries in [
+        &[("ST", "interest"), ("ST/OP", "interesting"), ("T", "the")][..],
+        &[("-G", "{^ing}"), ("T", "it")][..],
+        &[("ST", "stuff"), ("T/-G", "thing")][..],
+    ] {
+        let mut b = MapDictBuilder::new();
+        for (key, text) in entries {
+            b.insert(StenoWord::parse(key).unwrap().0, text.to_string());
+        }
+        let dict: &'static RamDict = Box::leak(Box::new(b.into_ram_dict()));
+        layers.push(dict as Dict);
+    }
+
+    let mut merged = MapDictBuilder::new();
+    for layer in &layers {
+        merged.merge(*layer);
+    }
+    let merged: &'static RamDict = Box::leak(Box::new(merged.into_ram_dict()));
+
+    // The stack and the merged dictionary must translate the same.
+    let mut results = Vec::new();
+    for mut xlat in [Translator::with_dicts(&layers), Translator::new(merged)] {
+        let mut typed = Vec::new();
+        for st in ["ST", "T", "-G", "ST", "OP", "*", "T", "ST"] {
+            xlat.add(StenoWord::parse(st).unwrap().0[0]);
+            while let Some(action) = xlat.next_action() {
+                typed.push((action.remove, action.to_string()));
+            }
+        }
+        results.push(typed);
+    }
+    assert_eq!(results[0], results[1]);
+    assert_eq!(results[0][0], (0, " stuff".to_string()));
+}
+
+/// Build an image of the entries, as dict-convert would, and map it.
+fn encode_memdict(entries: &[(&str, &str)], options: &Options) -> MemDict {
+    let mut entries: Vec<(Vec<Stroke>, String)> = entries.iter()
+        .map(|(key, text)| (StenoWord::parse(key).unwrap().0, ops::compile(text)))
+        .collect();
+    entries.sort();
+    let entries: Vec<(&[Stroke], &str)> = entries.iter().map(|(k, v)| (k.as_slice(), v.as_str())).collect();
+    let image = encode_dict(&entries, options, "test").unwrap();
+
+    // Keep the image word aligned, as it is read from directly.
+    let mut mem = vec![0u32; (image.len() + 3) / 4];
+    for (word, bytes) in mem.iter_mut().zip(image.chunks(4)) {
+        let mut buf = [0; 4];
+        buf[..bytes.len()].copy_from_slice(bytes);
+        *word = u32::from_le_bytes(buf);
+    }
+    let mem: &'static [u32] = Box::leak(mem.into_boxed_slice());
+    unsafe { MemDict::from_raw_ptr(mem.as_ptr() as *const u8) }.unwrap()
+}
+
+#[test]
+fn user_dict() {
+    let mut b = MapDictBuilder::new();
+    b.insert(vec![stroke!("ST")], "interest".to_string());
+    b.insert(vec![stroke!("T")], "the".to_string());
+    let main: &'static RamDict = Box::leak(Box::new(b.into_ram_dict()));
+
+    // The user dictionary is its own image, layered ahead of the main one.
+    let user = encode_memdict(&[("ST", "stuff"), ("ST/OP", "stop")], &Options::default());
+    let user: &'static MemDict = Box::leak(Box::new(user));
+    let mut xlat = Translator::with_dicts(&[main, user]);
+
+    let mut typed = Vec::new();
+    for st in [stroke!("ST"), stroke!("T"), stroke!("ST"), stroke!("OP")] {
+        xlat.add(st);
+        while let Some(action) = xlat.next_action() {
+            typed.push((action.remove, action.to_string()));
+        }
+    }
+    assert_eq!(typed, vec![
+        (0, " stuff".to_string()),
+        (0, " the".to_string()),
+        (0, " stuff".to_string()),
+        (3, "op".to_string()),
+    ]);
+}
+
+/// Entries for the image tests.
+const IMAGE_ENTRIES: &[(&str, &str)] = &[
+    ("ST", "interest"),
+    ("ST/OP", "interesting"),
+    ("ST/OP/HREU", "interestingly"),
+    ("STOP", "stop"),
+    ("STO*P", "stop"),
+    ("T", "the"),
+    ("-G", "{^ing}"),
+];
+
+#[test]
+fn memdict_round_trip() {
+    let mut entries: Vec<(Vec<Stroke>, String)> = IMAGE_ENTRIES.iter()
+        .map(|(key, text)| (StenoWord::parse(key).unwrap().0, ops::compile(text)))
+        .collect();
+    entries.sort();
+
+    for layout in [Layout::V1, Layout::V2] {
+        let dict = encode_memdict(IMAGE_ENTRIES, &Options { layout, ..Options::default() });
+        assert_eq!(dict.len(), entries.len());
+        for (i, (key, text)) in entries.iter().enumerate() {
+            assert_eq!(dict.key(i), key.as_slice());
+            assert_eq!(dict.value(i), text);
+        }
+        assert_eq!(dict.longest_key(), 3);
+
+        let dict: &'static MemDict = Box::leak(Box::new(dict));
+        let (sel, text) = Selector::new(dict).lookup_step(stroke!("ST")).unwrap();
+        assert_eq!(text, Some("interest"));
+        let (_, text) = sel.lookup_step(stroke!("OP")).unwrap();
+        assert_eq!(text, Some("interesting"));
+        assert!(Selector::new(dict).lookup_step(stroke!("OP")).is_none());
+    }
+}
+
+#[test]
+fn memdict_compiled() {
+    // Only the newer layout says the definitions are compiled.
+    for (layout, compiled) in [(Layout::V1, false), (Layout::V2, true)] {
+        let dict = encode_memdict(IMAGE_ENTRIES, &Options { layout, ..Options::default() });
+        assert_eq!(dict.compiled, compiled);
+    }
+}
+
+#[test]
+fn memdict_cache() {
+    // Walk two strokes from every probe, giving the range and text of each
+    // step.
+    fn walk(dict: &'static MemDict) -> Vec<Option<(usize, usize, Option<&'static str>)>> {
+        let probes = ["ST", "OP", "HREU", "STOP", "STO*P", "T", "-G", "A"]
+            .map(|st| StenoWord::parse(st).unwrap().0[0]);
+        let mut steps = Vec::new();
+        for first in probes {
+            for second in probes {
+                let mut sel = Selector::new(dict);
+                for st in [first, second] {
+                    let step = sel.lookup_step(st);
+                    steps.push(step.map(|(next, text)| (next.left, next.right, text)));
+                    match step {
+                        Some((next, _)) => sel = next,
+                        None => break,
+                    }
+                }
+            }
+        }
+        steps
+    }
+
+    for layout in [Layout::V1, Layout::V2] {
+        let options = Options { layout, ..Options::default() };
+        let plain: &'static MemDict = Box::leak(Box::new(encode_memdict(IMAGE_ENTRIES, &options)));
+        let expect = walk(plain);
+
+        // A tiny cache has strokes sharing slots.  Walk twice, so the second
+        // walk is answered from what the first one filled in.
+        for slots in [2, 16] {
+            let cached = encode_memdict(IMAGE_ENTRIES, &options).with_cache(slots);
+            let cached: &'static MemDict = Box::leak(Box::new(cached));
+            assert_eq!(walk(cached), expect);
+            assert_eq!(walk(cached), expect);
+        }
+    }
+}
+
+#[test]
+fn memdict_reverse() {
+    for layout in [Layout::V1, Layout::V2] {
+        let dict = encode_memdict(IMAGE_ENTRIES, &Options { layout, ..Options::default() });
+        let keys: Vec<_> = dict.entries_for("stop").map(|i| dict.key(i)).collect();
+        assert_eq!(keys, [&[stroke!("STOP")], &[stroke!("STO*P")]]);
+        assert_eq!(dict.entries_for("start").count(), 0);
+        // The index is of the compiled text.
+        assert_eq!(dict.shortest_key("\x01ing"), Some(&[stroke!("-G")][..]));
+        assert_eq!(dict.shortest_key("interesting"), Some(&[stroke!("ST"), stroke!("OP")][..]));
+
+        // Without the index, nothing is found.
+        let dict = encode_memdict(IMAGE_ENTRIES, &Options { layout, reverse: false, ..Options::default() });
+        assert_eq!(dict.shortest_key("stop"), None);
+    }
+}
+
 /*
 #[test]
 fn simple_dict() {
@@ -77,7 +434,7 @@ fn main_dict() {
     let (pos, text) = pos.lookup_step(stroke!("1257B")).unwrap();
     assert!(text.is_none());
     let (pos, text) = pos.lookup_step(stroke!("HREU")).unwrap();
-    assert_eq!(text, Some("Stanley".to_string()));
+    assert_eq!(text, Some("Stanley"));
     assert!(!pos.unique());
 }
 
@@ -108,7 +465,7 @@ fn test_translator() {
 */
 
 /// Load the main dictionary.
-fn load_dict() -> Result<Rc<RamDict>> {
+fn load_dict() -> Result<&'static RamDict> {
     let data: BTreeMap<String, String> =
         serde_json::from_reader(File::open("../dict-convert/lapwing-base.json")?)?;
     let mut builder = MapDictBuilder::new();
@@ -116,5 +473,5 @@ fn load_dict() -> Result<Rc<RamDict>> {
         let k = StenoWord::parse(&k)?;
         builder.insert(k.0, v);
     }
-    Ok(Rc::new(builder.into_ram_dict()))
+    Ok(Box::leak(Box::new(builder.into_ram_dict())))
 }
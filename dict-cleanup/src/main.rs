@@ -1,206 +1,151 @@
 // Perform dictionary cleanups.
+//
+// The dictionaries given on the command line are merged, later ones taking
+// priority, and each check is run over the entries.  The checks are
+// independent for each entry, so the entries are split into a shard for each
+// thread.
 
 use anyhow::Result;
-use bbq_steno::{dict::{MapDictBuilder, MapDict, Dict}, stroke::StenoWord, Stroke};
+use bbq_steno::{
+    dict::{ops::{self, Definition}, ortho, DictImpl, MapDict, MapDictBuilder, Translator},
+    stroke::StenoWord,
+    Stroke,
+};
 use bbq_steno_macros::stroke;
-use regex_lite::Regex;
-// use regex::Regex;
-use std::{fs::File, collections::BTreeMap};
+use std::{fs::File, collections::BTreeMap, time::Instant};
 
-fn main() -> Result<()> {
-    // Read main into a map.
-    let data: BTreeMap<String, String> =
-        serde_json::from_reader(File::open("../dict-convert/main.json")?)?;
-    let mut builder = MapDictBuilder::new();
-    for (k, v) in data {
-        let k = StenoWord::parse(&k)?;
-        builder.insert(k.0, v);
-    }
-    let dict = builder.into_map_dict();
+/// A check of a single entry, giving a description of any problem with it.
+type Check = fn(&'static MapDict, &'static [Stroke], &'static str) -> Option<String>;
 
-    find_redundant_suffixes(&dict)?;
-    Ok(())
-}
+static CHECKS: &[(&str, Check)] = &[
+    ("Redundant suffixes", redundant_suffix),
+    ("Conflicts", conflict),
+    ("Unreachable", unreachable),
+];
 
-/// Scan through the dictionary for any entries that end in '-G', '-Z', '-S', or
-/// '-D', and look up the word without the suffix.  If we find that entry, and
-/// the orthography results in the same final text, this is a redundant entry.
-fn find_redundant_suffixes(dict: &MapDict) -> Result<()> {
-    let rules = Ortho::new()?;
-    for k in dict.keys() {
-        let last = k.len() - 1;
-        if k[last] == stroke!("-G") ||
-            k[last] == stroke!("-Z") ||
-            k[last] == stroke!("-S") ||
-            k[last] == stroke!("-D")
-        {
-            let full = dict.lookup(k).unwrap();
-            let short = if let Some(short) = dict.lookup(&k[..last]) {
-                short
-            } else {
-                continue;
-            };
-            println!("ending: {} ({})", StenoWord(k.to_vec()), short);
-            println!("   fixed: {} -> {}", full, rules.combine(short, to_ending(k[last])));
+fn main() -> Result<()> {
+    let start = Instant::now();
+    let dict = load_dict()?;
+    println!("{} entries, loaded in {:?}", dict.len(), start.elapsed());
+
+    for &(name, check) in CHECKS {
+        let start = Instant::now();
+        let found = check_all(dict, check);
+        println!("{}: {} found in {:?}", name, found.len(), start.elapsed());
+        for line in found {
+            println!("   {}", line);
         }
     }
     Ok(())
 }
 
-fn to_ending(stroke: Stroke) -> &'static str {
-    match stroke {
-        st if st == stroke!("-G") => "ing",
-        st if st == stroke!("-Z") => "s",
-        st if st == stroke!("-S") => "s",
-        st if st == stroke!("-D") => "ed",
-        _ => "???",
+/// Load the dictionaries given on the command line, merged into one.
+fn load_dict() -> Result<&'static MapDict> {
+    let mut paths: Vec<String> = std::env::args().skip(1).collect();
+    if paths.is_empty() {
+        paths.push("../dict-convert/main.json".to_string());
     }
+    let mut builder = MapDictBuilder::new();
+    for path in paths {
+        let data: BTreeMap<String, String> = serde_json::from_reader(File::open(path)?)?;
+        for (k, v) in data {
+            let k = StenoWord::parse(&k)?;
+            builder.insert(k.0, v);
+        }
+    }
+    Ok(Box::leak(Box::new(builder.into_map_dict())))
 }
 
-struct Ortho {
-    rules: Vec<(Regex, String)>,
+/// Run a check on every entry.  The findings are in dictionary order.
+fn check_all(dict: &'static MapDict, check: Check) -> Vec<String> {
+    let threads = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(1);
+    let chunk = (dict.len() / threads).max(1024);
+
+    std::thread::scope(|s| {
+        let workers: Vec<_> = dict.entries().chunks(chunk).map(|shard| {
+            s.spawn(move || {
+                shard.iter()
+                    .filter_map(|(k, v)| check(dict, k, v))
+                    .collect::<Vec<_>>()
+            })
+        }).collect();
+        workers.into_iter().flat_map(|w| w.join().unwrap()).collect()
+    })
 }
 
-impl Ortho {
-    pub fn new() -> Result<Ortho> {
-        let rules = ORTHO_BASE.iter().map(|(a, b)| {
-            let r2 = Regex::new(a)?;
-            Ok((r2, b.to_string()))
-        });
-        let rules: Result<Vec<_>> = rules.collect();
-        let rules = rules?;
-        Ok(Ortho { rules })
+/// An entry that ends in '-G', '-Z', '-S', or '-D', where the entry without the
+/// suffix stroke, with the suffix attached by the orthography rules, results in
+/// the same text.
+fn redundant_suffix(dict: &'static MapDict, key: &'static [Stroke], text: &'static str) -> Option<String> {
+    let (&last, short_key) = key.split_last()?;
+    let ending = to_ending(last)?;
+    let short = dict.lookup(short_key)?;
+    if !ops::is_plain(short) || ortho::combine(short, ending) != text {
+        return None;
     }
+    Some(format!("{}: {:?} is {:?} + {:?}", StenoWord(key.to_vec()), text, short, ending))
+}
 
-    pub fn combine(&self, left: &str, right: &str) -> String {
-        let start = format!("{} ^ {}", left, right);
-        for (rule, replacement) in &self.rules {
-            if let Some(cap) = rule.captures(&start) {
-                // println!("Rule: {:?} {:?},{:?}", start, rule, replacement);
-                let mut result = String::new();
-                cap.expand(replacement, &mut result);
-                // println!(" Match: {:?}", cap);
-                return result;
-            }
+/// An entry whose strokes can be split into two entries that, written one after
+/// the other, would type something other than a change in case.  Those two can
+/// never be written in a row, as the translator will always take the longer
+/// entry.
+fn conflict(dict: &'static MapDict, key: &'static [Stroke], text: &'static str) -> Option<String> {
+    for split in 1..key.len() {
+        let (left, right) = key.split_at(split);
+        let (first, second) = match (dict.lookup(left), dict.lookup(right)) {
+            (Some(first), Some(second)) => (first, second),
+            _ => continue,
+        };
+        // Phrases are often entered to get the capitalization right, which
+        // isn't a problem.
+        if !join(first, second).eq_ignore_ascii_case(Definition::split(text).text) {
+            return Some(format!("{}: {:?} hides {} {:?} then {} {:?}",
+                                StenoWord(key.to_vec()), text,
+                                StenoWord(left.to_vec()), first,
+                                StenoWord(right.to_vec()), second));
         }
-
-        // If no rules match, just combine them.
-        format!("{}{}", left, right)
     }
+    None
 }
 
-/// Othography rules copied out of plover, and changed to Rust string syntax.
-static ORTHO_BASE: &[(&str, &str)] = &[
-    // == +ly ==
-    // artistic + ly = artistically
-    (r"^(.*[aeiou]c) \^ ly$", r"$1ally"),
-    // humble + ly = humbly (*humblely)
-    // questionable +ly = questionably
-    // triple +ly = triply
-    (r"^(.+[aeioubmnp])le \^ ly$", r"$1ly"),
-
-    // == +ry ==
-    // statute + ry = statutory
-    (r"^(.*t)e \^ (ry|ary)$", r"$1ory"),
-    // confirm +tory = confirmatory (*confirmtory)
-    (r"^(.+)m \^ tor(y|ily)$", r"$1mator$2"),
-    // supervise +ary = supervisory (*supervisary)
-    (r"^(.+)se \^ ar(y|ies)$", r"$1sor$2"),
-
-    // == t +cy ==
-    // frequent + cy = frequency (tcy/tecy removal)
-    (r"^(.*[naeiou])te? \^ cy$", r"$1cy"),
-
-    // == +s ==
-    // establish + s = establishes (sibilant pluralization)
-    (r"^(.*(?:s|sh|x|z|zh)) \^ s$", r"$1es"),
-
-    // speech + s = speeches (soft ch pluralization)
-    // PERL crap: TODO: Can we do this without this?
-    // (r"^(.*(?:oa|ea|i|ee|oo|au|ou|l|n|(?<![gin]a)r|t)ch) \^ s$", r"$1es"),
-    (r"^(.*(?:oa|ea|i|ee|oo|au|ou|l|n|[^gin]ar|t)ch) \^ s$", r"$1es"),
-
-    // cherry + s = cherries (consonant + y pluralization)
-    (r"^(.+[bcdfghjklmnpqrstvwxz])y \^ s$", r"$1ies"),
-
-    // == y ==
-    // die+ing = dying
-    (r"^(.+)ie \^ ing$", r"$1ying"),
-    // metallurgy + ist = metallurgist
-    (r"^(.+[cdfghlmnpr])y \^ ist$", r"$1ist"),
-    // beauty + ful = beautiful (y -> i)
-    (r"^(.+[bcdfghjklmnpqrstvwxz])y \^ ([a-hj-xz].*)$", r"$1i$2"),
-
-    // == +en ==
-    // write + en = written
-    (r"^(.+)te \^ en$", r"$1tten"),
-    // Minessota +en = Minessotan (*Minessotaen)
-    (r"^(.+[ae]) \^ e(n|ns)$", r"$1$2"),
-
-    // == +ial ==
-    // ceremony +ial = ceremonial (*ceremonyial)
-    (r"^(.+)y \^ (ial|ially)$", r"$1$2"),
-    // == +if ==
-    // spaghetti +ification = spaghettification (*spaghettiification)
-    (r"^(.+)i \^ if(y|ying|ied|ies|ication|ications)$", r"$1if$2"),
-
-    // == +ical ==
-    // fantastic +ical = fantastical (*fantasticcal)
-    (r"^(.+)ic \^ (ical|ically)$", r"$1$2"),
-    // epistomology +ical = epistomological
-    (r"^(.+)ology \^ ic(al|ally)$", r"$1ologic$2"),
-    // oratory +ical = oratorical (*oratoryical)
-    (r"^(.*)ry \^ ica(l|lly|lity)$", r"$1rica$2"),
-
-    // == +ist ==
-    // radical +ist = radicalist (*radicallist)
-    (r"^(.*[l]) \^ is(t|ts)$", r"$1is$2"),
-
-    // == +ity ==
-    // complementary +ity = complementarity (*complementaryity)
-    (r"^(.*)ry \^ ity$", r"$1rity"),
-    // disproportional +ity = disproportionality (*disproportionallity)
-    (r"^(.*)l \^ ity$", r"$1lity"),
-
-    // == +ive, +tive ==
-    // perform +tive = performative (*performtive)
-    (r"^(.+)rm \^ tiv(e|ity|ities)$", r"$1rmativ$2"),
-    // restore +tive = restorative
-    (r"^(.+)e \^ tiv(e|ity|ities)$", r"$1ativ$2"),
-
-    // == +ize ==
-    // token +ize = tokenize (*tokennize)
-    // token +ise = tokenise (*tokennise)
-    (r"^(.+)y \^ iz(e|es|ing|ed|er|ers|ation|ations|able|ability)$", r"$1iz$2"),
-    (r"^(.+)y \^ is(e|es|ing|ed|er|ers|ation|ations|able|ability)$", r"$1is$2"),
-    // conditional +ize = conditionalize (*conditionallize)
-    (r"^(.+)al \^ iz(e|ed|es|ing|er|ers|ation|ations|m|ms|able|ability|abilities)$", r"$1aliz$2"),
-    (r"^(.+)al \^ is(e|ed|es|ing|er|ers|ation|ations|m|ms|able|ability|abilities)$", r"$1alis$2"),
-    // spectacular +ization = spectacularization (*spectacularrization)
-    (r"^(.+)ar \^ iz(e|ed|es|ing|er|ers|ation|ations|m|ms)$", r"$1ariz$2"),
-    (r"^(.+)ar \^ is(e|ed|es|ing|er|ers|ation|ations|m|ms)$", r"$1aris$2"),
-
-    // category +ize/+ise = categorize/categorise (*categoryize/*categoryise)
-    // custom +izable/+isable = customizable/customisable (*custommizable/*custommisable)
-    // fantasy +ize = fantasize (*fantasyize)
-    (r"^(.*[lmnty]) \^ iz(e|es|ing|ed|er|ers|ation|ations|m|ms|able|ability|abilities)$", r"$1iz$2"),
-    (r"^(.*[lmnty]) \^ is(e|es|ing|ed|er|ers|ation|ations|m|ms|able|ability|abilities)$", r"$1is$2"),
-
-    // == +olog ==
-    // criminal + ology = criminology
-    // criminal + ologist = criminalogist (*criminallologist)
-    (r"^(.+)al \^ olog(y|ist|ists|ical|ically)$", r"$1olog$2"),
-
-    // == +ish ==
-    // similar +ish = similarish (*similarrish)
-    (r"^(.+)(ar|er|or) \^ ish$", r"$1$2ish"),
+/// An entry that can never be translated, because it is longer than the
+/// translator's history, or that types nothing at all.
+fn unreachable(dict: &'static MapDict, key: &'static [Stroke], text: &'static str) -> Option<String> {
+    if text.is_empty() {
+        return Some(format!("{}: types nothing", StenoWord(key.to_vec())));
+    }
+    if key.len() <= Translator::HISTORY {
+        return None;
+    }
+    let other = dict.strokes_for(text).find(|k| k.len() <= Translator::HISTORY);
+    Some(match other {
+        Some(other) => format!("{}: {:?} is too long, but can be written {}",
+                               StenoWord(key.to_vec()), text, StenoWord(other.to_vec())),
+        None => format!("{}: {:?} is too long, and can't be written any other way",
+                        StenoWord(key.to_vec()), text),
+    })
+}
 
-    // free + ed = freed
-    (r"^(.+e)e \^ (e.+)$", r"$1$2"),
-    // narrate + ing = narrating (silent e)
-    (r"^(.+[bcdfghjklmnpqrstuvwxz])e \^ ([aeiouy].*)$", r"$1$2"),
+/// The text typed by two definitions written in a row.  This only handles the
+/// spacing and suffixes, which is enough to tell entries apart.
+fn join(first: &'static str, second: &'static str) -> String {
+    let (a, b) = (Definition::split(first), Definition::split(second));
+    if b.attach_before && ops::is_plain(b.text) {
+        ortho::combine(a.text, b.text)
+    } else if a.attach_after || (a.glue && b.glue) {
+        format!("{}{}", a.text, b.text)
+    } else {
+        format!("{} {}", a.text, b.text)
+    }
+}
 
-    // == misc ==
-    // defer + ed = deferred (consonant doubling)   XXX monitor(stress not on last syllable)
-    (r"^(.*(?:[bcdfghjklmnprstvwxyz]|qu)[aeiou])([bcdfgklmnprtvz]) \^ ([aeiouy].*)$", r"$1$2$2$3"),
-];
+fn to_ending(stroke: Stroke) -> Option<&'static str> {
+    match stroke {
+        st if st == stroke!("-G") => Some("ing"),
+        st if st == stroke!("-Z") => Some("s"),
+        st if st == stroke!("-S") => Some("s"),
+        st if st == stroke!("-D") => Some("ed"),
+        _ => None,
+    }
+}
@@ -1,19 +1,21 @@
 #![allow(dead_code)]
 
-use std::{fs::File, collections::BTreeMap, io::Write};
+use std::{fs::File, io::{BufReader, Write}, ops::Range};
 
-use anyhow::Result;
+use anyhow::{anyhow, Context, Result};
+use serde::de::{self, DeserializeSeed, Deserializer, MapAccess, Visitor};
 
 use bbq_steno::Stroke;
 use bbq_steno::stroke::StenoWord;
-use bbq_steno::dict::Dict;
-use bbq_steno::memdict::{MAGIC1, MemDict};
+use bbq_steno::dict::{ops, DictImpl, Selector};
+use bbq_steno::memdict::MemDict;
+use bbq_steno::memdict::encode::{encode_dict, Options};
 use bbq_steno_macros::stroke;
-use byteorder::{LittleEndian, WriteBytesExt};
 // use rand::RngCore;
 
-// Must match the endianness of our target.
-type Target = LittleEndian;
+/// Space for the user dictionary, from bbq-keyboard's USER_DICT to the end of
+/// the flash.
+const USER_SIZE: usize = 1024 * 1024;
 
 fn main() -> Result<()> {
     let commit = env!("GIT_COMMIT");
@@ -21,56 +23,239 @@ fn main() -> Result<()> {
     let stamp = env!("BUILD_TIMESTAMP");
     println!("commit: {:?}, dirty: {:?}, stamp: {:?}", commit, dirty, stamp);
 
-    let data: BTreeMap<String, String>  = serde_json::from_reader(
-        File::open("lapwing-base.json")?
-    )?;
-
-    let mut dict: BTreeMap<StenoWord, String> = BTreeMap::new();
+    // The trie and reverse indices are optional, and can be left out to save
+    // space.
+    let mut trie = true;
+    let mut reverse = true;
+    // With --user, the output is the user dictionary, to be programmed at
+    // bbq-keyboard's USER_DICT.  It is an image just like the main one, but
+    // must fit in the space there.
+    let mut user = false;
+    let mut output = None;
+    let mut inputs = Vec::new();
+    let mut args = std::env::args().skip(1);
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--no-trie" => trie = false,
+            "--no-reverse" => reverse = false,
+            "--user" => user = true,
+            "-o" | "--output" => output = Some(args.next().ok_or_else(|| anyhow!("{} needs a path", arg))?),
+            _ => inputs.push(arg),
+        }
+    }
+    if inputs.is_empty() {
+        inputs.push("lapwing-base.json".to_string());
+    }
 
-    for (k, v) in data.iter() {
-        let k = StenoWord::parse(k)?;
-        dict.insert(k, v.clone());
+    // Later inputs take priority over earlier ones.
+    let mut raw = RawEntries::default();
+    for input in &inputs {
+        let file = BufReader::new(File::open(input).with_context(|| input.clone())?);
+        let mut de = serde_json::Deserializer::from_reader(file);
+        de.deserialize_map(&mut raw).with_context(|| input.clone())?;
+        de.end()?;
     }
+    println!("Entries read: {}", raw.entries.len());
+
+    let dict = raw.parse()?;
+    let entries = dict.sorted();
 
     // Print out the longest entry.
-    let longest = dict.keys().map(|k| k.0.len()).max();
+    let longest = entries.iter().map(|(k, _)| k.len()).max();
     println!("Longest key: {:?}", longest);
 
-    let memory = encode_dict(&dict)?;
+    let stamp = format!("({:?}, {:?}, {:?})", commit, dirty, stamp);
+    let memory = encode_dict(&entries, &Options { trie, reverse, ..Options::default() }, &stamp)?;
+    if user && memory.len() > USER_SIZE {
+        return Err(anyhow!("User dictionary is {} bytes, only {} fit", memory.len(), USER_SIZE));
+    }
 
-    File::create("lapwing-base.bin")?.write_all(&memory)?;
+    let default = if user { "user.bin" } else { "lapwing-base.bin" };
+    File::create(output.as_deref().unwrap_or(default))?.write_all(&memory)?;
 
     // Let's map this (somewhat unsafely) and see what we get out of it.
     let mdict = unsafe { MemDict::from_raw_ptr(memory.as_ptr()).unwrap() };
     println!("Header:\n{:#?}", mdict.raw);
     println!("Keys: {}", mdict.keys.len());
+    println!("Trie nodes: {}", mdict.trie.len());
     println!("Longest: {}", mdict.longest_key());
+    println!("Compiled: {}", mdict.compiled);
 
     // Print out the first some number of keys.
-    for k in 0 .. 12 {
-        let key = mdict.get_key(k);
+    for k in 0 .. 12.min(mdict.len()) {
+        let key = mdict.key(k);
         let key = StenoWord(key.to_vec());
-        let text = mdict.get_text(k);
+        let text = mdict.value(k);
         println!("   {} -> {:?}", key, text);
     }
 
+    let mdict: &'static MemDict = Box::leak(Box::new(mdict));
+
     // Try some lookups.
     println!("lookup test");
-    for stroke in TEST_STROKES {
-        let text = mdict.lookup(stroke);
-        println!("  {} -> {:?}", StenoWord(stroke.to_vec()), text);
-        let text = mdict.prefix_lookup(stroke);
-        println!("  {} -> {:?}", StenoWord(stroke.to_vec()), text);
+    for stroke in TEST_STROKES.iter().chain(PREFIX_STROKES) {
+        println!("  {} -> {:?}", StenoWord(stroke.to_vec()), lookup(mdict, stroke));
     }
 
-    println!("prefix lookup test");
-    for stroke in PREFIX_STROKES {
-        let text = mdict.prefix_lookup(stroke);
-        println!("  {} -> {:?}", StenoWord(stroke.to_vec()), text);
+    println!("reverse lookup test");
+    for text in ["the", "interesting", "\x01ing"] {
+        let key = mdict.shortest_key(text).map(|k| StenoWord(k.to_vec()));
+        println!("  {:?} <- {}", text, key.map(|k| k.to_string()).unwrap_or("none".to_string()));
     }
     Ok(())
 }
 
+/// The entries of the input dictionaries, as they are read.  The text of every
+/// key and definition is kept in a single buffer, rather than a pair of
+/// strings per entry.  The definitions are compiled as they are read, see
+/// `bbq_steno::dict::ops`.
+#[derive(Default)]
+struct RawEntries {
+    buf: String,
+    /// The key and definition of each entry, as ranges in `buf`.
+    entries: Vec<(Range<usize>, Range<usize>)>,
+}
+
+/// The entries with their keys parsed.  The strokes of every key are in a
+/// single buffer.
+struct Entries {
+    text: String,
+    strokes: Vec<Stroke>,
+    /// The strokes and definition of each entry, in input order.
+    entries: Vec<(Range<usize>, Range<usize>)>,
+}
+
+impl<'de> Visitor<'de> for &mut RawEntries {
+    type Value = ();
+
+    fn expecting(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "a map of steno to definitions")
+    }
+
+    /// Take the entries one at a time, so the whole input never needs to be
+    /// held as a map.
+    fn visit_map<A: MapAccess<'de>>(self, mut map: A) -> std::result::Result<(), A::Error> {
+        while let Some(key) = map.next_key_seed(Append(&mut self.buf, String::push_str))? {
+            let value = map.next_value_seed(Append(&mut self.buf, ops::compile_into))?;
+            self.entries.push((key, value));
+        }
+        Ok(())
+    }
+}
+
+/// Deserialize a string by appending it to a buffer, giving its range.  The
+/// string is appended with the given function.
+struct Append<'a>(&'a mut String, fn(&mut String, &str));
+
+impl<'de, 'a> DeserializeSeed<'de> for Append<'a> {
+    type Value = Range<usize>;
+
+    fn deserialize<D: Deserializer<'de>>(self, de: D) -> std::result::Result<Range<usize>, D::Error> {
+        de.deserialize_str(self)
+    }
+}
+
+impl<'de, 'a> Visitor<'de> for Append<'a> {
+    type Value = Range<usize>;
+
+    fn expecting(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "a string")
+    }
+
+    fn visit_str<E: de::Error>(self, text: &str) -> std::result::Result<Range<usize>, E> {
+        let a = self.0.len();
+        (self.1)(self.0, text);
+        Ok(a..self.0.len())
+    }
+}
+
+impl RawEntries {
+    /// Parse the keys.  This is split across threads, each parsing a run of
+    /// the entries into its own stroke buffer, which are then joined.
+    fn parse(self) -> Result<Entries> {
+        let threads = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(1);
+        let chunk = (self.entries.len() / threads).max(1024);
+        let buf = &self.buf;
+
+        let parsed: Vec<Result<(Vec<Stroke>, Vec<Range<usize>>)>> = std::thread::scope(|s| {
+            let workers: Vec<_> = self.entries.chunks(chunk).map(|entries| {
+                s.spawn(move || {
+                    let mut strokes = Vec::new();
+                    let mut keys = Vec::with_capacity(entries.len());
+                    for (key, _) in entries {
+                        let a = strokes.len();
+                        for st in buf[key.clone()].split('/') {
+                            let st = Stroke::from_text(st)
+                                .with_context(|| format!("parsing {:?}", &buf[key.clone()]))?;
+                            strokes.push(st);
+                        }
+                        keys.push(a..strokes.len());
+                    }
+                    Ok((strokes, keys))
+                })
+            }).collect();
+            workers.into_iter().map(|w| w.join().unwrap()).collect()
+        });
+
+        let mut strokes = Vec::new();
+        let mut entries = Vec::with_capacity(self.entries.len());
+        let mut values = self.entries.into_iter().map(|(_, value)| value);
+        for part in parsed {
+            let (part_strokes, keys) = part?;
+            let base = strokes.len();
+            strokes.extend_from_slice(&part_strokes);
+            for key in keys {
+                entries.push((key.start + base..key.end + base, values.next().unwrap()));
+            }
+        }
+
+        Ok(Entries { text: self.buf, strokes, entries })
+    }
+}
+
+impl Entries {
+    /// The entries sorted by key.  Where there are several definitions for the
+    /// same strokes, the last one read wins.
+    fn sorted(&self) -> Vec<(&[Stroke], &str)> {
+        let mut order: Vec<u32> = (0..self.entries.len() as u32).collect();
+        // The sort is stable, so the definitions of each key stay in the order
+        // they were read.
+        order.sort_by(|&a, &b| self.key(a).cmp(self.key(b)));
+
+        let mut result: Vec<(&[Stroke], &str)> = Vec::with_capacity(order.len());
+        for index in order {
+            let entry = (self.key(index), &self.text[self.entries[index as usize].1.clone()]);
+            match result.last_mut() {
+                Some(last) if last.0 == entry.0 => *last = entry,
+                _ => result.push(entry),
+            }
+        }
+        result
+    }
+
+    fn key(&self, index: u32) -> &[Stroke] {
+        &self.strokes[self.entries[index as usize].0.clone()]
+    }
+}
+
+/// Perform the lookup of a sequence of strokes with a selector, returning the
+/// text of the last stroke that resulted in a translation.
+fn lookup(dict: &'static MemDict, strokes: &[Stroke]) -> Option<(usize, &'static str)> {
+    let mut sel = Selector::new(dict);
+    let mut best = None;
+    for st in strokes {
+        let (next, text) = match sel.lookup_step(*st) {
+            Some(step) => step,
+            None => break,
+        };
+        if let Some(text) = text {
+            best = Some((next.count, text));
+        }
+        sel = next;
+    }
+    best
+}
+
 static TEST_STROKES: &[&[Stroke]] = &[
     &[stroke!("-T")],
     &[stroke!("THE")],
@@ -111,99 +296,3 @@ static PREFIX_STROKES: &[&[Stroke]] = &[
         stroke!("-Z"),
     ],
 ];
-
-fn encode_dict(dict: &BTreeMap<StenoWord, String>) -> Result<Vec<u8>> {
-    let mut result = Vec::new();
-
-    // The header gets a placeholder for now.
-    for _ in 0..128 {
-        result.push(0);
-    }
-    let mut header = Vec::new();
-    header.extend(MAGIC1);
-    header.write_u32::<Target>(dict.len() as u32)?;
-
-    // Write out the key table.
-    let mut keys = Vec::new();
-    let key_table = result.len();
-    let mut offset = 0;
-    for k in dict.keys() {
-        // Record the key offset table.
-        keys.push(TablePos { offset, length: k.0.len() });
-        offset += k.0.len();
-
-        // Push out the strokes to the file.
-        for st in &k.0 {
-            result.write_u32::<Target>(st.into_raw())?;
-        }
-    }
-    let new_pos = result.len();
-    header.write_u32::<Target>(key_table as u32)?;
-    header.write_u32::<Target>((new_pos - key_table) as u32)?;
-
-    assert_eq!(dict.len(), keys.len());
-
-    pad(&mut result, 8);
-    let keyposes = result.len();
-    header.write_u32::<Target>(keyposes as u32)?;
-
-    for pos in &keys {
-        result.write_u32::<Target>(pos.encoded())?;
-    }
-
-    pad(&mut result, 8);
-    // Encode all of the text strings.
-    let mut texts = Vec::new();
-    let text_table = result.len();
-    let mut offset = 0;
-    for v in dict.values() {
-        texts.push(TablePos { offset, length: v.len() });
-        offset += v.len();
-
-        // Append the raw text.
-        result.extend_from_slice(v.as_bytes());
-    }
-
-    pad(&mut result, 8);
-    header.write_u32::<Target>(text_table as u32)?;
-    header.write_u32::<Target>(offset as u32)?;
-
-    let textposes = result.len();
-    header.write_u32::<Target>(textposes as u32)?;
-    for pos in &texts {
-        result.write_u32::<Target>(pos.encoded())?;
-    }
-
-    pad(&mut result, 8);
-
-    // Stamp the header in place.
-    result[0..header.len()].copy_from_slice(&header);
-    let mut wr = &mut result[header.len()..128];
-    write!(&mut wr, "({:?}, {:?}, {:?})",
-           env!("GIT_COMMIT"),
-           env!("GIT_DIRTY"),
-           env!("BUILD_TIMESTAMP"),
-    )?;
-
-    Ok(result)
-}
-
-fn pad(buf: &mut Vec<u8>, count: usize) {
-    while (buf.len() % count) > 0 {
-        buf.push(0);
-    }
-}
-
-struct TablePos {
-    offset: usize,
-    length: usize,
-}
-
-impl TablePos {
-    fn encoded(&self) -> u32 {
-        // Encode by putting the length as the upper 8 bits, and the offset in the lower.
-        assert!(self.length < (1 << 8));
-        assert!(self.offset < (1 << 24));
-        ((self.length << 24) as u32) | (self.offset as u32)
-    }
-}
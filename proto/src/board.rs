@@ -10,11 +10,12 @@ pub use proto2::*;
 #[cfg(feature = "proto3")]
 pub use proto3::*;
 
+/// The columns are driven by the PIO scanner, and must be consecutive GPIOs.
 macro_rules! col_pins {
     ($pins:expr, $($pin:ident),*) => {
         [
             $($pins.$pin
-              .into_push_pull_output_in_state(PinState::Low)
+              .into_function::<FunctionPio0>()
               .into_dyn_pin()),*
         ]
     };
@@ -4,6 +4,9 @@ pub const NCOLS: usize = 6;
 pub const NROWS: usize = 4;
 pub const NKEYS: usize = NCOLS * NROWS;
 
+/// How long, in us, a key must read consistently before it changes state.
+pub const DEBOUNCE_US: u64 = 20_000;
+
 macro_rules! cols {
     ($pins:expr) => {
         crate::board::col_pins!($pins, gpio2, gpio3, gpio4, gpio5, gpio6, gpio7)
@@ -0,0 +1,175 @@
+//! Steno translation on the second core.
+//!
+//! With the `core1` feature, the translator, and the dictionary lookups it
+//! does, run on core 1, leaving core 0 to the scanning, USB, and the
+//! inter-link.  Each stroke is sent to core 1 as a single word through the SIO
+//! FIFO.  Core 1 puts the resulting actions in a fixed ring, shared between the
+//! cores, and then answers with a single word, so nothing is allocated per
+//! stroke.  Core 0 is woken by the FIFO interrupt, rather than polling.
+
+use core::cell::UnsafeCell;
+use core::mem::MaybeUninit;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+use bbq_keyboard::dict::Dict;
+use bbq_steno::dict::TypeAction;
+use bbq_steno::Stroke;
+use cortex_m::peripheral::NVIC;
+use rtic_sync::channel::Receiver;
+
+use crate::app::WrapTimer;
+use crate::stats::{self, Stage};
+use crate::bsp::hal;
+use hal::multicore::{Multicore, Stack};
+use hal::pac;
+use hal::sio::{Sio, SioFifo};
+
+static mut CORE1_STACK: Stack<8192> = Stack::new();
+
+/// Answer from core 1 when it has finished a stroke.
+const DONE: u32 = 1;
+
+/// Answer from core 1 when the ring is full, and must be emptied before it
+/// can finish the stroke.
+const FULL: u32 = 0;
+
+/// Actions waiting to be typed.  A few strokes worth, as a stroke rarely gives
+/// more than one or two.
+const RING_SIZE: usize = 16;
+
+/// Single producer, single consumer ring of actions.  Core 1 only pushes, and
+/// core 0 only pops.  Each side only stores its own index, so plain atomic
+/// loads and stores, which the M0+ has, are enough.
+struct Ring {
+    slots: UnsafeCell<[MaybeUninit<TypeAction>; RING_SIZE]>,
+    /// Next slot to pop, only stored by core 0.
+    head: AtomicUsize,
+    /// Next slot to push, only stored by core 1.
+    tail: AtomicUsize,
+}
+
+unsafe impl Sync for Ring {}
+
+static RING: Ring = Ring {
+    slots: UnsafeCell::new(unsafe { MaybeUninit::uninit().assume_init() }),
+    head: AtomicUsize::new(0),
+    tail: AtomicUsize::new(0),
+};
+
+impl Ring {
+    /// Push an action, giving it back if the ring is full.  Only core 1 may
+    /// call this.
+    fn push(&self, action: TypeAction) -> Result<(), TypeAction> {
+        let tail = self.tail.load(Ordering::Relaxed);
+        if tail.wrapping_sub(self.head.load(Ordering::Acquire)) == RING_SIZE {
+            return Err(action);
+        }
+        unsafe { (*self.slots.get())[tail % RING_SIZE].write(action) };
+        self.tail.store(tail.wrapping_add(1), Ordering::Release);
+        Ok(())
+    }
+
+    /// Pop an action, if there is one.  Only core 0 may call this.
+    fn pop(&self) -> Option<TypeAction> {
+        let head = self.head.load(Ordering::Relaxed);
+        if head == self.tail.load(Ordering::Acquire) {
+            return None;
+        }
+        let action = unsafe { (*self.slots.get())[head % RING_SIZE].assume_init_read() };
+        self.head.store(head.wrapping_add(1), Ordering::Release);
+        Some(action)
+    }
+}
+
+/// Core 0's side of the translator.
+pub struct Translator {
+    fifo: SioFifo,
+    /// Woken from the FIFO interrupt, see `sio_irq`.
+    wake: Receiver<'static, (), 1>,
+    /// Strokes sent to core 1 that haven't been answered.
+    pending: usize,
+}
+
+impl Translator {
+    /// Start the translator on core 1.
+    pub fn start(
+        psm: &mut pac::PSM,
+        ppb: &mut pac::PPB,
+        mut fifo: SioFifo,
+        wake: Receiver<'static, (), 1>,
+    ) -> Self {
+        let mut mc = Multicore::new(psm, ppb, &mut fifo);
+        let cores = mc.cores();
+        cores[1]
+            .spawn(unsafe { &mut CORE1_STACK.mem }, move || core1_main())
+            .unwrap();
+        Translator { fifo, wake, pending: 0 }
+    }
+
+    /// Send a stroke to core 1.  Returns false, without sending it, if the
+    /// FIFO is full.
+    pub fn send(&mut self, stroke: Stroke) -> bool {
+        if !self.fifo.is_write_ready() {
+            return false;
+        }
+        self.fifo.write(stroke.into_raw());
+        self.pending += 1;
+        true
+    }
+
+    /// Read the answers from core 1, and hand each action that is ready to
+    /// `f`, in order.
+    pub fn recv<F: FnMut(TypeAction)>(&mut self, mut f: F) {
+        while let Some(word) = self.fifo.read() {
+            if word == DONE {
+                self.pending -= 1;
+            }
+            while let Some(action) = RING.pop() {
+                f(action);
+            }
+        }
+    }
+
+    /// Are there strokes still being translated?
+    pub fn is_busy(&self) -> bool {
+        self.pending > 0
+    }
+
+    /// Wait for core 1 to answer.
+    pub async fn wait(&mut self) {
+        // Discard a wake from an answer that has already been read.  The
+        // interrupt is level triggered, so is asserted again right away if
+        // there is anything unread.
+        let _ = self.wake.try_recv();
+        unsafe {
+            NVIC::unmask(pac::Interrupt::SIO_IRQ_PROC0);
+        }
+        let _ = self.wake.recv().await;
+    }
+}
+
+fn core1_main() -> ! {
+    // Core 1 only uses the FIFO, which is per core.
+    let pac = unsafe { pac::Peripherals::steal() };
+    let mut sio = Sio::new(pac.SIO);
+
+    let mut dict = Dict::new();
+    loop {
+        let stroke = Stroke::from_raw(sio.fifo.read_blocking());
+        let start = stats::start();
+        dict.each_action(stroke, &WrapTimer, |mut action| {
+            let mut told = false;
+            while let Err(back) = RING.push(action) {
+                // Core 0 empties the ring whenever it reads from the FIFO.
+                if !told {
+                    sio.fifo.write_blocking(FULL);
+                    told = true;
+                }
+                core::hint::spin_loop();
+                action = back;
+            }
+        });
+        start.end(Stage::Lookup);
+        sio.fifo.write_blocking(DONE);
+    }
+}
@@ -7,14 +7,18 @@ use core::mem::replace;
 use arraydeque::ArrayDeque;
 use defmt::{info, warn};
 use embedded_hal::serial::Read;
+use rtic_monotonics::rp2040::Timer;
+use rtic_monotonics::Monotonic;
 use rtic_sync::channel::Sender;
 use smart_leds::RGB8;
 use sparkfun_pro_micro_rp2040::hal;
 use sparkfun_pro_micro_rp2040::hal::uart::UartPeripheral;
 
-use bbq_keyboard::{Event, InterState, KeyEvent, Side};
+use bbq_keyboard::{Event, InterState, KeyBatch, Side};
 
-use bbq_keyboard::serialize::{Decoder, EventVec, Packet, PacketBuffer};
+use bbq_keyboard::serialize::{Decoder, Packet, PacketBuffer};
+
+use crate::stats::{self, Mark};
 
 pub struct InterHandler<D, P>
 where
@@ -28,10 +32,24 @@ where
     side: Side,
     seq: u8,
     state: InterState,
-    keys: EventVec,
+    /// On the secondary, the state of our keys, and whether it has changed
+    /// since the last packet.  On the primary, the last state received from
+    /// the secondary.
+    keys: u64,
+    changed: bool,
 
     /// RGB values to send to other side.
     leds: RGB8,
+    /// On the secondary, the RGB values last received, so that only changes
+    /// are passed on.
+    recv_leds: Option<RGB8>,
+
+    /// On the primary, a Secondary packet with keys, to acknowledge.
+    ack: Option<u8>,
+    /// On the secondary, when each packet with key changes was sent, by
+    /// sequence number, or 0 if it has been acknowledged.
+    sent: [u32; 256],
+    latency: Latency,
 }
 
 impl<D: hal::uart::UartDevice, P: hal::uart::ValidUartPinout<D>> InterHandler<D, P> {
@@ -50,8 +68,13 @@ impl<D: hal::uart::UartDevice, P: hal::uart::ValidUartPinout<D>> InterHandler<D,
             seq: 1,
             side,
             state: InterState::Idle,
-            keys: EventVec::new(),
+            keys: 0,
+            changed: false,
             leds: RGB8::new(4, 4, 4),
+            recv_leds: None,
+            ack: None,
+            sent: [0; 256],
+            latency: Latency::default(),
         }
     }
 
@@ -61,12 +84,23 @@ impl<D: hal::uart::UartDevice, P: hal::uart::ValidUartPinout<D>> InterHandler<D,
     ) {
         self.try_recv(events);
         self.try_send();
+
+        // Keys that changed while the last packet was going out.
+        if self.state == InterState::Secondary && self.changed {
+            self.send_packet();
+        }
     }
 
+    /// The tick sends a packet, even if there is nothing new, so that each
+    /// side knows the other is there.
     pub fn tick(&mut self) {
-        // If we are transmitting still, just warn about the overflow.
+        self.send_packet();
+    }
+
+    /// Build and start sending a packet for our current state, unless one is
+    /// still being sent.
+    fn send_packet(&mut self) {
         if !self.xmit_buffer.is_empty() {
-            warn!("transmit overflow");
             return;
         }
 
@@ -81,17 +115,17 @@ impl<D: hal::uart::UartDevice, P: hal::uart::ValidUartPinout<D>> InterHandler<D,
                 Packet::Primary {
                     side: self.side,
                     led: self.leds,
+                    ack: self.ack.take(),
                 }
                 .encode(&mut self.xmit_buffer, &mut self.seq);
             }
             InterState::Secondary => {
-                let keys = replace(&mut self.keys, EventVec::new());
-                // if !keys.is_empty() {
-                //     info!("Send secondary {} keys", keys.len());
-                // }
+                if replace(&mut self.changed, false) {
+                    self.sent[self.seq as usize] = (Timer::now().ticks() as u32).max(1);
+                }
                 Packet::Secondary {
                     side: self.side,
-                    keys,
+                    keys: self.keys,
                 }
                 .encode(&mut self.xmit_buffer, &mut self.seq);
             }
@@ -145,26 +179,48 @@ impl<D: hal::uart::UartDevice, P: hal::uart::ValidUartPinout<D>> InterHandler<D,
                         // now just ignore it.
                         // self.set_state(InterState::Idle, events);
                     }
-                    Packet::Primary { side: _, led } => {
+                    Packet::Primary { side: _, led, ack } => {
                         // Upon receiving a primary message, this tells us we
                         // are secondary.
                         // info!("Got primary");
                         self.set_state(InterState::Secondary, events);
-                        let _ = events.try_send(Event::RecvLed(led));
+                        if self.recv_leds != Some(led) && events.try_send(Event::RecvLed(led)).is_ok() {
+                            self.recv_leds = Some(led);
+                        }
+
+                        if let Some(ack) = ack {
+                            let sent = replace(&mut self.sent[ack as usize], 0);
+                            if sent != 0 {
+                                let now = Timer::now().ticks() as u32;
+                                self.latency.add(now.wrapping_sub(sent) / 2);
+                            }
+                        }
                     }
                     Packet::Secondary { side: _, keys } => {
                         // info!("Secondary");
                         if events.try_send(Event::Heartbeat).is_err() {
                             warn!("UART: event queue full");
                         }
-                        for key in &keys {
-                            if events.try_send(Event::InterKey(*key)).is_err() {
+                        let batch = KeyBatch {
+                            pressed: keys & !self.keys,
+                            released: self.keys & !keys,
+                        };
+                        if !batch.is_empty() {
+                            // Only take the new state once it has been
+                            // delivered, so that a dropped batch is seen
+                            // again in the next packet.
+                            if events.try_send(Event::InterKey(batch)).is_ok() {
+                                self.keys = keys;
+                            } else {
                                 warn!("UART: key event queue full");
+                                stats::count(Mark::EventDropped);
                             }
+
+                            // Acknowledge changes right away, so the other
+                            // side can measure the latency.
+                            self.ack = Some(self.receiver.seq());
+                            self.send_packet();
                         }
-                        // if !keys.is_empty() {
-                        //     info!("{} keys", keys.len());
-                        // }
                     }
                 }
             }
@@ -181,6 +237,7 @@ impl<D: hal::uart::UartDevice, P: hal::uart::ValidUartPinout<D>> InterHandler<D,
     ) {
         if self.state != state {
             self.state = state;
+            self.recv_leds = None;
             info!("Inter state change: {}", state);
             if events.try_send(Event::BecomeState(state)).is_err() {
                 warn!("set_state: UART: event queue full");
@@ -188,11 +245,44 @@ impl<D: hal::uart::UartDevice, P: hal::uart::ValidUartPinout<D>> InterHandler<D,
         }
     }
 
-    pub fn add_key(&mut self, key: KeyEvent) {
-        self.keys.push(key);
+    pub fn state(&self) -> InterState {
+        self.state
+    }
+
+    /// Update the key state from our matrix that is sent to the primary, and
+    /// send it right away, if the link is free.
+    pub fn add_keys(&mut self, keys: KeyBatch) {
+        self.keys = (self.keys | keys.pressed) & !keys.released;
+        self.changed = true;
+        self.send_packet();
     }
 
     pub fn set_other_led(&mut self, leds: RGB8) {
         self.leds = leds;
     }
 }
+
+/// The one-way latency of the link, estimated as half of the time from sending
+/// a packet with keys to receiving its acknowledgement.  This is logged every
+/// so often, to help with tuning.
+#[derive(Default)]
+struct Latency {
+    count: u32,
+    total: u32,
+    max: u32,
+}
+
+/// How many measurements to gather before logging them.
+const LATENCY_REPORT: u32 = 256;
+
+impl Latency {
+    fn add(&mut self, us: u32) {
+        self.count += 1;
+        self.total += us;
+        self.max = self.max.max(us);
+        if self.count == LATENCY_REPORT {
+            info!("Inter latency: {}us avg, {}us max", self.total / self.count, self.max);
+            *self = Latency::default();
+        }
+    }
+}
@@ -1,14 +1,22 @@
 //! Control of the LEDs.
+//!
+//! The indications are run by `led_task`, which sleeps until the current step
+//! is over, or until the indication is changed.  The LED is only written when
+//! its colour changes, which, as there is a single LED, is a single word into
+//! the PIO FIFO that never waits.
 
 #![allow(unused_variables)]
 #![allow(dead_code)]
 
 use core::iter::once;
 
-use bbq_keyboard::Event;
+use rtic_monotonics::rp2040::{ExtU64, Timer};
+use rtic_monotonics::Monotonic;
 use rtic_sync::channel::Sender;
 use smart_leds::{SmartLedsWrite, RGB8};
 
+type Instant = <Timer as Monotonic>::Instant;
+
 const OFF: RGB8 = RGB8::new(0, 0, 0);
 // const INIT: RGB8 = RGB8::new(8, 8, 0);
 
@@ -16,6 +24,7 @@ pub struct Indication(&'static [Step]);
 
 struct Step {
     color: RGB8,
+    /// How long to show the colour, in ms.
     count: usize,
 }
 
@@ -181,73 +190,94 @@ pub struct LedManager<L: SmartLedsWrite<Color = RGB8>> {
     /// A single shot.  Runs until out of steps, and then is removed.
     oneshot: Option<&'static [Step]>,
 
-    /// Information on the current display.
-    count: usize,
+    /// Information on the current display.  When the deadline is None, the
+    /// next step starts as soon as the task runs.
     phase: usize,
+    deadline: Option<Instant>,
+
+    /// The colour last written, so that steps that don't change it aren't
+    /// written, or sent to the other side.
+    shown: Option<RGB8>,
 
     /// Override the indicator by LEDs sent from the other side.
     other_side: bool,
+
+    /// Wakes the led task when the indication changes.
+    wake: Sender<'static, (), 1>,
 }
 
 impl<L: SmartLedsWrite<Color = RGB8>> LedManager<L> {
-    pub fn new(leds: L) -> Self {
+    pub fn new(leds: L, wake: Sender<'static, (), 1>) -> Self {
         LedManager {
             leds,
             // Assumes that we are in this state.
             base: STENO_INDICATOR.0,
             global: Some(INIT_INDICATOR.0),
             oneshot: None,
-            count: 0,
             phase: 0,
+            deadline: None,
+            shown: None,
             other_side: false,
+            wake,
         }
     }
 
-    pub fn tick(
-        &mut self,
-        events: &mut Sender<'static, Event, { crate::app::EVENT_CAPACITY }>,
-    ) {
+    /// Move on to the next step, if the current one is over.  Returns when
+    /// this next needs to be called, or None to wait for a change of
+    /// indication, and the new colour to send to the other side, if it changed.
+    pub fn update(&mut self, now: Instant) -> (Option<Instant>, Option<RGB8>) {
         // If the other side is active, just leave the LED alone.
         if self.other_side {
-            return;
+            return (None, None);
         }
 
-        if self.count == 0 {
-            let mut steps = self.base;
-            if let Some(gl) = self.global {
-                steps = gl;
-            }
-            if let Some(one) = self.oneshot {
-                steps = one;
+        if let Some(deadline) = self.deadline {
+            if now < deadline {
+                return (Some(deadline), None);
             }
+        }
 
-            if self.phase >= steps.len() {
-                self.phase = 0;
-
-                // If this is the oneshot, back out of that and return to an earlier state.
-                if self.oneshot.is_some() {
-                    self.oneshot = None;
+        let mut steps = self.base;
+        if let Some(gl) = self.global {
+            steps = gl;
+        }
+        if let Some(one) = self.oneshot {
+            steps = one;
+        }
 
-                    // Hack, make the phase past, as the remaining will repeat,
-                    // and this will cause them to restart. Better would be for
-                    // each to maintain its own state.
-                    self.phase = 1000;
+        if self.phase >= steps.len() {
+            self.phase = 0;
 
-                    // Just wait until the next tick.
-                    return;
-                }
+            // If this is the oneshot, back out of that and return to the
+            // earlier state, from its start.
+            if self.oneshot.take().is_some() {
+                steps = self.global.unwrap_or(self.base);
             }
+        }
+
+        let step = &steps[self.phase];
+        let deadline = now + (step.count as u64).millis();
+        self.deadline = Some(deadline);
+        self.phase += 1;
 
-            let rgb = steps[self.phase].color;
-            let _ = events.try_send(Event::SendLed(rgb));
+        (Some(deadline), self.show(step.color))
+    }
 
-            let _ = self.leds.write(once(rgb));
-            // let _ = self.leds.write(once(if self.phase { INIT } else { OFF }));
-            self.count = steps[self.phase].count;
-            self.phase += 1;
-        } else {
-            self.count -= 1;
+    /// Write a colour to the LED, returning it if it changed.
+    fn show(&mut self, color: RGB8) -> Option<RGB8> {
+        if self.shown == Some(color) {
+            return None;
         }
+        self.shown = Some(color);
+        let _ = self.leds.write(once(color));
+        Some(color)
+    }
+
+    /// Start the current indication over, waking the task to show it.
+    fn restart(&mut self) {
+        self.phase = 0;
+        self.deadline = None;
+        let _ = self.wake.try_send(());
     }
 
     /// Set a global indicator. This will override any other status being
@@ -256,38 +286,34 @@ impl<L: SmartLedsWrite<Color = RGB8>> LedManager<L> {
     /// yet.
     pub fn set_global(&mut self, indicator: &Indication) {
         self.global = Some(indicator.0);
-        self.count = 0;
-        self.phase = 0;
+        self.restart();
     }
 
     pub fn clear_global(&mut self) {
         self.global = None;
         if self.oneshot.is_none() {
-            self.count = 0;
-            self.phase = 0;
+            self.restart();
         }
     }
 
     pub fn set_base(&mut self, indicator: &Indication) {
         self.base = indicator.0;
         if self.oneshot.is_none() && self.global.is_none() {
-            self.count = 0;
-            self.phase = 0;
+            self.restart();
         }
     }
 
     /// Override the LEDs, setting to just a value sent by the other side.
     pub fn set_other_side(&mut self, leds: RGB8) {
         self.other_side = true;
-        let _ = self.leds.write(once(leds));
+        self.show(leds);
     }
 
     /*
     /// Set a oneshot indicator.
     pub fn set_oneshot(&mut self, indicator: &Indication) {
         self.oneshot = Some(indicator.0);
-        self.count = 0;
-        self.phase = 0;
+        self.restart();
     }
     */
 }
@@ -15,7 +15,7 @@ use core::{
     sync::atomic::{AtomicU8, Ordering},
 };
 
-use bsp::hal::gpio::{DynPinId, FunctionSio, Pin, PullDown, SioInput, SioOutput};
+use bsp::hal::gpio::{DynPinId, FunctionSio, Pin, PullDown, SioInput};
 use defmt_rtt as _;
 use embedded_alloc::Heap;
 use matrix::Matrix;
@@ -24,9 +24,13 @@ use panic_probe as _;
 use sparkfun_pro_micro_rp2040 as bsp;
 
 mod board;
+#[cfg(feature = "core1")]
+mod core1;
 mod inter;
 mod leds;
 mod matrix;
+mod scanner;
+mod stats;
 mod usb;
 
 #[global_allocator]
@@ -37,12 +41,17 @@ const HEAP_SIZE: usize = 150000;
 type MatrixType = Matrix<
     Infallible,
     Pin<DynPinId, FunctionSio<SioInput>, PullDown>,
-    Pin<DynPinId, FunctionSio<SioOutput>, PullDown>,
     { board::NCOLS },
     { board::NROWS },
     { board::NKEYS },
 >;
 
+/// The steno translator, which runs either in steno_task, or on core 1.
+#[cfg(not(feature = "core1"))]
+type StenoTranslator = bbq_keyboard::dict::Dict;
+#[cfg(feature = "core1")]
+type StenoTranslator = core1::Translator;
+
 #[rtic::app(
     device = crate::bsp::pac,
     dispatchers = [SW0_IRQ, SW1_IRQ],
@@ -52,17 +61,19 @@ mod app {
     use crate::bsp;
     use crate::inter;
     use crate::leds;
-    use crate::matrix::Matrix;
+    use crate::matrix::{self, Matrix};
+    use crate::scanner::{self, Scanner};
+    use crate::stats::{self, Mark, Stage};
     use crate::usb;
     use crate::MatrixType;
+    use crate::StenoTranslator;
     use crate::HEAP;
     use crate::HEAP_MEM;
     use crate::HEAP_SIZE;
     use arrayvec::ArrayString;
     use bbq_keyboard::Mods;
-    use bbq_keyboard::layout::LayoutManager;
+    use bbq_keyboard::layout::{Held, LayoutManager};
     use bbq_keyboard::usb_typer::enqueue_action;
-    use bbq_keyboard::dict::Dict;
     use bbq_keyboard::Event;
     use bbq_keyboard::EventQueue;
     use bbq_keyboard::InterState;
@@ -71,15 +82,16 @@ mod app {
     use bbq_keyboard::MinorMode;
     use bbq_keyboard::Side;
     use bbq_keyboard::Timable;
+    use bbq_steno::dict::TypeAction;
     use bbq_steno::Stroke;
     use bsp::hal::clocks::init_clocks_and_plls;
+    use bsp::hal::dma::DMAExt;
     use bsp::hal::gpio::bank0::Gpio8;
     use bsp::hal::gpio::bank0::Gpio9;
     use bsp::hal::gpio::DynPinId;
     use bsp::hal::gpio::FunctionPio0;
     use bsp::hal::gpio::FunctionUart;
     use bsp::hal::gpio::Pin;
-    use bsp::hal::gpio::PinState;
     use bsp::hal::gpio::PullDown;
     use bsp::hal::pac::PIO0;
     use bsp::hal::pac::UART1;
@@ -112,6 +124,10 @@ mod app {
     pub const EVENT_CAPACITY: usize = 200;
     pub const STENO_CAPACITY: usize = 8;
 
+    /// How many scans the matrix must be settled for, before it stops
+    /// scanning and waits for a key to be pressed.  This is 100ms.
+    const IDLE_TICKS: usize = (100_000 / matrix::SCAN_US) as usize;
+
     type UartPinout = (
         Pin<Gpio8, FunctionUart, PullDown>,
         Pin<Gpio9, FunctionUart, PullDown>,
@@ -133,11 +149,16 @@ mod app {
         inter_event: Sender<'static, Event, EVENT_CAPACITY>,
         event_event: Sender<'static, Event, EVENT_CAPACITY>,
         periodic_event: Sender<'static, Event, EVENT_CAPACITY>,
-        dict: Dict,
+        matrix_event: Sender<'static, Event, EVENT_CAPACITY>,
+        matrix_wake: Sender<'static, (), 1>,
+        fifo_wake: Sender<'static, (), 1>,
+        translator: StenoTranslator,
     }
 
     #[init(local=[
-        usb_bus: MaybeUninit<UsbBusAllocator<UsbBus>> = MaybeUninit::uninit()
+        usb_bus: MaybeUninit<UsbBusAllocator<UsbBus>> = MaybeUninit::uninit(),
+        scan_patterns: scanner::Patterns<{ crate::board::NCOLS }> = scanner::patterns(),
+        scan_samples: [u32; crate::board::NCOLS] = [0; crate::board::NCOLS],
     ])]
     fn init(mut ctx: init::Context) -> (Shared, Local) {
         // When using the picoprobe, it only resets the core and not any
@@ -194,21 +215,32 @@ mod app {
             Side::Left
         };
 
-        let (mut pio, sm0, _, _, _) = ctx.device.PIO0.split(&mut ctx.device.RESETS);
+        let (mut pio, sm0, sm1, _, _) = ctx.device.PIO0.split(&mut ctx.device.RESETS);
+        let dma = ctx.device.DMA.split(&mut ctx.device.RESETS);
         let ws = Ws2812Direct::new(
             pins.led.into_function().into_dyn_pin(),
             &mut pio,
             sm0,
             clocks.peripheral_clock.freq(),
         );
-        let led_manager = leds::LedManager::new(ws);
+        let (led_wake, led_receive) = make_channel!((), 1);
+        let led_manager = leds::LedManager::new(ws, led_wake);
 
         // Build handler for the matrix handler.
         let matrix = {
             let cols = crate::board::cols!(pins);
             let rows = crate::board::rows!(pins);
+            let scanner = Scanner::new(
+                &mut pio,
+                sm1,
+                cols,
+                (dma.ch0, dma.ch1),
+                ctx.local.scan_patterns,
+                ctx.local.scan_samples,
+                clocks.system_clock.freq().to_MHz(),
+            );
             // TODO: Calculate side.
-            Matrix::new(cols, rows, side)
+            Matrix::new(scanner, rows, side)
         };
 
         let uart_pins = (
@@ -218,10 +250,11 @@ mod app {
         let uart =
             hal::uart::UartPeripheral::new(ctx.device.UART1, uart_pins, &mut ctx.device.RESETS)
                 .enable(
-                    // Ideally, being above 320k will allow full frames to be sent
-                    // each tick. This number is chosen to be an exact divisor of
-                    // the clock rate.
-                    UartConfig::new(390625.Hz(), DataBits::Eight, None, StopBits::One),
+                    // Packets are sent as soon as there are keys, so the
+                    // rate sets how long one takes on the wire, about 180us
+                    // for a full one.  This number is chosen to be an exact
+                    // divisor of the clock rate.
+                    UartConfig::new(1_562_500.Hz(), DataBits::Eight, None, StopBits::One),
                     clocks.peripheral_clock.freq(),
                 )
                 .unwrap();
@@ -230,7 +263,19 @@ mod app {
 
         let layout_manager = LayoutManager::new();
 
-        let dict = Dict::new();
+        let (fifo_wake, fifo_receive) = make_channel!((), 1);
+        #[cfg(not(feature = "core1"))]
+        let translator = {
+            drop(fifo_receive);
+            StenoTranslator::new()
+        };
+        #[cfg(feature = "core1")]
+        let translator = StenoTranslator::start(
+            &mut ctx.device.PSM,
+            &mut ctx.device.PPB,
+            sio.fifo,
+            fifo_receive,
+        );
 
         let usb_bus: &'static _ =
             ctx.local
@@ -246,15 +291,19 @@ mod app {
 
         let (event_send, event_receive) = make_channel!(Event, EVENT_CAPACITY);
         let (steno_send, steno_receive) = make_channel!(Stroke, STENO_CAPACITY);
+        let (matrix_wake, wake_receive) = make_channel!((), 1);
 
         let usb_event = event_send.clone();
         let inter_event = event_send.clone();
         let event_event = event_send.clone();
         let periodic_event = event_send.clone();
+        let matrix_event = event_send.clone();
 
-        periodic_task::spawn().unwrap();
+        periodic_task::spawn(steno_send.clone()).unwrap();
+        matrix_task::spawn(wake_receive, steno_send.clone()).unwrap();
         event_task::spawn(event_receive, steno_send).unwrap();
         steno_task::spawn(steno_receive).unwrap();
+        led_task::spawn(led_receive).unwrap();
 
         // let _timer = Timer::new(ctx.device.TIMER, &mut ctx.device.RESETS, &clocks);
 
@@ -271,7 +320,10 @@ mod app {
                 inter_event,
                 event_event,
                 periodic_event,
-                dict,
+                matrix_event,
+                matrix_wake,
+                fifo_wake,
+                translator,
             },
         )
     }
@@ -300,6 +352,23 @@ mod app {
         });
     }
 
+    // A row edge while the matrix is idle.  Mask the interrupt, as the edge
+    // stays latched until matrix_task clears it.
+    #[task(binds = IO_IRQ_BANK0, local = [matrix_wake], priority = 3)]
+    fn io_irq(cx: io_irq::Context) {
+        cortex_m::peripheral::NVIC::mask(bsp::pac::Interrupt::IO_IRQ_BANK0);
+        let _ = cx.local.matrix_wake.try_send(());
+    }
+
+    // An answer from core 1.  Only core 1 writes to our FIFO, so this never
+    // fires without the `core1` feature.  The interrupt is level triggered,
+    // so mask it until steno_task has read the FIFO.
+    #[task(binds = SIO_IRQ_PROC0, local = [fifo_wake], priority = 3)]
+    fn sio_irq(cx: sio_irq::Context) {
+        cortex_m::peripheral::NVIC::mask(bsp::pac::Interrupt::SIO_IRQ_PROC0);
+        let _ = cx.local.fifo_wake.try_send(());
+    }
+
     /// Macro to assist with locking.
     macro_rules! lock {
         // Match the simple case.  Doesn't work.
@@ -315,11 +384,14 @@ mod app {
 
     /// The periodic task. This calls 'tick' on various manager subsystems, once
     /// every ms.
-    #[task(shared = [usb_handler, inter_handler, layout_manager, led_manager],
-           local = [periodic_event, matrix],
+    #[task(shared = [usb_handler, inter_handler, layout_manager],
+           local = [periodic_event],
            priority = 2
     )]
-    async fn periodic_task(mut ctx: periodic_task::Context) {
+    async fn periodic_task(
+        mut ctx: periodic_task::Context,
+        mut steno: Sender<'static, Stroke, STENO_CAPACITY>,
+    ) {
         let mut next = Timer::now();
         loop {
             next += 1.millis();
@@ -327,13 +399,115 @@ mod app {
 
             lock!(ctx, usb_handler, usb_handler.tick());
             lock!(ctx, inter_handler, inter_handler.tick());
+            let mut held = None;
             lock!(ctx, layout_manager, {
-                layout_manager.tick(&mut EventWrapper(ctx.local.periodic_event));
-            });
-            lock!(ctx, led_manager, {
-                led_manager.tick(ctx.local.periodic_event);
+                held = layout_manager.tick(&mut EventWrapper(ctx.local.periodic_event));
             });
-            ctx.local.matrix.tick(ctx.local.periodic_event).await;
+            if let Some(held) = held {
+                send_held(held, &mut steno, ctx.local.periodic_event).await;
+            }
+        }
+    }
+
+    /// The LED task.  This runs the indications, sleeping until the current
+    /// step is over, or the LED manager wakes it with a new indication.  LED
+    /// changes are passed directly to the other side.
+    #[task(shared = [led_manager, inter_handler], priority = 1)]
+    async fn led_task(mut ctx: led_task::Context, mut wake: Receiver<'static, (), 1>) {
+        loop {
+            let (deadline, changed) =
+                ctx.shared.led_manager.lock(|led_manager| led_manager.update(Timer::now()));
+            if let Some(rgb) = changed {
+                lock!(ctx, inter_handler, inter_handler.set_other_led(rgb));
+            }
+            match deadline {
+                Some(deadline) => {
+                    let _ = Timer::timeout_at(deadline, wake.recv()).await;
+                }
+                None => {
+                    let _ = wake.recv().await;
+                }
+            }
+        }
+    }
+
+    /// The matrix scanner.  This scans every SCAN_US while keys are in use.
+    /// Once all keys have been released for a while, it stops scanning, and
+    /// waits for a row interrupt to indicate a key has been pressed.
+    ///
+    /// The key changes go directly to the layout manager, or to the other side
+    /// when we are secondary.  In steno mode, the stroke then goes straight to
+    /// the translator.
+    #[task(shared = [layout_manager, inter_handler, usb_handler],
+           local = [matrix_event, matrix],
+           priority = 2)]
+    async fn matrix_task(
+        mut ctx: matrix_task::Context,
+        mut wake: Receiver<'static, (), 1>,
+        mut steno: Sender<'static, Stroke, STENO_CAPACITY>,
+    ) {
+        let mut next = Timer::now();
+        let mut settled = 0;
+        loop {
+            next += matrix::SCAN_US.micros();
+            Timer::delay_until(next).await;
+
+            if let Some(keys) = ctx.local.matrix.tick() {
+                let state = ctx.shared.inter_handler.lock(|inter| inter.state());
+                let mut stroke = None;
+                match state {
+                    InterState::Primary | InterState::Idle => {
+                        lock!(ctx, layout_manager, {
+                            stroke = layout_manager.handle_batch(
+                                keys,
+                                &mut EventWrapper(ctx.local.matrix_event),
+                            );
+                        });
+                    }
+                    InterState::Secondary => {
+                        lock!(ctx, inter_handler, inter_handler.add_keys(keys));
+                    }
+                }
+
+                if keys.pressed != 0 {
+                    // This is specific to our implementation.
+                    // TODO: Only do this if remote wakeup enabled.
+                    lock!(ctx, usb_handler, {
+                        if usb_handler.is_suspended() {
+                            usb_handler.wakeup();
+                        }
+                    });
+                }
+
+                // Wait for room, rather than dropping the stroke.  The matrix
+                // holds its state, so nothing is lost while blocked.
+                if let Some(stroke) = stroke {
+                    if steno.send(stroke).await.is_err() {
+                        warn!("Steno task is gone");
+                    }
+                }
+            }
+
+            if !ctx.local.matrix.settled() {
+                settled = 0;
+                continue;
+            }
+            settled += 1;
+            if settled < IDLE_TICKS {
+                continue;
+            }
+
+            // Discard any stale wakeup before arming.
+            let _ = wake.try_recv();
+            if ctx.local.matrix.idle().await {
+                unsafe {
+                    cortex_m::peripheral::NVIC::unmask(bsp::pac::Interrupt::IO_IRQ_BANK0);
+                }
+                let _ = wake.recv().await;
+                ctx.local.matrix.wake();
+            }
+            settled = 0;
+            next = Timer::now();
         }
     }
 
@@ -350,39 +524,18 @@ mod app {
         let mut last_size = 0;
         let mut state = InterState::Idle;
         let mut flashing = true;
-        let mut usb_suspended = true;
         let mut current_mode = LayoutMode::Steno;
         while let Ok(event) = recv.recv().await {
+            let start = stats::start();
+            // A stroke for the translator.  This is sent once the event is
+            // handled, so waiting for room isn't counted in the event time.
+            let mut stroke = None;
             match event {
-                Event::Matrix(key) => {
-                    match state {
-                        InterState::Primary | InterState::Idle => {
-                            lock!(ctx, layout_manager, {
-                                layout_manager.handle_event(
-                                    key,
-                                    &mut EventWrapper(ctx.local.event_event),
-                                );
-                            });
-                        }
-                        InterState::Secondary => {
-                            lock!(ctx, inter_handler, {
-                                inter_handler.add_key(key);
-                            });
-                        }
-                    }
-                    if usb_suspended {
-                        // This is specific to our implementation.
-                        // TODO: Only do this if remote wakeup enabled.
-                        lock!(ctx, usb_handler, {
-                            usb_handler.wakeup();
-                        });
-                    }
-                }
-                Event::InterKey(key) => {
+                Event::InterKey(keys) => {
                     if state == InterState::Primary {
                         lock!(ctx, layout_manager, {
-                            layout_manager.handle_event(
-                                key,
+                            stroke = layout_manager.handle_batch(
+                                keys,
                                 &mut EventWrapper(ctx.local.event_event),
                             );
                         });
@@ -417,7 +570,6 @@ mod app {
                     lock!(ctx, inter_handler, {
                         inter_handler.set_state(InterState::Primary, ctx.local.event_event);
                     });
-                    usb_suspended = false;
                 }
                 Event::UsbState(UsbDeviceState::Suspend) => {
                     // This indicates the host has gone to sleep.
@@ -427,7 +579,6 @@ mod app {
                         led_manager.set_global(&leds::SLEEP_INDICATOR)
                     );
                     // flashing = true;
-                    usb_suspended = true;
                 }
                 Event::UsbState(_) => (),
                 Event::BecomeState(new_state) => {
@@ -492,9 +643,6 @@ mod app {
                 Event::RecvLed(rgb) => {
                     lock!(ctx, led_manager, led_manager.set_other_side(rgb));
                 }
-                Event::SendLed(rgb) => {
-                    lock!(ctx, inter_handler, inter_handler.set_other_led(rgb));
-                }
             }
 
             // Heap debugging is useful.
@@ -503,12 +651,20 @@ mod app {
                 let free = HEAP.free();
                 info!("Heap: {} used, {} free", new_used, free);
                 last_size = new_used;
+                stats::mark(Mark::Heap, new_used);
+            }
+            start.end(Stage::Event);
+
+            if let Some(stroke) = stroke {
+                if steno.send(stroke).await.is_err() {
+                    warn!("Steno task is gone");
+                }
             }
         }
     }
 
     #[task(
-        local = [dict],
+        local = [translator],
         shared = [usb_handler],
         priority = 1,
     )]
@@ -516,24 +672,96 @@ mod app {
         mut ctx: steno_task::Context,
         mut steno: Receiver<'static, Stroke, STENO_CAPACITY>
     ) {
+        #[cfg(not(feature = "core1"))]
         while let Ok(stroke) = steno.recv().await {
-            for action in ctx.local.dict.handle_stroke(stroke, &WrapTimer) {
-                info!("type action: {} del, {} add", action.remove, action.text.len());
-
-                lock!(ctx, usb_handler, {
-                    // Press backspace for each remove.
-                    for _ in 0..action.remove {
-                        usb_handler.enqueue([
-                            KeyAction::KeyPress(Keyboard::DeleteBackspace, Mods::empty()),
-                            KeyAction::KeyRelease,
-                        ].iter().cloned());
+            if stats::ENABLED && stroke == stats::DUMP_STROKE {
+                stats::dump();
+                continue;
+            }
+            let start = stats::start();
+            let actions = ctx.local.translator.handle_stroke(stroke, &WrapTimer);
+            start.end(Stage::Lookup);
+            for action in actions {
+                lock!(ctx, usb_handler, type_action(usb_handler, &action));
+            }
+        }
+
+        // When translating on core 1, wait for its answers to wake us.  The
+        // next stroke is held back if core 1 has no room for it.
+        #[cfg(feature = "core1")]
+        {
+            let translator = ctx.local.translator;
+            let mut waiting = None;
+            loop {
+                if waiting.is_none() && !translator.is_busy() {
+                    match steno.recv().await {
+                        Ok(stroke) if stats::ENABLED && stroke == stats::DUMP_STROKE => {
+                            stats::dump();
+                            continue;
+                        }
+                        Ok(stroke) => waiting = Some(stroke),
+                        Err(_) => break,
                     }
-                    enqueue_action(usb_handler, &action.text);
+                }
+
+                while let Some(stroke) = waiting.take().or_else(|| steno.try_recv().ok()) {
+                    if !translator.send(stroke) {
+                        waiting = Some(stroke);
+                        break;
+                    }
+                }
+
+                translator.recv(|action| {
+                    lock!(ctx, usb_handler, type_action(usb_handler, &action));
                 });
+
+                if translator.is_busy() {
+                    translator.wait().await;
+                }
             }
         }
     }
 
+    /// Send a held steno stroke on the same path as the other strokes.  The
+    /// first send of a held stroke is the only one, as releasing it won't send
+    /// it again, so wait for room, as matrix_task does.  The repeats aren't
+    /// worth holding up the tick for, as another will come along.
+    async fn send_held(
+        held: Held,
+        steno: &mut Sender<'static, Stroke, STENO_CAPACITY>,
+        events: &mut Sender<'static, Event, EVENT_CAPACITY>,
+    ) {
+        if held.raw {
+            let event = Event::RawSteno(held.stroke);
+            if held.repeat {
+                EventWrapper(events).push(event);
+            } else if events.send(event).await.is_err() {
+                warn!("Event task is gone");
+            }
+        } else if held.repeat {
+            if steno.try_send(held.stroke).is_err() {
+                warn!("Steno queue full, dropping repeat");
+            }
+        } else if steno.send(held.stroke).await.is_err() {
+            warn!("Steno task is gone");
+        }
+    }
+
+    /// Send a translated action to the host.
+    fn type_action(usb_handler: &mut usb::UsbHandler<'static, UsbBus>, action: &TypeAction) {
+        info!("type action: {} del, {} add", action.remove, action.len());
+
+        // Press backspace for each remove.
+        for _ in 0..action.remove {
+            usb_handler.enqueue([
+                KeyAction::KeyPress(Keyboard::DeleteBackspace, Mods::empty()),
+                KeyAction::KeyRelease,
+            ].iter().cloned());
+        }
+        enqueue_action(usb_handler, &action.prefix);
+        enqueue_action(usb_handler, action.text);
+    }
+
     /// Wrap the event queue in a way so that the bbq-keyboard package doesn't need
     /// to know how it is implemented.
     struct EventWrapper<'a>(&'a mut Sender<'static, Event, EVENT_CAPACITY>);
@@ -542,12 +770,13 @@ mod app {
         fn push(&mut self, event: Event) {
             if self.0.try_send(event).is_err() {
                 warn!("Unable to queue event");
+                stats::count(Mark::EventDropped);
             }
         }
     }
 
     /// Placeholder for the timer, until we implement a real one.
-    struct WrapTimer;
+    pub struct WrapTimer;
 
     impl Timable for WrapTimer {
         fn get_ticks(&self) -> u64 {
@@ -2,43 +2,48 @@
 
 use core::fmt::Debug;
 
-use defmt::warn;
-use embedded_hal::digital::v2::{InputPin, OutputPin};
+use embedded_hal::digital::v2::InputPin;
 
-use bbq_keyboard::{Event, KeyEvent, Side};
+use bbq_keyboard::{KeyBatch, Side};
+use crate::bsp::hal::gpio::{Function, Interrupt, Pin, PinId, PullType};
+use crate::scanner::Scanner;
+use crate::stats::{self, Stage};
 // use rtic_monotonics::Monotonic;
 use rtic_monotonics::rp2040::ExtU64;
 use rtic_monotonics::rp2040::Timer;
-use rtic_sync::channel::Sender;
 
 pub struct Matrix<
     E,
-    I: InputPin<Error = E>,
-    O: OutputPin<Error = E>,
+    I: InputPin<Error = E> + WakePin,
     const NCOLS: usize,
     const NROWS: usize,
     const NKEYS: usize,
 > {
-    cols: [O; NCOLS],
+    scanner: Scanner<NCOLS>,
     rows: [I; NROWS],
-    keys: [Debouncer; NKEYS],
+    /// The GPIO number of each row, which is its bit in the scanner samples.
+    row_pins: [u8; NROWS],
+    keys: Debouncer,
     side: Side,
 }
 
 impl<
         E: Debug,
-        I: InputPin<Error = E>,
-        O: OutputPin<Error = E>,
+        I: InputPin<Error = E> + WakePin,
         const NCOLS: usize,
         const NROWS: usize,
         const NKEYS: usize,
-    > Matrix<E, I, O, NCOLS, NROWS, NKEYS>
+    > Matrix<E, I, NCOLS, NROWS, NKEYS>
 {
-    pub fn new(cols: [O; NCOLS], rows: [I; NROWS], side: Side) -> Self {
-        let keys = [Debouncer::new(); NKEYS];
+    pub fn new(scanner: Scanner<NCOLS>, rows: [I; NROWS], side: Side) -> Self {
+        // Both sides share the batch masks.
+        assert!(2 * NKEYS <= 64);
+        let keys = Debouncer::new();
+        let row_pins = core::array::from_fn(|row| rows[row].gpio());
         Matrix {
-            cols,
+            scanner,
             rows,
+            row_pins,
             keys,
             side,
         }
@@ -47,131 +52,164 @@ impl<
     // pub fn poll(&mut self) {
     // }
 
-    pub(crate) async fn tick<'a>(
-        &mut self,
-        events: &mut Sender<'a, Event, { crate::app::EVENT_CAPACITY }>,
-    ) {
-        for col in 0..self.cols.len() {
-            self.cols[col].set_high().unwrap();
-            for row in 0..self.rows.len() {
-                let key = col * NROWS + row;
-                let action = self.keys[key].react(self.rows[row].is_high().unwrap());
-
-                let bias = if self.side.is_left() { 0 } else { NKEYS };
-                let act = match action {
-                    KeyAction::Press => {
-                        // info!("press: {}", key);
-                        Some(KeyEvent::Press((key + bias) as u8))
-                    }
-                    KeyAction::Release => {
-                        // info!("release: {}", key);
-                        Some(KeyEvent::Release((key + bias) as u8))
-                    }
-                    _ => None,
-                };
-                if let Some(act) = act {
-                    if events.send(Event::Matrix(act)).await.is_err() {
-                        warn!("Unable to send key event");
-                    }
+    /// Are all of the keys released, with none of them in the middle of
+    /// debouncing?  When this is the case, there is no need to keep scanning
+    /// until a key is pressed.
+    pub fn settled(&self) -> bool {
+        self.keys.settled()
+    }
+
+    /// Go into idle mode.  All of the columns are driven, so that pressing any
+    /// key will raise its row, and the rows are set to interrupt on that edge.
+    /// Returns false, without going idle, if a row is already high.
+    pub(crate) async fn idle(&mut self) -> bool {
+        self.scanner.drive_all();
+        Timer::delay(5.micros()).await;
+
+        for row in self.rows.iter_mut() {
+            row.clear_wake();
+            row.set_wake(true);
+        }
+
+        // A press that came in before the interrupts were enabled won't have
+        // an edge.
+        if self.rows.iter().any(|row| row.is_high().unwrap()) {
+            self.wake();
+            return false;
+        }
+        true
+    }
+
+    /// Leave idle mode, returning to regular scanning.
+    pub fn wake(&mut self) {
+        for row in self.rows.iter_mut() {
+            row.set_wake(false);
+            row.clear_wake();
+        }
+        self.scanner.release_all();
+    }
+
+    /// Scan the matrix, returning the keys that changed since the last scan.
+    pub fn tick(&mut self) -> Option<KeyBatch> {
+        let start = stats::start();
+        let batch = self.scan_batch();
+        start.end(Stage::Scan);
+        batch
+    }
+
+    fn scan_batch(&mut self) -> Option<KeyBatch> {
+        let samples = self.scanner.scan()?;
+        let levels = self.pack(&samples);
+
+        let changed = self.keys.react(levels);
+        if changed == 0 {
+            return None;
+        }
+
+        let bias = if self.side.is_left() { 0 } else { NKEYS };
+        Some(KeyBatch {
+            pressed: (changed & self.keys.state) << bias,
+            released: (changed & !self.keys.state) << bias,
+        })
+    }
+
+    /// Pack the per-column samples into a bitmap with a bit per key.
+    fn pack(&self, samples: &[u32; NCOLS]) -> u64 {
+        let mut levels = 0;
+        for (col, sample) in samples.iter().enumerate() {
+            for (row, pin) in self.row_pins.iter().enumerate() {
+                if sample & (1 << pin) != 0 {
+                    levels |= 1 << (col * NROWS + row);
                 }
             }
-            self.cols[col].set_low().unwrap();
-            Timer::delay(5.micros()).await;
         }
+        levels
     }
 }
 
-/// Individual state tracking.
-#[derive(Clone, Copy, Eq, PartialEq)]
-enum KeyState {
-    /// Key is in released state.
-    Released,
-    /// Key is in pressed state.
-    Pressed,
-    /// We've seen a release edge, and will consider it released when consistent.
-    DebounceRelease,
-    /// We've seen a press edge, and will consider it pressed when consistent.
-    DebouncePress,
+/// Row pins that can wake the matrix from idle.
+pub trait WakePin {
+    /// Enable or disable the rising edge interrupt.
+    fn set_wake(&mut self, enabled: bool);
+    /// Clear a latched edge.
+    fn clear_wake(&mut self);
+    /// The GPIO number of this pin.
+    fn gpio(&self) -> u8;
 }
 
-#[derive(Clone, Copy)]
-enum KeyAction {
-    None,
-    Press,
-    Release,
+impl<I: PinId, F: Function, P: PullType> WakePin for Pin<I, F, P> {
+    fn set_wake(&mut self, enabled: bool) {
+        self.set_interrupt_enabled(Interrupt::EdgeHigh, enabled);
+    }
+
+    fn clear_wake(&mut self) {
+        self.clear_interrupt(Interrupt::EdgeHigh);
+    }
+
+    fn gpio(&self) -> u8 {
+        self.id().num
+    }
 }
 
-// Don't really want Copy, but needed for init.
-#[derive(Clone, Copy)]
+/// Time between scans of the matrix, in us.  The PIO scanner makes scans
+/// cheap, so they can be done more often than once per ms.
+pub const SCAN_US: u64 = 250;
+
+/// Number of consistent scans for a key to change state.
+const DEBOUNCE_COUNT: u32 = (crate::board::DEBOUNCE_US / SCAN_US) as u32;
+
+/// Number of bits needed for the debounce counters.
+const PLANES: usize = (u32::BITS - DEBOUNCE_COUNT.leading_zeros()) as usize;
+
+/// Debounce all of the keys at once, using vertical counters.  Each key counts
+/// how many consecutive scans have disagreed with its debounced state, and
+/// changes state when the count reaches DEBOUNCE_COUNT.  The counters are
+/// stored a bit at a time: plane `i` holds bit `i` of every key's counter, so
+/// a single scan is a handful of operations on the whole matrix.
 struct Debouncer {
-    /// State for this key.
-    state: KeyState,
-    /// Count how many times we've seen a given debounce state.
-    counter: usize,
+    /// The debounced state, with a bit set for each pressed key.
+    state: u64,
+    planes: [u64; PLANES],
 }
 
-const DEBOUNCE_COUNT: usize = 20;
-
 impl Debouncer {
     fn new() -> Debouncer {
         Debouncer {
-            state: KeyState::Released,
-            counter: 0,
+            state: 0,
+            planes: [0; PLANES],
         }
     }
 
-    fn react(&mut self, pressed: bool) -> KeyAction {
-        match self.state {
-            KeyState::Released => {
-                if pressed {
-                    self.state = KeyState::DebouncePress;
-                    self.counter = 0;
-                }
-                KeyAction::None
-            }
-            KeyState::Pressed => {
-                if !pressed {
-                    self.state = KeyState::DebounceRelease;
-                    self.counter = 0;
-                }
-                KeyAction::None
-            }
-            KeyState::DebounceRelease => {
-                if pressed {
-                    // Reset the counter any time we see a press state.
-                    self.counter = 0;
-                    KeyAction::None
-                } else {
-                    self.counter += 1;
-                    if self.counter == DEBOUNCE_COUNT {
-                        self.state = KeyState::Released;
-                        KeyAction::Release
-                    } else {
-                        KeyAction::None
-                    }
-                }
-            }
-            // TODO: We could probably just do two states, and a press/released flag.
-            KeyState::DebouncePress => {
-                if !pressed {
-                    // Reset the counter any time we see a released state.
-                    self.counter = 0;
-                    KeyAction::None
-                } else {
-                    self.counter += 1;
-                    if self.counter == DEBOUNCE_COUNT {
-                        self.state = KeyState::Pressed;
-                        KeyAction::Press
-                    } else {
-                        KeyAction::None
-                    }
-                }
+    /// Feed in the levels from a scan, returning the keys that changed state.
+    fn react(&mut self, levels: u64) -> u64 {
+        let differ = levels ^ self.state;
+
+        // Count up the keys that differ, and reset the rest.
+        let mut carry = differ;
+        for plane in self.planes.iter_mut() {
+            let next = *plane & carry;
+            *plane = (*plane ^ carry) & differ;
+            carry = next;
+        }
+
+        let mut changed = differ;
+        for (bit, plane) in self.planes.iter().enumerate() {
+            if DEBOUNCE_COUNT & (1 << bit) != 0 {
+                changed &= *plane;
+            } else {
+                changed &= !*plane;
             }
         }
+
+        for plane in self.planes.iter_mut() {
+            *plane &= !changed;
+        }
+        self.state ^= changed;
+        changed
     }
 
-    #[allow(dead_code)]
-    fn is_pressed(&self) -> bool {
-        self.state == KeyState::Pressed || self.state == KeyState::DebounceRelease
+    /// All keys released, and none of them debouncing.
+    fn settled(&self) -> bool {
+        self.state == 0 && self.planes.iter().all(|&plane| plane == 0)
     }
 }
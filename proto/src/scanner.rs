@@ -0,0 +1,181 @@
+//! PIO based matrix scanning.
+//!
+//! A PIO state machine walks the columns, driving each in turn, and samples
+//! the GPIO inputs while it is driven.  DMA feeds the column patterns to the
+//! state machine, and collects the samples, so a full scan takes no CPU time
+//! beyond starting the two transfers, and picking up the result.
+//!
+//! The columns must be on consecutive GPIOs.  The rows can be anywhere, as the
+//! samples contain every GPIO.
+
+use core::mem;
+
+use crate::bsp::hal;
+use hal::dma::{single_buffer, Channel, CH0, CH1};
+use hal::gpio::{DynPinId, FunctionPio0, Pin, PullDown};
+use hal::pac::PIO0;
+use hal::pio::{
+    PIOBuilder, PinDir, Running, Rx, ShiftDirection, StateMachine, Tx, UninitStateMachine, PIO,
+    SM1,
+};
+use pio::{Instruction, InstructionOperands, MovDestination, MovOperation, MovSource};
+
+pub type ColPin = Pin<DynPinId, FunctionPio0, PullDown>;
+
+type ScanSM = (PIO0, SM1);
+
+/// The column patterns, one per column.
+pub type Patterns<const NCOLS: usize> = [u32; NCOLS];
+
+/// Build the column patterns.  These are placed in a buffer that lives as long
+/// as the scanner.
+pub const fn patterns<const NCOLS: usize>() -> Patterns<NCOLS> {
+    let mut result = [0; NCOLS];
+    let mut col = 0;
+    while col < NCOLS {
+        result[col] = 1 << col;
+        col += 1;
+    }
+    result
+}
+
+pub struct Scanner<const NCOLS: usize> {
+    sm: StateMachine<ScanSM, Running>,
+    _cols: [ColPin; NCOLS],
+    dma: Dma<NCOLS>,
+}
+
+/// The DMA transfers move between being ready, and running.
+enum Dma<const NCOLS: usize> {
+    Ready {
+        tx_ch: Channel<CH0>,
+        rx_ch: Channel<CH1>,
+        tx: Tx<ScanSM>,
+        rx: Rx<ScanSM>,
+        patterns: &'static Patterns<NCOLS>,
+        samples: &'static mut [u32; NCOLS],
+    },
+    Running {
+        tx: single_buffer::Transfer<Channel<CH0>, &'static Patterns<NCOLS>, Tx<ScanSM>>,
+        rx: single_buffer::Transfer<Channel<CH1>, Rx<ScanSM>, &'static mut [u32; NCOLS]>,
+    },
+    Moving,
+}
+
+impl<const NCOLS: usize> Scanner<NCOLS> {
+    pub fn new(
+        pio: &mut PIO<PIO0>,
+        sm: UninitStateMachine<ScanSM>,
+        cols: [ColPin; NCOLS],
+        channels: (Channel<CH0>, Channel<CH1>),
+        patterns: &'static Patterns<NCOLS>,
+        samples: &'static mut [u32; NCOLS],
+        sys_mhz: u32,
+    ) -> Self {
+        let base = cols[0].id().num;
+        for (i, col) in cols.iter().enumerate() {
+            assert!(col.id().num as usize == base as usize + i);
+        }
+
+        // With the state machine clocked at 1 MHz, each column is driven for
+        // 2us before the rows are sampled, and then released for 5us before
+        // the next.
+        let program = pio_proc::pio_asm!(
+            ".wrap_target",
+            "    pull block",
+            "    out pins, 32 [1]",
+            "    in pins, 32",
+            "    push block",
+            "    mov pins, null [4]",
+            ".wrap",
+        );
+        let installed = pio.install(&program.program).unwrap();
+        let (mut sm, rx, tx) = PIOBuilder::from_program(installed)
+            .out_pins(base, NCOLS as u8)
+            .in_pin_base(0)
+            .in_shift_direction(ShiftDirection::Left)
+            .autopull(false)
+            .autopush(false)
+            .clock_divisor_fixed_point(sys_mhz as u16, 0)
+            .build(sm);
+        sm.set_pindirs(cols.iter().map(|col| (col.id().num, PinDir::Output)));
+        let sm = sm.start();
+
+        let (tx_ch, rx_ch) = channels;
+        Scanner {
+            sm,
+            _cols: cols,
+            dma: Dma::Ready { tx_ch, rx_ch, tx, rx, patterns, samples },
+        }
+    }
+
+    /// Retrieve the samples from the last scan, and start another one.  The
+    /// scan only takes tens of us, so the previous scan will have finished
+    /// by the time this is called again.  Returns None on the first call, or
+    /// if the previous scan is somehow still running.
+    pub fn scan(&mut self) -> Option<[u32; NCOLS]> {
+        if let Dma::Running { tx, rx } = &self.dma {
+            if !tx.is_done() || !rx.is_done() {
+                return None;
+            }
+        }
+
+        let (result, tx_ch, rx_ch, tx, rx, patterns, samples) = match self.take() {
+            Dma::Ready { tx_ch, rx_ch, tx, rx, patterns, samples } => {
+                (None, tx_ch, rx_ch, tx, rx, patterns, samples)
+            }
+            Dma::Running { tx, rx } => {
+                let (tx_ch, patterns, tx) = tx.wait();
+                let (rx_ch, rx, samples) = rx.wait();
+                (Some(*samples), tx_ch, rx_ch, tx, rx, patterns, samples)
+            }
+            Dma::Moving => unreachable!(),
+        };
+
+        // Start the receiver first, so it is ready for the first sample.
+        let rx = single_buffer::Config::new(rx_ch, rx, samples).start();
+        let tx = single_buffer::Config::new(tx_ch, patterns, tx).start();
+        self.dma = Dma::Running { tx, rx };
+        result
+    }
+
+    /// Wait for any scan in progress, and leave the DMA ready.
+    fn stop(&mut self) {
+        self.dma = match self.take() {
+            Dma::Running { tx, rx } => {
+                let (tx_ch, patterns, tx) = tx.wait();
+                let (rx_ch, rx, samples) = rx.wait();
+                Dma::Ready { tx_ch, rx_ch, tx, rx, patterns, samples }
+            }
+            dma => dma,
+        };
+    }
+
+    fn take(&mut self) -> Dma<NCOLS> {
+        mem::replace(&mut self.dma, Dma::Moving)
+    }
+
+    /// Drive all of the columns, for idle mode.  The state machine is waiting
+    /// for a pattern, so the move is executed directly.
+    pub fn drive_all(&mut self) {
+        self.stop();
+        self.exec_mov(MovOperation::Invert);
+    }
+
+    /// Release all of the columns, to resume scanning.
+    pub fn release_all(&mut self) {
+        self.exec_mov(MovOperation::None);
+    }
+
+    fn exec_mov(&mut self, op: MovOperation) {
+        self.sm.exec_instruction(Instruction {
+            operands: InstructionOperands::MOV {
+                destination: MovDestination::PINS,
+                op,
+                source: MovSource::NULL,
+            },
+            delay: 0,
+            side_set: None,
+        });
+    }
+}
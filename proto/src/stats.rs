@@ -0,0 +1,191 @@
+//! Latency instrumentation.
+//!
+//! With the `stats` feature, the time taken by each stage between a key press
+//! and the HID report is collected into a histogram, along with high-water
+//! marks for the queues and the heap.  Pressing every steno key at once dumps
+//! them through defmt.  Without the feature, all of this compiles away.
+//!
+//! The times come from the 1MHz system timer.  The Cortex-M0+ has no DWT cycle
+//! counter, and none of the stages take less than a few us.
+
+#[cfg(feature = "stats")]
+pub use enabled::*;
+#[cfg(not(feature = "stats"))]
+pub use disabled::*;
+
+use bbq_steno::Stroke;
+use bbq_steno_macros::stroke;
+
+/// The stroke that dumps the statistics, which is never a real translation.
+pub const DUMP_STROKE: Stroke = stroke!("STKPWHRAO*EUFRPBLGTSDZ");
+
+/// The stages that are timed.
+#[derive(Clone, Copy)]
+pub enum Stage {
+    /// `Matrix::tick`, collecting the scan and debouncing it.
+    Scan,
+    /// Handling a single event in `event_task`.
+    Event,
+    /// Translating a stroke, with the dictionary lookups and the typer.
+    Lookup,
+    /// `UsbHandler::tick`, which sends the next report.
+    Usb,
+}
+
+/// The high-water marks that are tracked.
+#[derive(Clone, Copy)]
+pub enum Mark {
+    /// Events dropped because the event queue was full.  rtic-sync can't say
+    /// how full a channel is, so this counts instead.
+    EventDropped,
+    /// Entries in the USB key queue.
+    UsbKeys,
+    /// Bytes of heap in use.
+    Heap,
+}
+
+#[cfg(feature = "stats")]
+mod enabled {
+    use core::cell::RefCell;
+
+    use critical_section::Mutex;
+    use defmt::info;
+    use rtic_monotonics::rp2040::Timer;
+    use rtic_monotonics::Monotonic;
+
+    use super::{Mark, Stage};
+
+    pub const ENABLED: bool = true;
+
+    const STAGES: usize = 4;
+    const STAGE_NAMES: [&str; STAGES] = ["scan", "event", "lookup", "usb"];
+
+    const MARKS: usize = 3;
+    const MARK_NAMES: [&str; MARKS] = ["events dropped", "usb keys", "heap"];
+
+    /// Buckets of the histograms.  Bucket `n` counts times below `2**n` us,
+    /// and the last also counts anything longer.
+    const BUCKETS: usize = 16;
+
+    #[derive(Clone, Copy)]
+    struct Histogram {
+        buckets: [u32; BUCKETS],
+        count: u32,
+        max: u32,
+    }
+
+    impl Histogram {
+        const fn new() -> Histogram {
+            Histogram { buckets: [0; BUCKETS], count: 0, max: 0 }
+        }
+
+        fn add(&mut self, us: u32) {
+            let bucket = ((u32::BITS - us.leading_zeros()) as usize).min(BUCKETS - 1);
+            self.buckets[bucket] += 1;
+            self.count += 1;
+            self.max = self.max.max(us);
+        }
+
+        /// The bound below which the given percent of the times fall.
+        fn percentile(&self, pct: u32) -> u32 {
+            let target = (self.count * pct + 99) / 100;
+            let mut seen = 0;
+            for (bucket, &count) in self.buckets.iter().enumerate() {
+                seen += count;
+                if seen >= target {
+                    return 1 << bucket;
+                }
+            }
+            self.max
+        }
+    }
+
+    struct Stats {
+        stages: [Histogram; STAGES],
+        marks: [usize; MARKS],
+    }
+
+    // Core 1 can also record, so this needs the multicore critical section.
+    static STATS: Mutex<RefCell<Stats>> = Mutex::new(RefCell::new(Stats {
+        stages: [Histogram::new(); STAGES],
+        marks: [0; MARKS],
+    }));
+
+    /// The start of a timed stage.
+    pub struct Start(u64);
+
+    /// Start timing a stage.
+    pub fn start() -> Start {
+        Start(Timer::now().ticks())
+    }
+
+    impl Start {
+        /// Record the time since the start against the given stage.
+        pub fn end(self, stage: Stage) {
+            let us = (Timer::now().ticks() - self.0).min(u32::MAX as u64) as u32;
+            critical_section::with(|cs| {
+                STATS.borrow_ref_mut(cs).stages[stage as usize].add(us);
+            });
+        }
+    }
+
+    /// Raise a high-water mark to `value`.
+    pub fn mark(mark: Mark, value: usize) {
+        critical_section::with(|cs| {
+            let mut stats = STATS.borrow_ref_mut(cs);
+            let slot = &mut stats.marks[mark as usize];
+            *slot = (*slot).max(value);
+        });
+    }
+
+    /// Count an occurrence against a mark.
+    pub fn count(mark: Mark) {
+        critical_section::with(|cs| {
+            STATS.borrow_ref_mut(cs).marks[mark as usize] += 1;
+        });
+    }
+
+    /// Log everything collected so far.
+    pub fn dump() {
+        let (stages, marks) = critical_section::with(|cs| {
+            let stats = STATS.borrow_ref(cs);
+            (stats.stages, stats.marks)
+        });
+        for (name, hist) in STAGE_NAMES.iter().zip(stages.iter()) {
+            info!("{}: {} samples, p50 <{}us, p99 <{}us, max {}us, buckets {}",
+                  name, hist.count, hist.percentile(50), hist.percentile(99), hist.max,
+                  hist.buckets);
+        }
+        for (name, value) in MARK_NAMES.iter().zip(marks.iter()) {
+            info!("{}: {}", name, value);
+        }
+    }
+}
+
+#[cfg(not(feature = "stats"))]
+mod disabled {
+    use super::{Mark, Stage};
+
+    pub const ENABLED: bool = false;
+
+    pub struct Start;
+
+    #[inline(always)]
+    pub fn start() -> Start {
+        Start
+    }
+
+    impl Start {
+        #[inline(always)]
+        pub fn end(self, _stage: Stage) {}
+    }
+
+    #[inline(always)]
+    pub fn mark(_mark: Mark, _value: usize) {}
+
+    #[inline(always)]
+    pub fn count(_mark: Mark) {}
+
+    #[inline(always)]
+    pub fn dump() {}
+}
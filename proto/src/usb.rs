@@ -21,6 +21,8 @@ use usbd_human_interface_device::{
     UsbHidError,
 };
 
+use crate::stats::{self, Mark, Stage};
+
 // Type of the device list, which is internal to usbd_human_interface_device.
 type InterfaceList<'a, Bus> = HCons<NKROBootKeyboard<'a, Bus>, HNil>;
 
@@ -29,8 +31,15 @@ pub struct UsbHandler<'a, Bus: UsbBus> {
     hid: UsbHidClass<'a, Bus, InterfaceList<'a, Bus>>,
     state: Option<UsbDeviceState>,
     keys: ArrayDeque<KeyAction, 128>,
+    /// Keys left down from a run of typing, and their modifiers.
+    held: ArrayVec<Keyboard, HELD_MAX>,
+    held_mods: Mods,
 }
 
+/// The most keys held down at once while typing.  The boot keyboard report
+/// only has room for 6.
+const HELD_MAX: usize = 6;
+
 impl<'a, Bus: UsbBus> UsbHandler<'a, Bus> {
     pub fn new(usb_bus: &'a UsbBusAllocator<Bus>) -> Self {
         let keyboard = UsbHidClassBuilder::new()
@@ -50,9 +59,16 @@ impl<'a, Bus: UsbBus> UsbHandler<'a, Bus> {
             dev: usb_dev,
             state: None,
             keys: ArrayDeque::new(),
+            held: ArrayVec::new(),
+            held_mods: Mods::empty(),
         }
     }
 
+    /// Has the host not configured us, or put us to sleep?
+    pub fn is_suspended(&self) -> bool {
+        self.state != Some(UsbDeviceState::Configured)
+    }
+
     /// Add a sequence of events to be shipped off to the USB host.  If the
     /// deque is full, log a message, but discard.
     pub(crate) fn enqueue<I: Iterator<Item = KeyAction>>(&mut self, events: I) {
@@ -61,10 +77,12 @@ impl<'a, Bus: UsbBus> UsbHandler<'a, Bus> {
                 info!("Key event queue full.");
             }
         }
+        stats::mark(Mark::UsbKeys, self.keys.len());
     }
 
     /// Perform a 1khz tick operation.
     pub fn tick(&mut self) {
+        let start = stats::start();
         match self.hid.device().tick() {
             Ok(()) => (),
             Err(_) => {
@@ -72,75 +90,94 @@ impl<'a, Bus: UsbBus> UsbHandler<'a, Bus> {
             }
         }
 
-        // If we have keys to queue up, try to do that here.
-        if let Some(key) = self.keys.front() {
-            let mut keys = ArrayVec::<_, 5>::new();
-
-            // Capture all of the keys that should be down for this press.
-            let iter = match key {
-                KeyAction::KeyPress(k, m) => {
-                    if m.contains(Mods::SHIFT) {
-                        keys.push(Keyboard::LeftShift);
-                    }
-                    if m.contains(Mods::CONTROL) {
-                        keys.push(Keyboard::LeftControl);
-                    }
-                    if m.contains(Mods::ALT) {
-                        keys.push(Keyboard::LeftAlt);
-                    }
-                    if m.contains(Mods::GUI) {
-                        keys.push(Keyboard::LeftGUI);
-                    }
-                    keys.push(*k);
-                    None
-                }
-                KeyAction::ModOnly(m) => {
-                    // TODO: This doesn't need to be redundant like this.
-                    if m.contains(Mods::SHIFT) {
-                        keys.push(Keyboard::LeftShift);
-                    }
-                    if m.contains(Mods::CONTROL) {
-                        keys.push(Keyboard::LeftControl);
-                    }
-                    if m.contains(Mods::ALT) {
-                        keys.push(Keyboard::LeftAlt);
-                    }
-                    if m.contains(Mods::GUI) {
-                        keys.push(Keyboard::LeftGUI);
-                    }
-                    keys.push(Keyboard::NoEventIndicated);
-                    None
-                }
-                KeyAction::KeyRelease => {
-                    // Unclear if this is needed, or just empty is fine.
-                    keys.push(Keyboard::NoEventIndicated);
-                    None
-                }
-                KeyAction::KeySet(keys) => Some(keys.iter().cloned()),
-            };
-
-            let status = match iter {
-                None => self.hid.device().write_report(keys.iter().cloned()),
-                Some(iter) => self.hid.device().write_report(iter),
-            };
-            match status {
-                Ok(()) => {
-                    // Successful queue, so remove.
+        self.send_next();
+        start.end(Stage::Usb);
+    }
+
+    /// Send the next report, if there is anything to send.
+    ///
+    /// When typing, keys are left held down where possible, rather than
+    /// sending a release after each one.  A release directly followed by a
+    /// press of a different key with the same modifiers is skipped, and the
+    /// new key is added to those held, so each character needs a single
+    /// report.  The host types the key that is newly down.
+    fn send_next(&mut self) {
+        if let Some(KeyAction::KeyRelease) = self.keys.front() {
+            if let Some(KeyAction::KeyPress(k, m)) = self.keys.get(1) {
+                if self.can_hold(*k, *m) {
                     let _ = self.keys.pop_front();
                 }
-                Err(UsbHidError::WouldBlock) => (),
-                Err(UsbHidError::Duplicate) => {
-                    warn!("Duplicate key seen");
-                    // Duplicate keys should also unqueue.  This shouldn't
-                    // happen, but don't get stuck in a queue loop if it does.
-                    let _ = self.keys.pop_front();
+            }
+        }
+
+        let key = match self.keys.front() {
+            Some(key) => key,
+            None => return,
+        };
+
+        // The keys held after this report.
+        let mut held = ArrayVec::new();
+        let mut held_mods = Mods::empty();
+        let mut keys = ArrayVec::<_, { 4 + HELD_MAX }>::new();
+
+        // Capture all of the keys that should be down for this press.
+        let iter = match key {
+            KeyAction::KeyPress(k, m) => {
+                if self.can_hold(*k, *m) {
+                    held = self.held.clone();
                 }
-                Err(UsbHidError::UsbError(_)) => warn!("USB error"),
-                Err(UsbHidError::SerializationError) => warn!("SerializationError"),
+                held.push(*k);
+                held_mods = *m;
+                push_mods(&mut keys, *m);
+                keys.extend(held.iter().cloned());
+                None
+            }
+            KeyAction::ModOnly(m) => {
+                push_mods(&mut keys, *m);
+                keys.push(Keyboard::NoEventIndicated);
+                None
             }
+            KeyAction::KeyRelease => {
+                // Unclear if this is needed, or just empty is fine.
+                keys.push(Keyboard::NoEventIndicated);
+                None
+            }
+            KeyAction::KeySet(keys) => Some(keys.iter().cloned()),
+        };
+
+        let status = match iter {
+            None => self.hid.device().write_report(keys.iter().cloned()),
+            Some(iter) => self.hid.device().write_report(iter),
+        };
+        match status {
+            Ok(()) => {
+                // Successful queue, so remove.
+                let _ = self.keys.pop_front();
+                self.held = held;
+                self.held_mods = held_mods;
+            }
+            Err(UsbHidError::WouldBlock) => (),
+            Err(UsbHidError::Duplicate) => {
+                warn!("Duplicate key seen");
+                // Duplicate keys should also unqueue.  This shouldn't
+                // happen, but don't get stuck in a queue loop if it does.
+                let _ = self.keys.pop_front();
+                self.held = held;
+                self.held_mods = held_mods;
+            }
+            Err(UsbHidError::UsbError(_)) => warn!("USB error"),
+            Err(UsbHidError::SerializationError) => warn!("SerializationError"),
         }
     }
 
+    /// Can this press be added to the keys already held down?
+    fn can_hold(&self, key: Keyboard, mods: Mods) -> bool {
+        !self.held.is_empty()
+            && !self.held.is_full()
+            && mods == self.held_mods
+            && !self.held.contains(&key)
+    }
+
     /// Perform a periodic poll.  Ideally, this would be interrupt driven, but
     /// calling sufficiently fast should also work.
     /// The docs suggest this can be called on say a 1ms tick, but this seems to
@@ -155,6 +192,12 @@ impl<'a, Bus: UsbBus> UsbHandler<'a, Bus> {
                 Ok(l) => info!("Report: {}", l.caps_lock),
                 _ => (),
             }
+
+            // The host may have taken the last report, so there could be
+            // room for the next one, without waiting for the tick.
+            if !self.keys.is_empty() {
+                self.send_next();
+            }
         }
 
         // Check for state changes.
@@ -174,11 +217,28 @@ impl<'a, Bus: UsbBus> UsbHandler<'a, Bus> {
             self.state = Some(new_state);
             if events.try_send(Event::UsbState(new_state)).is_err() {
                 warn!("USB IRQ: Event queue full");
+                stats::count(Mark::EventDropped);
             }
         }
     }
 }
 
+/// Add the keys for a set of modifiers to a report.
+fn push_mods<const N: usize>(keys: &mut ArrayVec<Keyboard, N>, mods: Mods) {
+    if mods.contains(Mods::SHIFT) {
+        keys.push(Keyboard::LeftShift);
+    }
+    if mods.contains(Mods::CONTROL) {
+        keys.push(Keyboard::LeftControl);
+    }
+    if mods.contains(Mods::ALT) {
+        keys.push(Keyboard::LeftAlt);
+    }
+    if mods.contains(Mods::GUI) {
+        keys.push(Keyboard::LeftGUI);
+    }
+}
+
 /// The remote wakeup is only available for this specific hal.
 impl<'a> UsbHandler<'a, sparkfun_pro_micro_rp2040::hal::usb::UsbBus> {
     /// Inform the host that we'd like to request they wake up.  This should be
@@ -1,7 +1,7 @@
 use std::{
     collections::BTreeMap,
     fs::File,
-    io::{stdin, stdout, Write}, rc::Rc,
+    io::{stdin, stdout, Write},
 };
 
 use anyhow::Result;
@@ -33,7 +33,7 @@ fn main() -> Result<()> {
                 xlat.add(stroke);
                 xlat.show();
                 while let Some(action) = xlat.next_action() {
-                    writeln!(stdout, ">>> Delete {} type: {:?}", action.remove, action.text)?;
+                    writeln!(stdout, ">>> Delete {} type: {:?}", action.remove, action.to_string())?;
                 }
                 stdout.activate_raw_mode()?;
             } else {
@@ -51,13 +51,20 @@ fn main() -> Result<()> {
     Ok(())
 }
 
-fn load_dict() -> Result<Rc<RamDict>> {
-    let data: BTreeMap<String, String> =
-        serde_json::from_reader(File::open("../dict-convert/lapwing-base.json")?)?;
+/// Load the dictionaries given on the command line, merged into one, with the
+/// later ones taking priority.
+fn load_dict() -> Result<&'static RamDict> {
+    let mut paths: Vec<String> = std::env::args().skip(1).collect();
+    if paths.is_empty() {
+        paths.push("../dict-convert/lapwing-base.json".to_string());
+    }
     let mut builder = MapDictBuilder::new();
-    for (k, v) in data {
-        let k = StenoWord::parse(&k)?;
-        builder.insert(k.0, v);
+    for path in paths {
+        let data: BTreeMap<String, String> = serde_json::from_reader(File::open(path)?)?;
+        for (k, v) in data {
+            let k = StenoWord::parse(&k)?;
+            builder.insert(k.0, v);
+        }
     }
-    Ok(Rc::new(builder.into_ram_dict()))
+    Ok(Box::leak(Box::new(builder.into_ram_dict())))
 }